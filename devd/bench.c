@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * devd can run a client in its own process that reaches it through the
+ * loopback msg transport.  This drives the full stacks, from the
+ * client's transactions through btr-msg and messaging to devd's
+ * receive handling and its device, without a network between them.
+ *
+ * The client makes a new file system, creates inodes in batches and
+ * syncs them, reads each inode back, and then unlinks them in batches
+ * so that the device can be benchmarked again.  The time taken by each
+ * phase is logged.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "shared/lk/byteorder.h"
+#include "shared/lk/list.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/time64.h"
+#include "shared/lk/timekeeping.h"
+#include "shared/lk/types.h"
+
+#include "shared/block.h"
+#include "shared/btr-msg.h"
+#include "shared/format-block.h"
+#include "shared/log.h"
+#include "shared/manifest.h"
+#include "shared/mount.h"
+#include "shared/msg.h"
+#include "shared/mtr-loop.h"
+#include "shared/pfs.h"
+#include "shared/txn.h"
+
+#include "devd/bench.h"
+
+/* the number of inode ops given to each pfs batch */
+#define BENCH_BATCH	256
+
+static int bench_mkfs(struct ngnfs_fs_info *nfi)
+{
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	int ret;
+
+	ret = ngnfs_pfs_mkfs(nfi, &txn, NGNFS_ROOT_INO, ktime_get_real_ns());
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret ?: ngnfs_block_sync(nfi);
+}
+
+/*
+ * Perform the op on each of the bench inodes in batches and sync.
+ */
+static int bench_batch(struct ngnfs_fs_info *nfi, u64 nr, u8 type)
+{
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	struct ngnfs_inode ninode = {
+		.gen = cpu_to_le64(1),
+		.nlink = cpu_to_le32(1),
+		.mode = cpu_to_le32(0644),
+	};
+	struct ngnfs_pfs_op *ops;
+	unsigned int n;
+	unsigned int i;
+	u64 ino;
+	int ret = 0;
+
+	ops = calloc(BENCH_BATCH, sizeof(ops[0]));
+	if (!ops)
+		return -ENOMEM;
+
+	for (ino = NGNFS_ROOT_INO + 1; ino <= NGNFS_ROOT_INO + nr; ino += n) {
+		n = min((u64)BENCH_BATCH, NGNFS_ROOT_INO + nr + 1 - ino);
+
+		for (i = 0; i < n; i++) {
+			ops[i].ino = ino + i;
+			ops[i].ninode = &ninode;
+			ops[i].type = type;
+		}
+
+		ret = ngnfs_pfs_batch(nfi, &txn, ops, n);
+		for (i = 0; i < n && ret == 0; i++)
+			ret = ops[i].ret;
+		if (ret < 0)
+			break;
+	}
+
+	ngnfs_txn_destroy(nfi, &txn);
+	free(ops);
+
+	return ret ?: ngnfs_block_sync(nfi);
+}
+
+static int bench_read(struct ngnfs_fs_info *nfi, u64 nr)
+{
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	struct ngnfs_inode ninode;
+	u64 ino;
+	int ret;
+
+	for (ino = NGNFS_ROOT_INO + 1; ino <= NGNFS_ROOT_INO + nr; ino++) {
+		ret = ngnfs_pfs_read_inode(nfi, &txn, ino, &ninode, sizeof(ninode));
+		ngnfs_txn_reset(nfi, &txn);
+		if (ret >= 0 && (ret != sizeof(ninode) || le64_to_cpu(ninode.ino) != ino))
+			ret = -EIO;
+		if (ret < 0)
+			break;
+	}
+
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Mount a client of the devd listening on the loopback address and
+ * run the benchmark with nr inodes.
+ */
+int devd_bench(struct sockaddr_in *addr, u64 nr)
+{
+	struct ngnfs_fs_info nfi = INIT_NGNFS_FS_INFO;
+	struct ngnfs_manifest_addr_head ahead = { .addr = *addr, };
+	LIST_HEAD(addr_list);
+	u64 created_ns;
+	u64 read_ns;
+	u64 start_ns;
+	int ret;
+
+	list_add_tail(&ahead.head, &addr_list);
+
+	ret = ngnfs_manifest_setup(&nfi, &addr_list, 1, NULL) ?:
+	      ngnfs_msg_setup(&nfi, &ngnfs_mtr_loop_ops, NULL, NULL) ?:
+	      ngnfs_block_setup(&nfi, &ngnfs_btr_msg_ops, NULL) ?:
+	      bench_mkfs(&nfi);
+	if (ret < 0)
+		goto out;
+
+	start_ns = ktime_get_ns();
+	ret = bench_batch(&nfi, nr, NGNFS_PFS_OP_CREATE);
+	if (ret < 0)
+		goto out;
+
+	created_ns = ktime_get_ns();
+	ret = bench_read(&nfi, nr);
+	if (ret < 0)
+		goto out;
+
+	read_ns = ktime_get_ns();
+	ret = bench_batch(&nfi, nr, NGNFS_PFS_OP_UNLINK);
+	if (ret < 0)
+		goto out;
+
+	log("bench %llu inodes: created in %llu usecs, read in %llu usecs, unlinked in %llu usecs",
+	    nr, (created_ns - start_ns) / NSEC_PER_USEC, (read_ns - created_ns) / NSEC_PER_USEC,
+	    (ktime_get_ns() - read_ns) / NSEC_PER_USEC);
+out:
+	if (ret < 0)
+		log("bench error: "ENOF, ENOA(-ret));
+
+	ngnfs_unmount(&nfi);
+	return ret;
+}
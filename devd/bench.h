@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_DEVD_BENCH_H
+#define NGNFS_DEVD_BENCH_H
+
+#include <netinet/in.h>
+
+#include "shared/lk/types.h"
+
+int devd_bench(struct sockaddr_in *addr, u64 nr);
+
+#endif
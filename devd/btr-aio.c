@@ -54,6 +54,7 @@ struct btr_aio_info {
 	aio_context_t ctx;
 	unsigned int queue_depth;
 	int dev_fd;
+	bool shutdown;
 
 	struct thread submit_thr;
 	struct thread getevents_thr;
@@ -98,6 +99,7 @@ static inline struct iocb *get_and_clear_iocb_bit(struct btr_aio_info *ainf, uns
 			continue;
 		}
 		iocb = &ainf->iocbs[nr];
+		break;
 	}
 
 	return iocb;
@@ -124,6 +126,8 @@ static void getevents_thread(struct thread *thr, void *arg)
 
 		ret = syscall(__NR_io_getevents, ainf->ctx, 1, ainf->queue_depth,
 			      ainf->events, NULL);
+		if (ret < 0 && thread_should_return(thr))
+			break;
 		assert(ret > 0);
 		nr = ret;
 
@@ -133,6 +137,10 @@ static void getevents_thread(struct thread *thr, void *arg)
 			iocb = (struct iocb *)event->obj;
 			bnr = iocb->aio_offset >> NGNFS_BLOCK_SHIFT;
 
+			/* end_io can submit more blocks which need empty iocbs */
+			cmm_mb(); /* load iocb fields before storing empty bit */
+			set_iocb_bit(ainf, iocb, &ainf->empty_bmap);
+
 			if (event->res == NGNFS_BLOCK_SIZE)
 				err = 0;
 			else if (event->res < 0)
@@ -142,9 +150,6 @@ static void getevents_thread(struct thread *thr, void *arg)
 
 			ngnfs_block_end_io(ainf->nfi, bnr, data_page, err);
 			put_page(data_page);
-
-			cmm_mb(); /* load iocb fields before storing empty bit */
-			set_iocb_bit(ainf, iocb, &ainf->empty_bmap);
 		}
 	}
 }
@@ -284,12 +289,19 @@ out:
 	return ainf;
 }
 
-static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
+/*
+ * Stop completing IO before the block cache destroys its work queue,
+ * completions can queue more work.  Destroying the context waits for
+ * in-flight IO and discards their completions.  Blocks submitted after
+ * this are never sent.
+ */
+static void btr_aio_shutdown(struct ngnfs_fs_info *nfi, void *btr_info)
 {
 	struct btr_aio_info *ainf = btr_info;
 
-	if (IS_ERR_OR_NULL(ainf))
+	if (IS_ERR_OR_NULL(ainf) || ainf->shutdown)
 		return;
+	ainf->shutdown = true;
 
 	thread_stop_indicate(&ainf->submit_thr);
 	thread_stop_indicate(&ainf->getevents_thr);
@@ -304,6 +316,16 @@ static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 
 	thread_stop_wait(&ainf->submit_thr);
 	thread_stop_wait(&ainf->getevents_thr);
+}
+
+static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_aio_info *ainf = btr_info;
+
+	if (IS_ERR_OR_NULL(ainf))
+		return;
+
+	btr_aio_shutdown(nfi, ainf);
 
 	if (ainf->dev_fd >= 0)
 		close(ainf->dev_fd);
@@ -316,6 +338,7 @@ static void btr_aio_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 
 struct ngnfs_block_transport_ops ngnfs_btr_aio_ops = {
 	.setup = btr_aio_setup,
+	.shutdown = btr_aio_shutdown,
 	.destroy = btr_aio_destroy,
 	.queue_depth = btr_aio_queue_depth,
 	.submit_block = btr_aio_submit_block,
@@ -0,0 +1,276 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * devd maps the fs block numbers that it's sent to the block numbers
+ * of the blocks on its device that store them.  Devices only need to
+ * be large enough to store the blocks that have been written to them
+ * rather than the entire fs block space.
+ *
+ * The mapping is stored in a btree on the device whose items are keyed
+ * by the big-endian fs block number and contain the device block
+ * number.  Device blocks are allocated in the order that fs blocks are
+ * first written so blocks written together are laid out sequentially
+ * on the device.  Once mapped, fs blocks are overwritten in place.
+ * There's no message for freeing fs blocks so mappings are never
+ * removed.
+ *
+ * The first device block is a super block that records the end of the
+ * range of device blocks that have been reserved for allocation.
+ * Reservations are persistent before their blocks are used so we never
+ * reallocate a device block after a crash, at the cost of leaking the
+ * rest of the reservation.
+ *
+ * Lookups walk the tree without locking.  Insertions are serialized by
+ * a mutex which also protects the allocator.
+ */
+
+#include "shared/lk/bug.h"
+#include "shared/lk/byteorder.h"
+#include "shared/lk/err.h"
+#include "shared/lk/errno.h"
+#include "shared/lk/gfp.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/types.h"
+
+#include "shared/block.h"
+#include "shared/btree.h"
+#include "shared/format-block.h"
+#include "shared/tree.h"
+#include "shared/txn.h"
+
+#include "devd/map.h"
+
+#define MAP_SUPER_BNR		0
+#define MAP_ROOT_BNR		1
+#define MAP_FIRST_BNR		2
+
+#define MAP_SUPER_KEY_RESERVED	1
+
+/* extend the reservation by this many blocks at a time */
+#define MAP_RESERVE_BLOCKS	1024
+/* more than enough for a data block and an insertion's restructuring */
+#define MAP_INSERT_BLOCKS	(1 + (2 * NGNFS_TREE_MAX_HEIGHT))
+
+struct devd_map_info {
+	struct mutex mutex;
+	u64 next_bnr;
+	u64 reserved;
+	struct ngnfs_tree_root root;
+	struct page *zero_page;
+};
+
+/*
+ * Called by tree walks during insertion with the mutex held.
+ */
+static int map_alloc(struct ngnfs_fs_info *nfi, void *arg, u64 *bnr)
+{
+	struct devd_map_info *minf = arg;
+
+	if (minf->next_bnr == minf->reserved)
+		return -ENOSPC;
+
+	*bnr = minf->next_bnr++;
+	return 0;
+}
+
+/*
+ * Only failed restructuring frees blocks, we can give them back if
+ * they were the most recent allocation.
+ */
+static void map_free(struct ngnfs_fs_info *nfi, void *arg, u64 bnr)
+{
+	struct devd_map_info *minf = arg;
+
+	if (bnr + 1 == minf->next_bnr)
+		minf->next_bnr--;
+}
+
+int devd_map_lookup(struct ngnfs_fs_info *nfi, u64 bnr, u64 *dev_bnr)
+{
+	struct devd_map_info *minf = nfi->map_info;
+	__be64 key = cpu_to_be64(bnr);
+	__le64 val;
+	int ret;
+
+	ret = ngnfs_tree_lookup(nfi, &minf->root, &key, sizeof(key), &val, sizeof(val));
+	if (ret == sizeof(val)) {
+		*dev_bnr = le64_to_cpu(val);
+		ret = 0;
+	} else if (ret >= 0) {
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+static void commit_super(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			 struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	u8 key = MAP_SUPER_KEY_RESERVED;
+	__le64 *reserved = arg;
+	int ret;
+
+	ret = ngnfs_btree_update(bt, &key, sizeof(key), reserved, sizeof(*reserved));
+	if (ret == -ENOENT) {
+		ngnfs_btree_init_block(bt, 0, 0);
+		ret = ngnfs_btree_insert(bt, &key, sizeof(key), reserved, sizeof(*reserved));
+	}
+	BUG_ON(ret != 0);
+}
+
+/*
+ * Persistently record the end of the allocation reservation before its
+ * blocks can be used.
+ */
+static int write_super(struct ngnfs_fs_info *nfi, u64 reserved)
+{
+	struct ngnfs_transaction txn = INIT_NGNFS_TXN(txn);
+	__le64 le_reserved = cpu_to_le64(reserved);
+	int ret;
+
+	ret = ngnfs_txn_add_block(nfi, &txn, MAP_SUPER_BNR, NBF_WRITE, NULL, commit_super,
+				  &le_reserved) ?:
+	      ngnfs_txn_execute(nfi, &txn);
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret ?: ngnfs_block_sync(nfi);
+}
+
+/*
+ * Map the fs block number to a newly allocated device block, returning
+ * the existing mapping if another writer got there first.  Callers
+ * sync the new mapping along with their write of the device block.
+ */
+int devd_map_insert(struct ngnfs_fs_info *nfi, u64 bnr, u64 *dev_bnr)
+{
+	struct devd_map_info *minf = nfi->map_info;
+	__be64 key = cpu_to_be64(bnr);
+	__le64 val;
+	u64 reserved;
+	int ret;
+
+	mutex_lock(&minf->mutex);
+
+	ret = devd_map_lookup(nfi, bnr, dev_bnr);
+	if (ret != -ENOENT)
+		goto out;
+
+	if (minf->reserved - minf->next_bnr < MAP_INSERT_BLOCKS) {
+		reserved = minf->next_bnr + MAP_RESERVE_BLOCKS;
+		ret = write_super(nfi, reserved);
+		if (ret < 0)
+			goto out;
+		minf->reserved = reserved;
+	}
+
+	*dev_bnr = minf->next_bnr++;
+	val = cpu_to_le64(*dev_bnr);
+	ret = ngnfs_tree_insert(nfi, &minf->root, &key, sizeof(key), &val, sizeof(val));
+	if (ret < 0)
+		map_free(nfi, minf, *dev_bnr);
+out:
+	mutex_unlock(&minf->mutex);
+	return ret;
+}
+
+/*
+ * Reads of fs blocks that haven't been written are given zeros, as
+ * they would be if they were read from an unwritten device.
+ */
+struct page *devd_map_zero_page(struct ngnfs_fs_info *nfi)
+{
+	struct devd_map_info *minf = nfi->map_info;
+
+	return minf->zero_page;
+}
+
+/*
+ * Read the super to find the end of the previous reservation, or
+ * initialize the super and mapping tree if the device has never been
+ * written.  We always start allocating from the end of the previous
+ * reservation.
+ */
+static int read_super(struct ngnfs_fs_info *nfi, struct devd_map_info *minf)
+{
+	struct ngnfs_btree_block *bt;
+	u8 key = MAP_SUPER_KEY_RESERVED;
+	struct ngnfs_block *bl;
+	__le64 reserved;
+	bool fresh;
+	int ret;
+
+	bl = ngnfs_block_get(nfi, MAP_SUPER_BNR, NBF_READ);
+	if (IS_ERR(bl))
+		return PTR_ERR(bl);
+
+	bt = ngnfs_block_buf(bl);
+	ret = ngnfs_btree_lookup(bt, &key, sizeof(key), &reserved, sizeof(reserved));
+	fresh = ret == -ENOENT && bt->nr_items == 0;
+	ngnfs_block_put(bl);
+
+	if (fresh) {
+		minf->next_bnr = MAP_FIRST_BNR;
+		return ngnfs_tree_create(nfi, &minf->root) ?:
+		       write_super(nfi, minf->next_bnr);
+	}
+
+	if (ret != sizeof(reserved))
+		return -EIO;
+
+	minf->next_bnr = le64_to_cpu(reserved);
+	return 0;
+}
+
+int devd_map_setup(struct ngnfs_fs_info *nfi)
+{
+	struct devd_map_info *minf;
+	int ret;
+
+	minf = kzalloc(sizeof(struct devd_map_info), GFP_NOFS);
+	if (!minf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_init(&minf->mutex);
+	minf->root.bnr = MAP_ROOT_BNR;
+	minf->root.alloc = map_alloc;
+	minf->root.free = map_free;
+	minf->root.arg = minf;
+	minf->root.block_flags = NGNFS_BTREE_FLAG_KEY8;
+
+	minf->zero_page = alloc_page(GFP_NOFS | __GFP_ZERO);
+	if (!minf->zero_page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = read_super(nfi, minf);
+	if (ret < 0)
+		goto out;
+
+	minf->reserved = minf->next_bnr;
+	nfi->map_info = minf;
+	ret = 0;
+out:
+	if (ret < 0 && minf) {
+		if (minf->zero_page)
+			put_page(minf->zero_page);
+		kfree(minf);
+	}
+
+	return ret;
+}
+
+void devd_map_destroy(struct ngnfs_fs_info *nfi)
+{
+	struct devd_map_info *minf = nfi->map_info;
+
+	if (minf) {
+		put_page(minf->zero_page);
+		kfree(minf);
+		nfi->map_info = NULL;
+	}
+}
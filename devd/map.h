@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_DEVD_MAP_H
+#define NGNFS_DEVD_MAP_H
+
+#include "shared/lk/gfp.h"
+#include "shared/lk/types.h"
+
+#include "shared/fs_info.h"
+
+int devd_map_lookup(struct ngnfs_fs_info *nfi, u64 bnr, u64 *dev_bnr);
+int devd_map_insert(struct ngnfs_fs_info *nfi, u64 bnr, u64 *dev_bnr);
+struct page *devd_map_zero_page(struct ngnfs_fs_info *nfi);
+
+int devd_map_setup(struct ngnfs_fs_info *nfi);
+void devd_map_destroy(struct ngnfs_fs_info *nfi);
+
+#endif
@@ -18,8 +18,11 @@
 #include "shared/block.h"
 #include "shared/lk/err.h"
 #include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
 #include "shared/log.h"
 #include "shared/msg.h"
+#include "shared/mtr-loop.h"
+#include "shared/mtr-shm.h"
 #include "shared/mtr-socket.h"
 #include "shared/nerr.h"
 #include "shared/options.h"
@@ -29,14 +32,22 @@
 
 #include "devd/recv.h"
 #include "devd/btr-aio.h"
+#include "devd/bench.h"
+#include "devd/map.h"
 
 struct devd_options {
 	char *dev_path;
 	struct sockaddr_in listen_addr;
 	char *trace_path;
+	struct ngnfs_msg_transport_ops *mtr_ops;
+	u64 bench_nr;
 };
 
 static struct option_more devd_moreopts[] = {
+	{ .longopt = { "bench", required_argument, NULL, 'b' },
+	  .arg = "nr",
+	  .desc = "run a client with nr inodes in this process over the loopback transport, then exit", },
+
 	{ .longopt = { "device_path", required_argument, NULL, 'd' },
 	  .arg = "path",
 	  .desc = "path to block device",
@@ -47,6 +58,9 @@ static struct option_more devd_moreopts[] = {
 	  .desc = "listening IPv4 address and port",
 	  .required = 1, },
 
+	{ .longopt = { "shm", no_argument, NULL, 's' },
+	  .desc = "also accept shared memory connections from the same host", },
+
 	{ .longopt = { "trace_file", required_argument, NULL, 't' },
 	  .arg = "file_path",
 	  .desc = "append debugging traces to this file",
@@ -56,15 +70,28 @@ static struct option_more devd_moreopts[] = {
 static int parse_devd_opt(int c, char *str, void *arg)
 {
 	struct devd_options *opts = arg;
+	unsigned long long ull;
 	int ret = -EINVAL;
 
 	switch(c) {
+	case 'b':
+		ret = parse_ull(&ull, str, 1, U32_MAX);
+		if (ret < 0) {
+			log("error parsing -b bench inode count");
+			break;
+		}
+		opts->bench_nr = ull;
+		break;
 	case 'd':
 		ret = strdup_nerr(&opts->dev_path, str);
 		break;
 	case 'l':
 		ret = parse_ipv4_addr_port(&opts->listen_addr, str);
 		break;
+	case 's':
+		opts->mtr_ops = &ngnfs_mtr_shm_ops;
+		ret = 0;
+		break;
 	case 't':
 		ret = strdup_nerr(&opts->trace_path, str);
 		break;
@@ -76,7 +103,7 @@ static int parse_devd_opt(int c, char *str, void *arg)
 int main(int argc, char **argv)
 {
 	struct ngnfs_fs_info nfi = INIT_NGNFS_FS_INFO;
-	struct devd_options opts = { };
+	struct devd_options opts = { .mtr_ops = &ngnfs_mtr_socket_ops, };
 	int ret;
 
 	ret = getopt_long_more(argc, argv, devd_moreopts, ARRAY_SIZE(devd_moreopts),
@@ -84,17 +111,23 @@ int main(int argc, char **argv)
 	if (ret < 0)
 		goto out;
 
+	/* the bench client can only reach us in this process */
+	if (opts.bench_nr)
+		opts.mtr_ops = &ngnfs_mtr_loop_ops;
+
 	ret = thread_prepare_main();
 	if (ret < 0)
 		goto out;
 
 	ret = trace_setup(opts.trace_path) ?:
-	      ngnfs_msg_setup(&nfi, &ngnfs_mtr_socket_ops, NULL, &opts.listen_addr) ?:
+	      ngnfs_msg_setup(&nfi, opts.mtr_ops, NULL, &opts.listen_addr) ?:
 	      ngnfs_block_setup(&nfi, &ngnfs_btr_aio_ops, opts.dev_path) ?:
+	      devd_map_setup(&nfi) ?:
 	      devd_recv_setup(&nfi) ?:
-	      thread_sigwait();
+	      (opts.bench_nr ? devd_bench(&opts.listen_addr, opts.bench_nr) : thread_sigwait());
 
 	devd_recv_destroy(&nfi);
+	devd_map_destroy(&nfi);
 	ngnfs_block_destroy(&nfi);
 	ngnfs_msg_destroy(&nfi);
 
@@ -15,6 +15,7 @@
 #include "shared/msg.h"
 #include "shared/txn.h"
 
+#include "devd/map.h"
 #include "devd/recv.h"
 
 static int devd_get_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
@@ -22,7 +23,8 @@ static int devd_get_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdes
 	struct ngnfs_msg_get_block *gb = mdesc->ctl_buf;
 	struct ngnfs_msg_get_block_result res;
 	struct ngnfs_msg_desc res_mdesc;
-	struct ngnfs_block *bl;
+	struct ngnfs_block *bl = NULL;
+	u64 dev_bnr;
 	int ret;
 
 	if ((mdesc->ctl_size != sizeof(struct ngnfs_msg_get_block)) ||
@@ -30,28 +32,32 @@ static int devd_get_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdes
 	    (mdesc->data_size != 0))
 		return -EINVAL;
 
-	/* XXX there'd be fs bnr -> dev bnr mapping */
-	/* XXX that'd catch invalid bnr's coming in? */
-
-	bl = ngnfs_block_get(nfi, le64_to_cpu(gb->bnr), NBF_READ);
-	if (IS_ERR(bl))
-		ret = PTR_ERR(bl);
-	else
+	ret = devd_map_lookup(nfi, le64_to_cpu(gb->bnr), &dev_bnr);
+	if (ret == 0) {
+		bl = ngnfs_block_get(nfi, dev_bnr, NBF_READ);
+		if (IS_ERR(bl)) {
+			ret = PTR_ERR(bl);
+			bl = NULL;
+		}
+	} else if (ret == -ENOENT) {
 		ret = 0;
+	}
 
 	res.bnr = gb->bnr;
+	res.id = gb->id;
 	res.access = gb->access;
 	res.err = ngnfs_msg_err(ret);
 
 	res_mdesc.type = NGNFS_MSG_GET_BLOCK_RESULT;
 	res_mdesc.addr = mdesc->addr;
+	res_mdesc.steer = le64_to_cpu(gb->bnr);
 	res_mdesc.ctl_buf = &res;
 	res_mdesc.ctl_size = sizeof(res);
 	if (ret < 0) {
 		res_mdesc.data_page = NULL;
 		res_mdesc.data_size = 0;
 	} else {
-		res_mdesc.data_page = ngnfs_block_page(bl);
+		res_mdesc.data_page = bl ? ngnfs_block_page(bl) : devd_map_zero_page(nfi);
 		res_mdesc.data_size = NGNFS_BLOCK_SIZE;
 	}
 
@@ -79,6 +85,7 @@ static int devd_write_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *md
 	struct ngnfs_msg_write_block *wb = mdesc->ctl_buf;
 	struct ngnfs_msg_write_block_result res;
 	struct ngnfs_msg_desc res_mdesc;
+	u64 dev_bnr;
 	int ret;
 
 	/* XXX errors that shutdown the session? */
@@ -89,19 +96,26 @@ static int devd_write_block(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *md
 		goto out;
 	}
 
-	/* XXX there'd be fs bnr -> dev bnr mapping */
-
-	ret = ngnfs_txn_add_block(nfi, &txn, le64_to_cpu(wb->bnr), NBF_NEW | NBF_WRITE,
-				  NULL, commit_write_block, mdesc->data_page) ?:
-	      ngnfs_txn_execute(nfi, &txn);
+	/* a new mapping is synced with the block */
+	ret = devd_map_lookup(nfi, le64_to_cpu(wb->bnr), &dev_bnr);
+	if (ret == -ENOENT)
+		ret = devd_map_insert(nfi, le64_to_cpu(wb->bnr), &dev_bnr);
+	if (ret == 0) {
+		ret = ngnfs_txn_add_block(nfi, &txn, dev_bnr, NBF_NEW | NBF_WRITE,
+					  NULL, commit_write_block, mdesc->data_page) ?:
+		      ngnfs_txn_execute(nfi, &txn);
+		ngnfs_txn_destroy(nfi, &txn);
+	}
 	if (ret == 0)
 		ret = ngnfs_block_sync(nfi);
 
 	res.bnr = wb->bnr;
+	res.id = wb->id;
 	res.err = ngnfs_msg_err(ret);
 
 	res_mdesc.type = NGNFS_MSG_WRITE_BLOCK_RESULT;
 	res_mdesc.addr = mdesc->addr;
+	res_mdesc.steer = le64_to_cpu(wb->bnr);
 	res_mdesc.ctl_buf = &res;
 	res_mdesc.ctl_size = sizeof(res);
 	res_mdesc.data_page = NULL;
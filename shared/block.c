@@ -15,13 +15,36 @@
  *
  * Writeback is performed in terms of sets, in the order that they were
  * initially dirtied.  Background memory pressure or explicit cache sync
- * operations can trigger writeback.
+ * operations can trigger writeback.  Dirtying callers can attach
+ * notifications to a set which are called once its writeback finishes.
+ *
+ * Blocks are protected by a crc which is calculated as dirty blocks are
+ * submitted for writeback and verified, along with the btree block
+ * structure, as reads complete.  Cache hits on uptodate blocks don't
+ * re-verify.
+ *
+ * Each block has a sequence number that is odd while its contents are
+ * being modified.  Readers can copy an uptodate cached block without
+ * acquiring a reference and use the copy if the sequence number didn't
+ * change while they were working.  Anything that changes the contents
+ * of an uptodate block, or removes it from the cache, must increment
+ * the sequence number around the change.
+ *
+ * Write references are exclusive, only one writer can hold a block at a
+ * time.  Read references are shared and don't exclude writers.  Readers
+ * bracket their use of a block's contents with _read_begin and
+ * _read_end.  Writers only wait for those brief read sections to drain
+ * as they start modifying blocks in _dirty_begin, and readers only wait
+ * while blocks are being modified, never while writers are preparing.
+ * Readers of multiple blocks can use the sequence numbers to check that
+ * they saw a consistent view.
+ *
+ * Parent blocks keep an array of their item key prefixes for searches.
+ * It's built by the first search after the block is modified and is
+ * only used while the block's sequence number matches the one it was
+ * built at.
  *
  * XXX:
- *  - This doesn't yet support exclusive read and write references.
- *    Some callers won't have serialization of operations do we'll be
- *    implementing serialization down in the blocks.  If it works out,
- *    anyway.
  *  - We'll need some form of shrinking.  We'll want some form of access
  *    marking so that we don't throw away recently used blocks without
  *    also creating a ton of contention.
@@ -32,7 +55,9 @@
 #include "shared/lk/bitops.h"
 #include "shared/lk/bug.h"
 #include "shared/lk/build_bug.h"
+#include "shared/lk/byteorder.h"
 #include "shared/lk/cmpxchg.h"
+#include "shared/lk/crc32c.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/gfp.h"
@@ -42,12 +67,14 @@
 #include "shared/lk/processor.h"
 #include "shared/lk/rcupdate.h"
 #include "shared/lk/rhashtable.h"
+#include "shared/lk/rwonce.h"
 #include "shared/lk/wait.h"
 #include "shared/lk/workqueue.h"
 
 #include "shared/format-block.h"
 #include "shared/fs_info.h"
 #include "shared/block.h"
+#include "shared/btree.h"
 #include "shared/urcu.h"
 #include "shared/trace.h"
 
@@ -114,10 +141,12 @@ struct ngnfs_block_set {
 	struct llist_node writeback_llnode;
 	struct list_head writeback_head;
 	struct list_head block_list;
+	struct list_head notify_list;
 	wait_queue_head_t waitq;
 	u64 dirty_seq;
 	unsigned long bits; /* SET_ set bits */
 	unsigned size;
+	int error; /* first write error, given to notifiers */
 };
 
 enum {
@@ -149,9 +178,13 @@ struct ngnfs_block {
 	struct list_head set_head;
 	wait_queue_head_t waitq;
 	unsigned long bits; /* BL_ block bits */
+	unsigned long seq;
+	atomic_t readers;
 	int error;
 	struct page *page;
 	u64 bnr;
+	struct ngnfs_btree_prefixes *prefixes;
+	unsigned long prefixes_seq;
 };
 
 enum {
@@ -167,17 +200,41 @@ enum {
 	 */
 	BL_UPTODATE,
 	/*
-	 * IO failed.  Will be removed from the cache once all
-	 * references get a chance to return the error and put their
-	 * reference.
+	 * Read IO failed.  Gets that were waiting for the read return
+	 * the error and the next read attempt clears it.
 	 */
 	BL_ERROR,
 	/*
 	 * The block is present in a set of dirty blocks.
 	 */
 	BL_DIRTY,
+	/*
+	 * A write reference to the block is held.
+	 */
+	BL_WRITE_LOCKED,
+	/*
+	 * The block is a thread's copy from _snapshot(), not a cached
+	 * block.
+	 */
+	BL_SNAPSHOT,
+};
+
+/*
+ * The number of blocks that each thread can have copied with
+ * _snapshot() at a time.
+ */
+#define SNAPSHOT_NR	8
+
+struct block_snapshot {
+	struct ngnfs_block bl;
+	struct page page;
+	struct ngnfs_block *src;
+	unsigned long seq;
 };
 
+static __thread struct block_snapshot snapshots[SNAPSHOT_NR];
+static __thread u8 snapshot_bufs[SNAPSHOT_NR][NGNFS_BLOCK_SIZE] __attribute__((__aligned__(16)));
+
 /* declaring these as we want their wake logic along side the work logic */
 static void try_queue_submit_work(struct ngnfs_block_info *blinf);
 static void try_queue_writeback_work(struct ngnfs_block_info *blinf);
@@ -191,6 +248,54 @@ static inline void clear_bit_and_wake_up(int nr, unsigned long *bits, wait_queue
 	}
 }
 
+/*
+ * Modifications of a block's contents are serialized by the dirtying
+ * bit of its set so the sequence number has a single writer.  A block
+ * can appear more than once in a caller's list so we only make it odd
+ * once.  Once the seq is odd no new read sections can start and we wait
+ * for the current ones to finish.
+ */
+static void write_seq_begin(struct ngnfs_block *bl)
+{
+	if (!(bl->seq & 1)) {
+		WRITE_ONCE(bl->seq, bl->seq + 1);
+		smp_mb(); /* store odd seq before loading readers and modifying */
+		wait_event(&bl->waitq, atomic_read(&bl->readers) == 0);
+	}
+}
+
+static void write_seq_end(struct ngnfs_block *bl)
+{
+	if (bl->seq & 1) {
+		smp_wmb(); /* finish modifying contents before storing even seq */
+		WRITE_ONCE(bl->seq, bl->seq + 1);
+		smp_mb(); /* store even seq before loading waitq */
+		if (waitqueue_active(&bl->waitq))
+			wake_up(&bl->waitq);
+	}
+}
+
+/*
+ * Writers exclude each other for as long as they hold their reference.
+ */
+static int write_lock(struct ngnfs_block *bl, nbf_t nbf)
+{
+	while (test_and_set_bit(BL_WRITE_LOCKED, &bl->bits)) {
+		if (nbf & NBF_NOWAIT)
+			return -EAGAIN;
+		wait_event(&bl->waitq, !test_bit(BL_WRITE_LOCKED, &bl->bits));
+	}
+
+	smp_mb(); /* treat setting the bit as a lock -- hard load/store barrier */
+	return 0;
+}
+
+static void write_unlock(struct ngnfs_block *bl)
+{
+	smp_mb(); /* finish with the block before clearing the bit */
+	clear_bit_and_wake_up(BL_WRITE_LOCKED, &bl->bits, &bl->waitq);
+}
+
 static void free_block(struct ngnfs_block *bl)
 {
 	if (!IS_ERR_OR_NULL(bl)) {
@@ -199,6 +304,7 @@ static void free_block(struct ngnfs_block *bl)
 
 		if (bl->page)
 			put_page(bl->page);
+		kfree(bl->prefixes);
 		kfree(bl);
 	}
 }
@@ -257,6 +363,7 @@ static void put_set(struct ngnfs_block_set *set)
 {
 	if (!IS_ERR_OR_NULL(set) && atomic_dec_return(&set->refcount) == 0) {
 		BUG_ON(!list_empty(&set->block_list));
+		BUG_ON(!list_empty(&set->notify_list));
 		BUG_ON(set->size != 0);
 		kfree_rcu(&set->rcu);
 	}
@@ -327,12 +434,10 @@ static int sync_waiters_dec_error(struct ngnfs_block_info *blinf)
  * the broadcasting of errors to all waiters are great, but it makes for
  * a simple initial implementation.
  */
-static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
+static void start_sync_seq(struct ngnfs_block_info *blinf, u64 seq)
 {
 	u64 sync_seq;
 
-	sync_waiters_inc(blinf);
-
 	do {
 		sync_seq = atomic64_read(&blinf->sync_seq);
 	} while (seq > sync_seq &&
@@ -340,6 +445,13 @@ static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
 
 	if (seq > sync_seq)
 		try_queue_writeback_work(blinf);
+}
+
+static int sync_up_to_seq(struct ngnfs_block_info *blinf, u64 seq)
+{
+	sync_waiters_inc(blinf);
+
+	start_sync_seq(blinf, seq);
 
 	trace_ngnfs_sync_begin(seq);
 
@@ -400,14 +512,58 @@ static struct ngnfs_block *lookup_or_alloc_block(struct ngnfs_block_info *blinf,
 	return bl;
 }
 
+/*
+ * The crc covers the block contents after the leading crc field.
+ */
+static __le32 calc_block_crc(void *buf)
+{
+	BUILD_BUG_ON(offsetof(struct ngnfs_btree_block, crc) != 0);
+
+	return cpu_to_le32(crc32c(~0, buf + sizeof(__le32), NGNFS_BLOCK_SIZE - sizeof(__le32)));
+}
+
+static bool block_is_zero(void *buf)
+{
+	u64 *word = buf;
+	int i;
+
+	for (i = 0; i < NGNFS_BLOCK_SIZE / sizeof(u64); i++) {
+		if (word[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Blocks that have never been written read as zeros and don't have a
+ * valid crc.  We only have to check for them once the crc mismatches.
+ * Blocks with valid crcs must also have valid btree structures so that
+ * callers can trust item offsets and sizes.
+ */
+static bool block_read_valid(void *buf)
+{
+	struct ngnfs_btree_block *bt = buf;
+
+	if (bt->crc == calc_block_crc(buf))
+		return ngnfs_btree_verify(bt);
+
+	return block_is_zero(buf);
+}
+
 /*
  * If data_page is provided then it is a new page that the io transport
  * allocated to store an incoming read.  We swap it in to place and drop
  * the old (unused) block page.
  */
 static void end_read_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl,
-			struct page *data_page)
+			struct page *data_page, int err)
 {
+	if (err < 0) {
+		bl->error = err;
+		set_bit(BL_ERROR, &bl->bits);
+	}
+
 	if (data_page) {
 		/* this means that _block_buf() will change, callers beware */
 		if (bl->page)
@@ -416,6 +572,11 @@ static void end_read_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl,
 		get_page(bl->page);
 	}
 
+	if (!test_bit(BL_ERROR, &bl->bits) && !block_read_valid(ngnfs_block_buf(bl))) {
+		bl->error = -EIO;
+		set_bit(BL_ERROR, &bl->bits);
+	}
+
 	if (!test_bit(BL_ERROR, &bl->bits))
 		set_bit(BL_UPTODATE, &bl->bits);
 
@@ -427,16 +588,24 @@ static void end_read_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl,
  * Finish write IO on a block in a set.  Once all the blocks are written
  * we clear all the block's association with the set, clear its
  * dirtying, and put it.
+ *
+ * A write error is recorded in the set and given to its notifiers.  The
+ * block's cached contents are still current so it isn't marked with an
+ * error.  Failed blocks aren't kept dirty to retry, they're clean once
+ * the set finishes like successfully written blocks.
  */
-static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
+static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl, int err)
 {
 	struct ngnfs_block_set *set = rcu_dereference(bl->set);
+	struct ngnfs_block_notify *notify;
+	struct ngnfs_block_notify *ntmp;
 	struct ngnfs_block *tmp;
 
 	/* caller called 'cause we weren't reading, should only be dirty writeback */
 	BUG_ON(IS_ERR_OR_NULL(set));
-	/* XXX not supporting write errors yet (keeping blocks dirty) */
-	BUG_ON(test_bit(BL_ERROR, &bl->bits));
+
+	if (err < 0)
+		cmpxchg(&set->error, 0, err);
 
 	/* each finished block gives room for more writeback in the queue depth */
 	atomic_dec(&blinf->nr_writeback);
@@ -461,6 +630,12 @@ static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
 		/* XXX bl refcount? */
 	}
 
+	/* the set's blocks are durable, or one of them failed */
+	list_for_each_entry_safe(notify, ntmp, &set->notify_list, head) {
+		list_del_init(&notify->head);
+		notify->fn(blinf->nfi, notify, set->error);
+	}
+
 	clear_bit_and_wake_up(SET_WRITEBACK, &set->bits, &set->waitq);
 	put_set(set);
 
@@ -469,6 +644,17 @@ static void end_write_io(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
 		wake_up(&blinf->waitq);
 }
 
+/*
+ * Transports can find their info from completion paths that are only
+ * given the fs info.
+ */
+void *ngnfs_block_btr_info(struct ngnfs_fs_info *nfi)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+
+	return blinf->btr_info;
+}
+
 /*
  * An incoming data_page ref is only used for reads. Writes always
  * manage source page that contains their written contents.
@@ -483,17 +669,17 @@ void ngnfs_block_end_io(struct ngnfs_fs_info *nfi, u64 bnr, struct page *data_pa
 	bl = lookup_block(blinf, bnr);
 	assert(!IS_ERR_OR_NULL(bl)); /* not supporting this failure yet */
 
-	/* XXX not sure what this means for writeback errors */
-	if (err < 0) {
-		set_bit(BL_ERROR, &bl->bits);
-		bl->error = err;
+	if (err < 0)
 		sync_waiters_set_error(blinf);
-	}
 
 	if (test_bit(BL_READING, &bl->bits))
-		end_read_io(blinf, bl, data_page);
+		end_read_io(blinf, bl, data_page, err);
 	else
-		end_write_io(blinf, bl);
+		end_write_io(blinf, bl, err);
+
+	/* each completion gives room for another submission in the queue depth */
+	atomic_dec(&blinf->nr_submitted);
+	try_queue_submit_work(blinf);
 
 	put_block(bl);
 }
@@ -536,6 +722,7 @@ static void ngnfs_block_submit_work(struct work_struct *work)
 {
 	struct ngnfs_block_info *blinf = container_of(work, struct ngnfs_block_info, submit_work);
 	struct ngnfs_fs_info *nfi = blinf->nfi;
+	struct ngnfs_btree_block *bt;
 	struct ngnfs_block *tmp;
 	struct ngnfs_block *bl;
 	int space;
@@ -548,7 +735,7 @@ static void ngnfs_block_submit_work(struct work_struct *work)
 	space = blinf->queue_depth - atomic_read(&blinf->nr_submitted);
 
 	list_for_each_entry_safe(bl, tmp, &blinf->submit_list, submit_head) {
-		if (space-- < 0)
+		if (space-- <= 0)
 			break;
 
 		init_llist_node(&bl->submit_llnode);
@@ -557,6 +744,12 @@ static void ngnfs_block_submit_work(struct work_struct *work)
 		/* XXX _GET_WRITE isn't operational yet */
 		op = test_bit(BL_READING, &bl->bits) ? NGNFS_BTX_OP_GET_READ : NGNFS_BTX_OP_WRITE;
 
+		/* writeback blocks can't be dirtied so the crc is stable until end_io */
+		if (op == NGNFS_BTX_OP_WRITE) {
+			bt = ngnfs_block_buf(bl);
+			bt->crc = calc_block_crc(bt);
+		}
+
 		atomic_inc(&blinf->nr_submitted);
 		ret = blinf->btr_ops->submit_block(nfi, blinf->btr_info, op, bl->bnr, bl->page);
 		BUG_ON(ret != 0);
@@ -660,14 +853,26 @@ static bool bad_nbf(nbf_t nbf)
 	return hweight_long(nbf & NBF_RW_EXCL) > 1;
 }
 
+/*
+ * Queue a read of the block if one isn't already in flight.  A
+ * previous failed read's error is cleared so that this read can
+ * succeed.
+ */
+static void start_read(struct ngnfs_block_info *blinf, struct ngnfs_block *bl)
+{
+	if (!test_and_set_bit(BL_READING, &bl->bits)) {
+		clear_bit(BL_ERROR, &bl->bits);
+		get_block(bl); /* presence on submit lists before hitting transport */
+		llist_add(&bl->submit_llnode, &blinf->submit_llist);
+		try_queue_submit_work(blinf);
+	}
+}
+
 /*
  * Acquire a reference to a cached block.  The behaviour of the
  * reference is defined by the block flags as documented at the nbf_t
  * definition.  Successfully acquired references must later be released
- * by calling _put().
- *
- * This doesn't yet differentiate between exclusive read and write
- * references.
+ * by calling _put(), or _put_write() for write references.
  */
 struct ngnfs_block *ngnfs_block_get(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nbf)
 {
@@ -684,24 +889,39 @@ struct ngnfs_block *ngnfs_block_get(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nb
 	if (IS_ERR(bl))
 		goto out;
 
+	if (nbf & NBF_WRITE) {
+		err = write_lock(bl, nbf);
+		if (err < 0) {
+			put_block(bl);
+			bl = ERR_PTR(err);
+			goto out;
+		}
+	}
+
 	/* XXX also drop dirty?  hmm. */
 	if ((nbf & NBF_NEW)) {
+		write_seq_begin(bl);
 		memset(ngnfs_block_buf(bl), 0, NGNFS_BLOCK_SIZE);
+		write_seq_end(bl);
+		clear_bit(BL_ERROR, &bl->bits);
 		set_bit(BL_UPTODATE, &bl->bits);
 	}
 
-	if (!test_bit(BL_UPTODATE, &bl->bits)) {
-		if (!test_and_set_bit(BL_READING, &bl->bits)) {
-			get_block(bl); /* presence on submit lists before hitting transport */
-			llist_add(&bl->submit_llnode, &blinf->submit_llist);
-			try_queue_submit_work(blinf);
-		}
-
+	/* failed reads are retried, and we wait again if another get restarted ours */
+	err = 0;
+	while (!test_bit(BL_UPTODATE, &bl->bits)) {
+		start_read(blinf, bl);
 		wait_event(&bl->waitq, !test_bit(BL_READING, &bl->bits));
+		smp_rmb(); /* load reading before error */
+		if (test_bit(BL_ERROR, &bl->bits)) {
+			err = bl->error;
+			break;
+		}
 	}
 
-	if (test_bit(BL_ERROR, &bl->bits)) {
-		err = bl->error;
+	if (err < 0) {
+		if (nbf & NBF_WRITE)
+			write_unlock(bl);
 		put_block(bl);
 		bl = ERR_PTR(err);
 	}
@@ -709,11 +929,150 @@ out:
 	return bl;
 }
 
+/*
+ * Start reading a block that isn't cached without waiting for the read
+ * to complete.  A later get will find the block in the cache, waiting
+ * for the read if it's still in flight.  Errors are ignored, a get
+ * after a failed read starts another read and returns its result.
+ */
+void ngnfs_block_prefetch(struct ngnfs_fs_info *nfi, u64 bnr)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+	struct ngnfs_block *bl;
+
+	bl = lookup_or_alloc_block(blinf, bnr);
+	if (IS_ERR(bl))
+		return;
+
+	if (!test_bit(BL_UPTODATE, &bl->bits))
+		start_read(blinf, bl);
+
+	put_block(bl);
+}
+
+/*
+ * Copy a cached uptodate block into the calling thread's snapshot slot
+ * without acquiring a reference to it.  The returned block can be read
+ * like a referenced block until the slot is reused, it must not be put
+ * or dirtied.  -EAGAIN is returned if the block isn't cached and
+ * uptodate, if it was modified while it was copied, or if the slot is
+ * out of range.  Callers fall back to acquiring references.
+ *
+ * The caller must hold the RCU read lock from the first snapshot through
+ * to validating them with _snapshots_valid().
+ */
+struct ngnfs_block *ngnfs_block_snapshot(struct ngnfs_fs_info *nfi, u64 bnr, unsigned int slot)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+	struct block_snapshot *snap;
+	struct ngnfs_block *bl;
+	unsigned long seq;
+
+	if (slot >= SNAPSHOT_NR)
+		return ERR_PTR(-EAGAIN);
+
+	bl = rhashtable_lookup(&blinf->ht, &bnr, ngnfs_block_ht_params);
+	if (!bl)
+		return ERR_PTR(-EAGAIN);
+
+	seq = READ_ONCE(bl->seq);
+	smp_rmb(); /* load seq before uptodate and contents */
+	if ((seq & 1) || !test_bit(BL_UPTODATE, &bl->bits) || test_bit(BL_ERROR, &bl->bits))
+		return ERR_PTR(-EAGAIN);
+
+	snap = &snapshots[slot];
+	memcpy(snapshot_bufs[slot], page_address(READ_ONCE(bl->page)), NGNFS_BLOCK_SIZE);
+
+	smp_rmb(); /* load contents before checking seq */
+	if (READ_ONCE(bl->seq) != seq)
+		return ERR_PTR(-EAGAIN);
+
+	snap->page.buf = snapshot_bufs[slot];
+	snap->bl.bits = 1UL << BL_SNAPSHOT;
+	snap->bl.page = &snap->page;
+	snap->bl.bnr = bnr;
+	snap->src = bl;
+	snap->seq = seq;
+
+	return &snap->bl;
+}
+
+/*
+ * Returns true if none of the blocks copied into the first nr snapshot
+ * slots have been modified since they were copied.  The snapshots are
+ * then a consistent view of the blocks as of the time of the call.
+ */
+bool ngnfs_block_snapshots_valid(unsigned int nr)
+{
+	unsigned int i;
+
+	smp_rmb(); /* finish loading snapshot contents before checking seqs */
+
+	for (i = 0; i < nr && i < SNAPSHOT_NR; i++) {
+		if (READ_ONCE(snapshots[i].src->seq) != snapshots[i].seq)
+			return false;
+	}
+
+	return true;
+}
+
 void ngnfs_block_put(struct ngnfs_block *bl)
 {
 	put_block(bl);
 }
 
+void ngnfs_block_put_write(struct ngnfs_block *bl)
+{
+	if (!IS_ERR_OR_NULL(bl)) {
+		write_unlock(bl);
+		put_block(bl);
+	}
+}
+
+/*
+ * Start reading the contents of a block through a read reference.
+ * Writers won't start modifying the block until the matching
+ * _read_end.  The returned sequence number can be given to
+ * _read_valid() after the section ends to see if the block has since
+ * been modified.  Read sections must be brief and can't wait for other
+ * blocks.
+ */
+unsigned long ngnfs_block_read_begin(struct ngnfs_block *bl)
+{
+	unsigned long seq;
+
+	for (;;) {
+		atomic_inc(&bl->readers);
+		smp_mb(); /* store readers before loading seq */
+		seq = READ_ONCE(bl->seq);
+		if (!(seq & 1))
+			break;
+
+		ngnfs_block_read_end(bl);
+		wait_event(&bl->waitq, !(READ_ONCE(bl->seq) & 1));
+	}
+
+	smp_rmb(); /* load seq before contents */
+	return seq;
+}
+
+void ngnfs_block_read_end(struct ngnfs_block *bl)
+{
+	smp_mb(); /* finish loading contents before dropping readers */
+	if (atomic_dec_return(&bl->readers) == 0 && waitqueue_active(&bl->waitq))
+		wake_up(&bl->waitq);
+}
+
+/*
+ * Returns true if the block hasn't been modified since the read section
+ * that returned the seq.
+ */
+bool ngnfs_block_read_valid(struct ngnfs_block *bl, unsigned long seq)
+{
+	smp_rmb(); /* finish earlier loads before checking seq */
+	return READ_ONCE(bl->seq) == seq;
+}
+
 void *ngnfs_block_buf(struct ngnfs_block *bl)
 {
 	return page_address(bl->page);
@@ -724,6 +1083,53 @@ struct page *ngnfs_block_page(struct ngnfs_block *bl)
 	return bl->page;
 }
 
+/*
+ * Return the key prefix array of a parent block for searching its
+ * items, building it if the block has been modified since it was
+ * built.  The caller must be in a read section or hold the write
+ * reference outside of dirtying so that the block and its array don't
+ * change while they search.
+ *
+ * The array's seq is odd while a caller builds it.  Other callers
+ * don't wait, they're given NULL and search the block's items.
+ */
+struct ngnfs_btree_prefixes *ngnfs_block_prefixes(struct ngnfs_block *bl)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	unsigned long seq = READ_ONCE(bl->seq);
+	struct ngnfs_btree_prefixes *bp;
+	unsigned long built;
+
+	if (test_bit(BL_SNAPSHOT, &bl->bits) || (seq & 1) || bt->level == 0)
+		return NULL;
+
+	built = READ_ONCE(bl->prefixes_seq);
+	smp_rmb(); /* load array seq before array */
+	bp = READ_ONCE(bl->prefixes);
+	if (built == seq && bp)
+		return bp;
+
+	if ((built & 1) || cmpxchg(&bl->prefixes_seq, built, seq + 1) != built)
+		return NULL;
+
+	if (!bp) {
+		bp = kmalloc(sizeof(struct ngnfs_btree_prefixes), GFP_NOFS);
+		if (!bp) {
+			WRITE_ONCE(bl->prefixes_seq, built);
+			return NULL;
+		}
+		WRITE_ONCE(bl->prefixes, bp);
+	}
+
+	/* an array that couldn't be built is empty and isn't used */
+	if (!ngnfs_btree_build_prefixes(bt, bp))
+		bp = NULL;
+
+	smp_wmb(); /* finish building array before storing its seq */
+	WRITE_ONCE(bl->prefixes_seq, seq);
+	return bp;
+}
+
 /*
  * Get a reference to a block's set if it's different than the caller's.
  * If the block doesn't have a set then we either add it to the caller's
@@ -775,9 +1181,11 @@ static struct ngnfs_block_set *get_other_set(struct ngnfs_block *bl,
 		atomic_set(&set->submitted_blocks, 0);
 		INIT_LIST_HEAD(&set->writeback_head);
 		INIT_LIST_HEAD(&set->block_list);
+		INIT_LIST_HEAD(&set->notify_list);
 		init_waitqueue_head(&set->waitq);
 		set->bits = 0;
 		set->size = 1;
+		set->error = 0;
 
 		list_add_tail(&bl->set_head, &set->block_list);
 
@@ -935,6 +1343,7 @@ restart:
 		list_for_each_entry(bl, &small->block_list, set_head)
 			rcu_assign_pointer(bl->set, large);
 		list_splice_init(&small->block_list, &large->block_list);
+		list_splice_tail_init(&small->notify_list, &large->notify_list);
 		large->size += small->size;
 		small->size = 0;
 		clear_bit_and_wake_up(SET_DIRTY, &small->bits, &small->waitq);
@@ -944,6 +1353,10 @@ restart:
 
 	/* dirtying and modifying will succeed from this point */
 
+	/* tell optimistic readers that the blocks are being modified */
+	for_each_dirty_list_block(bl, pos, list, off)
+		write_seq_begin(bl);
+
 	/* make sure any newly added blocks are dirty */
 	list_for_each_entry_reverse(bl, &large->block_list, set_head) {
 		if (test_bit(BL_DIRTY, &bl->bits))
@@ -976,16 +1389,25 @@ out:
  * The writer is done modifying all the blocks.  _dirty_begin put all
  * the blocks in one set so we just need to get the set from the first
  * block and clear dirtying.
+ *
+ * If a notify is given then it's added to the set and is called once
+ * the set, and any sets it's later merged with, finish writeback.
  */
-void ngnfs_block_dirty_end(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off)
+void ngnfs_block_dirty_end_notify(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off,
+				  struct ngnfs_block_notify *notify)
 {
 	struct ngnfs_block_info *blinf = nfi->block_info;
 	struct ngnfs_block_set *set;
 	struct ngnfs_block *bl;
 	struct list_head *pos;
 
+	for_each_dirty_list_block(bl, pos, list, off)
+		write_seq_end(bl);
+
 	for_each_dirty_list_block(bl, pos, list, off) {
 		set = rcu_dereference(bl->set);
+		if (notify)
+			list_add_tail(&notify->head, &set->notify_list);
 		clear_bit_and_wake_up(SET_DIRTYING, &set->bits, &set->waitq);
 		put_set(set); /* from _dirty_begin */
 		break;
@@ -995,6 +1417,11 @@ void ngnfs_block_dirty_end(struct ngnfs_fs_info *nfi, struct list_head *list, ss
 	try_queue_writeback_work(blinf);
 }
 
+void ngnfs_block_dirty_end(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off)
+{
+	ngnfs_block_dirty_end_notify(nfi, list, off, NULL);
+}
+
 /*
  * Attempt to write all blocks that were dirty at the time of the call,
  * returning errors from any write failures of those blocks.
@@ -1006,6 +1433,18 @@ int ngnfs_block_sync(struct ngnfs_fs_info *nfi)
 	return sync_up_to_seq(blinf, atomic64_read(&blinf->dirty_seq));
 }
 
+/*
+ * Start writeback of all blocks that were dirty at the time of the
+ * call without waiting for it to finish.  Callers find out about
+ * completion through notifications attached while dirtying.
+ */
+void ngnfs_block_start_sync(struct ngnfs_fs_info *nfi)
+{
+	struct ngnfs_block_info *blinf = nfi->block_info;
+
+	start_sync_seq(blinf, atomic64_read(&blinf->dirty_seq));
+}
+
 int ngnfs_block_setup(struct ngnfs_fs_info *nfi, struct ngnfs_block_transport_ops *btr_ops,
 		      void *btr_setup_arg)
 {
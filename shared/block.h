@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 struct ngnfs_block;
+struct ngnfs_btree_prefixes;
 
 #include "shared/fs_info.h"
 #include "shared/lk/gfp.h"
@@ -14,7 +15,11 @@ struct ngnfs_block;
 typedef enum {
 	/* return a new block, allocate if missing, forget if existing */
 	NBF_NEW = (1 << 0),
-	/* acquire a read reference that can not be modified */
+	/*
+	 * Acquire a shared read reference.  Writers can still modify the
+	 * block, readers see stable contents between _read_begin and
+	 * _read_end.
+	 */
 	NBF_READ = (1 << 1),
 	/*
 	 * Acquire an exclusive reference with an intent to write.  The
@@ -22,6 +27,8 @@ typedef enum {
 	 * caller but will be done within _dirty_begin and _dirty_end.
 	 */
 	NBF_WRITE = (1 << 2),
+	/* return -EAGAIN instead of waiting for another writer */
+	NBF_NOWAIT = (1 << 3),
 } nbf_t;
 
 /* these flags are mutually exclusive */
@@ -42,15 +49,43 @@ struct ngnfs_block_transport_ops {
 			    int op, u64 bnr, struct page *data_page);
 };
 
+/*
+ * Notifications are called once the blocks they were attached to while
+ * dirtying have been written, with an error if any of them failed.
+ * They're called from writeback completion and must not block.
+ */
+struct ngnfs_block_notify;
+typedef void (*ngnfs_block_notify_fn)(struct ngnfs_fs_info *nfi,
+				      struct ngnfs_block_notify *notify, int err);
+
+struct ngnfs_block_notify {
+	struct list_head head;
+	ngnfs_block_notify_fn fn;
+};
+
 struct ngnfs_block *ngnfs_block_get(struct ngnfs_fs_info *nfi, u64 bnr, nbf_t nbf);
 void ngnfs_block_put(struct ngnfs_block *bl);
+void ngnfs_block_put_write(struct ngnfs_block *bl);
+void ngnfs_block_prefetch(struct ngnfs_fs_info *nfi, u64 bnr);
 void *ngnfs_block_buf(struct ngnfs_block *bl);
 struct page *ngnfs_block_page(struct ngnfs_block *bl);
+struct ngnfs_btree_prefixes *ngnfs_block_prefixes(struct ngnfs_block *bl);
+
+unsigned long ngnfs_block_read_begin(struct ngnfs_block *bl);
+void ngnfs_block_read_end(struct ngnfs_block *bl);
+bool ngnfs_block_read_valid(struct ngnfs_block *bl, unsigned long seq);
+
+struct ngnfs_block *ngnfs_block_snapshot(struct ngnfs_fs_info *nfi, u64 bnr, unsigned int slot);
+bool ngnfs_block_snapshots_valid(unsigned int nr);
 
 int ngnfs_block_dirty_begin(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off);
 void ngnfs_block_dirty_end(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off);
+void ngnfs_block_dirty_end_notify(struct ngnfs_fs_info *nfi, struct list_head *list, ssize_t off,
+				  struct ngnfs_block_notify *notify);
 int ngnfs_block_sync(struct ngnfs_fs_info *nfi);
+void ngnfs_block_start_sync(struct ngnfs_fs_info *nfi);
 
+void *ngnfs_block_btr_info(struct ngnfs_fs_info *nfi);
 void ngnfs_block_end_io(struct ngnfs_fs_info *nfi, u64 bnr, struct page *data_page, int err);
 
 int ngnfs_block_setup(struct ngnfs_fs_info *nfi, struct ngnfs_block_transport_ops *btr_ops,
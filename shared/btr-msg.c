@@ -1,9 +1,51 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+/*
+ * The msg block transport sends block reads and writes to the devds
+ * that store the blocks.
+ *
+ * Blocks can be replicated on multiple devds.  Writes are sent to all
+ * the replicas.  The block's write completes once a quorum of replicas
+ * have written it, or fails once too many have failed for a quorum to
+ * be possible.
+ *
+ * With a write quorum smaller than the number of replicas, some
+ * replicas might not have written a block when its write completes.
+ * A later read from one of those replicas could see an older version
+ * of the block.  The default quorum is all the replicas.
+ *
+ * Reads are first sent to the replica that we expect to reply
+ * soonest, going by the peers' average latency and how many requests
+ * they already have in flight.  If the read hasn't completed by the
+ * time that almost all of that peer's replies would have arrived we
+ * hedge by also sending it to the next replica.  The first successful
+ * reply completes the read and a failed reply moves on to the next
+ * replica if nothing else is in flight.
+ *
+ * Requests are tracked by an id that devds return in their results.
+ * The low bits of the id identify the replica that the request was
+ * sent to.  Requests are freed once they complete and replies that
+ * arrive after that, like the losers of hedged reads, are discarded.
+ */
+
+#include "shared/lk/atomic.h"
+#include "shared/lk/build_bug.h"
 #include "shared/lk/byteorder.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/gfp.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/list.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/rcupdate.h"
+#include "shared/lk/rhashtable.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/stddef.h"
+#include "shared/lk/string.h"
+#include "shared/lk/timekeeping.h"
+#include "shared/lk/wait.h"
 
 #include "shared/block.h"
 #include "shared/btr-msg.h"
@@ -11,56 +53,234 @@
 #include "shared/fs_info.h"
 #include "shared/manifest.h"
 #include "shared/msg.h"
+#include "shared/thread.h"
 
-static int ngnfs_btr_msg_get_block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+/* low bits of wire ids are the replica index */
+#define BTR_MSG_ID_SHIFT		3
+#define BTR_MSG_ID_MASK			((1ULL << BTR_MSG_ID_SHIFT) - 1)
+
+/* peers without latency samples are assumed to be this slow */
+#define BTR_MSG_DEF_LAT_NS		(1000ULL * 1000)
+/* and we wait a while before hedging reads sent to them */
+#define BTR_MSG_DEF_HEDGE_NS		(10 * BTR_MSG_DEF_LAT_NS)
+/* don't hedge sooner than this, no matter how fast peers seem */
+#define BTR_MSG_MIN_HEDGE_NS		(100ULL * 1000)
+/* hedged sends are gathered under the lock and sent after */
+#define BTR_MSG_HEDGE_BATCH		16
+
+struct btr_msg_info {
+	struct ngnfs_fs_info *nfi;
+	struct rhashtable ht;
+	atomic64_t next_id;
+	u8 write_quorum;
+
+	/* protects request state, the hedge list, and the hedge wake time */
+	struct mutex mutex;
+	struct list_head hedge_list;
+	u64 hedge_wake_ns;
+	bool hedge_kick;
+	wait_queue_head_t hedge_waitq;
+	struct thread hedge_thr;
+};
+
+/*
+ * @nr_sending counts sends that were reserved under the lock and are
+ * being sent without it.  The request can't be freed until they're
+ * finished.  @nr_pending counts sends without a result.  Reads send to
+ * replicas in @order and @nr_tried is the number that have been sent.
+ */
+struct btr_msg_req {
+	struct rcu_head rcu;
+	struct rhash_head rhead;
+	struct list_head hedge_head;
+	u64 id;
+	u64 bnr;
+	u64 hedge_ns;
+	u64 sent_ns[NGNFS_MANIFEST_MAX_REPLICAS];
+	int op;
+	int err;
+	u8 nr_addrs;
+	u8 quorum;
+	u8 nr_ok;
+	u8 nr_err;
+	u8 nr_tried;
+	u8 nr_sending;
+	u8 nr_pending;
+	bool done;
+	u8 order[NGNFS_MANIFEST_MAX_REPLICAS];
+	struct sockaddr_in addrs[NGNFS_MANIFEST_MAX_REPLICAS];
+};
+
+/*
+ * What to do with a request after dropping the lock: complete the
+ * block, send to another replica, and/or free the request.
+ */
+struct btr_msg_act {
+	int err;
+	int send;
+	bool complete;
+	bool free;
+};
+
+static const struct rhashtable_params btr_msg_ht_params = {
+	.head_offset = offsetof(struct btr_msg_req, rhead),
+	.key_offset = offsetof(struct btr_msg_req, id),
+	.key_len = sizeof_field(struct btr_msg_req, id),
+};
+
+static void free_req(struct btr_msg_info *binf, struct btr_msg_req *req)
 {
-	struct ngnfs_msg_get_block_result *gbr = mdesc->ctl_buf;
+	rcu_read_lock();
+	rhashtable_remove_fast(&binf->ht, &req->rhead, btr_msg_ht_params);
+	rcu_read_unlock();
+	kfree_rcu(&req->rcu);
+}
 
-	/*
-	 * This may grow cases where it's fine to be granted write
-	 * access to an existing block without a data payload because
-	 * you indicated the intent to free it without reading it.
-	 */
-	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_get_block_result) ||
-	    ((gbr->err == NGNFS_MSG_ERR_OK) && (mdesc->data_size != NGNFS_BLOCK_SIZE)) ||
-	    ((gbr->err != NGNFS_MSG_ERR_OK) && (mdesc->data_size != 0)))
-		return -EINVAL;
+/*
+ * The fastest peer is the one whose latency, scaled by the requests
+ * that it already has in flight, is the lowest.  A peer that has
+ * stopped replying accumulates in flight requests and falls behind.
+ */
+static u64 peer_cost(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	struct ngnfs_msg_peer_stats stats;
 
-	ngnfs_block_end_io(nfi, le64_to_cpu(gbr->bnr), mdesc->data_page, ngnfs_msg_errno(gbr->err));
+	ngnfs_msg_peer_stats(nfi, addr, &stats);
 
-	return 0;
+	return (stats.lat_ns ?: BTR_MSG_DEF_LAT_NS) * (stats.nr_inflight + 1);
 }
 
-static int ngnfs_btr_msg_write_block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+/*
+ * Estimate the 95th percentile of the peer's latency as the mean plus
+ * two deviations.  Mean deviation isn't a standard deviation, but
+ * it's close enough to decide when a reply is unusually late.
+ */
+static u64 hedge_delay(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
 {
-	struct ngnfs_msg_write_block_result *wbr = mdesc->ctl_buf;
+	struct ngnfs_msg_peer_stats stats;
 
-	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_write_block_result) ||
-	    mdesc->data_size != 0)
-		return -EINVAL;
+	ngnfs_msg_peer_stats(nfi, addr, &stats);
+	if (stats.lat_ns == 0)
+		return BTR_MSG_DEF_HEDGE_NS;
 
-	ngnfs_block_end_io(nfi, le64_to_cpu(wbr->bnr), mdesc->data_page, ngnfs_msg_errno(wbr->err));
+	return max(stats.lat_ns + (2 * stats.lat_dev_ns), BTR_MSG_MIN_HEDGE_NS);
+}
 
-	return 0;
+/*
+ * Sort the replicas by cost with an insertion sort that preserves the
+ * manifest's order for peers with equal costs.
+ */
+static void order_replicas(struct ngnfs_fs_info *nfi, struct btr_msg_req *req)
+{
+	u64 cost[NGNFS_MANIFEST_MAX_REPLICAS];
+	u64 c;
+	int i;
+	int j;
+
+	for (i = 0; i < req->nr_addrs; i++) {
+		c = req->nr_addrs > 1 ? peer_cost(nfi, &req->addrs[i]) : 0;
+		for (j = i; j > 0 && cost[j - 1] > c; j--) {
+			cost[j] = cost[j - 1];
+			req->order[j] = req->order[j - 1];
+		}
+		cost[j] = c;
+		req->order[j] = i;
+	}
 }
 
-static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info, int op, u64 bnr,
-				      struct page *data_page)
+/*
+ * Reserve a send of a read to the next replica in order, returning its
+ * index or -1 if all the replicas have been tried.
+ */
+static int reserve_read(struct btr_msg_req *req, u64 now)
+{
+	int i;
+
+	if (req->nr_tried == req->nr_addrs)
+		return -1;
+
+	i = req->order[req->nr_tried++];
+	req->sent_ns[i] = now;
+	req->nr_sending++;
+	req->nr_pending++;
+
+	return i;
+}
+
+/*
+ * Writes send the block's page to each replica so the block can't be
+ * completed, which lets it be dirtied again, until all its sends have
+ * been issued.  Exactly one caller sees a done req without sends and
+ * it frees the req and completes its write.
+ */
+static void check_free(struct btr_msg_req *req, struct btr_msg_act *act)
+{
+	act->free = req->done && req->nr_sending == 0;
+	if (act->free && req->op == NGNFS_BTX_OP_WRITE) {
+		act->complete = true;
+		act->err = req->err;
+	}
+}
+
+/*
+ * Record a replica's result, with the lock held.  Exactly one result
+ * completes the block.  For writes it's the one that reaches the quorum
+ * or makes it impossible.  For reads it's the first success or the
+ * final failure once all the replicas have been tried.
+ */
+static void record_result(struct btr_msg_req *req, int err, struct btr_msg_act *act)
+{
+	req->nr_pending--;
+
+	if (req->done)
+		goto out;
+
+	if (req->op == NGNFS_BTX_OP_WRITE) {
+		if (err == 0 && ++req->nr_ok == req->quorum)
+			req->done = true;
+		else if (err < 0 && ++req->nr_err == req->nr_addrs - req->quorum + 1)
+			req->done = true;
+
+	} else if (err == 0) {
+		req->done = true;
+
+	} else if (req->nr_pending == 0) {
+		act->send = reserve_read(req, ktime_get_ns());
+		if (act->send < 0)
+			req->done = true;
+	}
+
+	if (req->done) {
+		req->err = err;
+		if (req->op != NGNFS_BTX_OP_WRITE) {
+			act->complete = true;
+			act->err = err;
+		}
+		if (!list_empty(&req->hedge_head))
+			list_del_init(&req->hedge_head);
+	}
+out:
+	check_free(req, act);
+}
+
+static int send_req(struct ngnfs_fs_info *nfi, struct btr_msg_req *req, int i,
+		    struct page *data_page)
 {
 	union {
 		struct ngnfs_msg_get_block gb;
 		struct ngnfs_msg_write_block wb;
 	} u;
 	struct ngnfs_msg_desc mdesc;
-	struct sockaddr_in addr;
-	int ret;
+	u64 id = (req->id << BTR_MSG_ID_SHIFT) | i;
 
-	switch (op) {
+	switch (req->op) {
 		case NGNFS_BTX_OP_GET_READ:
 		case NGNFS_BTX_OP_GET_WRITE:
-			u.gb.bnr = cpu_to_le64(bnr);
-			u.gb.access = op == NGNFS_BTX_OP_GET_READ ? NGNFS_MSG_BLOCK_ACCESS_READ :
-								    NGNFS_MSG_BLOCK_ACCESS_WRITE;
+			u.gb.bnr = cpu_to_le64(req->bnr);
+			u.gb.id = cpu_to_le64(id);
+			u.gb.access = req->op == NGNFS_BTX_OP_GET_READ ?
+					NGNFS_MSG_BLOCK_ACCESS_READ : NGNFS_MSG_BLOCK_ACCESS_WRITE;
+			memset(u.gb._pad, 0, sizeof(u.gb._pad));
 			mdesc.ctl_buf = &u.gb;
 			mdesc.ctl_size = sizeof(u.gb);
 			mdesc.data_page = NULL;
@@ -69,7 +289,8 @@ static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
 			break;
 
 		case NGNFS_BTX_OP_WRITE:
-			u.wb.bnr = cpu_to_le64(bnr);
+			u.wb.bnr = cpu_to_le64(req->bnr);
+			u.wb.id = cpu_to_le64(id);
 			mdesc.ctl_buf = &u.wb;
 			mdesc.ctl_size = sizeof(u.wb);
 			mdesc.data_page = data_page;
@@ -78,19 +299,295 @@ static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info,
 			break;
 
 		default:
-			ret = -EOPNOTSUPP;
-			goto out;
+			return -EOPNOTSUPP;
 	}
 
-	ret = ngnfs_manifest_map_block(nfi, bnr, &addr);
-	if (ret == 0) {
-		mdesc.addr = &addr;
-		ret = ngnfs_msg_send(nfi, &mdesc);
+	mdesc.addr = &req->addrs[i];
+	mdesc.steer = (u32)req->bnr;
+
+	return ngnfs_msg_send(nfi, &mdesc);
+}
+
+/*
+ * Send a reserved request to a replica and finish the reservation.  A
+ * failure to send is recorded as the replica's result.
+ */
+static void send_reserved(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf,
+			  struct btr_msg_req *req, int i, struct page *data_page,
+			  struct btr_msg_act *act)
+{
+	int ret;
+
+	ngnfs_msg_peer_sent(nfi, &req->addrs[i]);
+	ret = send_req(nfi, req, i, data_page);
+	if (ret < 0)
+		ngnfs_msg_peer_replied(nfi, &req->addrs[i], 0);
+
+	memset(act, 0, sizeof(struct btr_msg_act));
+	act->send = -1;
+
+	mutex_lock(&binf->mutex);
+	req->nr_sending--;
+	if (ret < 0)
+		record_result(req, ret, act);
+	else
+		check_free(req, act);
+	mutex_unlock(&binf->mutex);
+}
+
+/*
+ * Act on a request after dropping the lock.  Only reads can send to
+ * another replica and they never have a data page to send.  The req is
+ * freed before the block is completed because completion can let the
+ * block layer tear down.
+ */
+static void finish_act(struct ngnfs_fs_info *nfi, struct btr_msg_info *binf,
+		       struct btr_msg_req *req, struct page *data_page,
+		       struct btr_msg_act *act)
+{
+	u64 bnr = req->bnr;
+
+	for (;;) {
+		if (act->free)
+			free_req(binf, req);
+
+		if (act->complete)
+			ngnfs_block_end_io(nfi, bnr, act->err < 0 ? NULL : data_page, act->err);
+
+		if (act->free || act->send < 0)
+			break;
+
+		send_reserved(nfi, binf, req, act->send, NULL, act);
 	}
-out:
+}
+
+/*
+ * Results for requests that have already completed are discarded, but
+ * they still tell us that the peer is no longer working on them.
+ * Results that don't match the request they name are rejected and
+ * aren't counted as replies.
+ */
+static int block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc, u64 id,
+			u64 bnr, struct page *data_page, int err)
+{
+	struct btr_msg_info *binf = ngnfs_block_btr_info(nfi);
+	struct btr_msg_act act = { .send = -1, };
+	struct btr_msg_req *req;
+	u64 lat_ns = 0;
+	int i = id & BTR_MSG_ID_MASK;
+	int ret = 0;
+
+	id >>= BTR_MSG_ID_SHIFT;
+
+	/* results racing to free can find the req until the grace period */
+	rcu_read_lock();
+	req = rhashtable_lookup(&binf->ht, &id, btr_msg_ht_params);
+	if (req) {
+		mutex_lock(&binf->mutex);
+		if (i >= req->nr_addrs || req->bnr != bnr) {
+			ret = -EINVAL;
+			req = NULL;
+		} else if (req->done && req->nr_sending == 0) {
+			req = NULL;
+		} else {
+			if (err == 0 && req->op != NGNFS_BTX_OP_WRITE)
+				lat_ns = max(ktime_get_ns() - req->sent_ns[i], 1ULL);
+			record_result(req, err, &act);
+		}
+		mutex_unlock(&binf->mutex);
+	}
+	rcu_read_unlock();
+
+	if (ret == 0)
+		ngnfs_msg_peer_replied(nfi, mdesc->addr, lat_ns);
+
+	if (req)
+		finish_act(nfi, binf, req, data_page, &act);
+
 	return ret;
 }
 
+static int ngnfs_btr_msg_get_block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_get_block_result *gbr = mdesc->ctl_buf;
+
+	/*
+	 * This may grow cases where it's fine to be granted write
+	 * access to an existing block without a data payload because
+	 * you indicated the intent to free it without reading it.
+	 */
+	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_get_block_result) ||
+	    ((gbr->err == NGNFS_MSG_ERR_OK) && (mdesc->data_size != NGNFS_BLOCK_SIZE)) ||
+	    ((gbr->err != NGNFS_MSG_ERR_OK) && (mdesc->data_size != 0)))
+		return -EINVAL;
+
+	return block_result(nfi, mdesc, le64_to_cpu(gbr->id), le64_to_cpu(gbr->bnr),
+			    mdesc->data_page, ngnfs_msg_errno(gbr->err));
+}
+
+static int ngnfs_btr_msg_write_block_result(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_write_block_result *wbr = mdesc->ctl_buf;
+
+	if (mdesc->ctl_size != sizeof(struct ngnfs_msg_write_block_result) ||
+	    mdesc->data_size != 0)
+		return -EINVAL;
+
+	return block_result(nfi, mdesc, le64_to_cpu(wbr->id), le64_to_cpu(wbr->bnr), NULL,
+			    ngnfs_msg_errno(wbr->err));
+}
+
+static int ngnfs_btr_msg_submit_block(struct ngnfs_fs_info *nfi, void *btr_info, int op, u64 bnr,
+				      struct page *data_page)
+{
+	struct btr_msg_info *binf = btr_info;
+	struct btr_msg_act act;
+	struct btr_msg_req *req;
+	bool kick = false;
+	u64 now;
+	int nr;
+	int i;
+
+	BUILD_BUG_ON(NGNFS_MANIFEST_MAX_REPLICAS > (1 << BTR_MSG_ID_SHIFT));
+
+	if (op != NGNFS_BTX_OP_GET_READ && op != NGNFS_BTX_OP_GET_WRITE &&
+	    op != NGNFS_BTX_OP_WRITE)
+		return -EOPNOTSUPP;
+
+	req = kzalloc(sizeof(struct btr_msg_req), GFP_NOFS);
+	if (!req)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&req->hedge_head);
+	req->id = atomic64_inc_return(&binf->next_id);
+	req->bnr = bnr;
+	req->op = op;
+	req->nr_addrs = ngnfs_manifest_map_replicas(nfi, bnr, req->addrs);
+	if (op == NGNFS_BTX_OP_WRITE && binf->write_quorum &&
+	    binf->write_quorum < req->nr_addrs)
+		req->quorum = binf->write_quorum;
+	else
+		req->quorum = req->nr_addrs;
+
+	/* reserve the initial sends before results can find the req */
+	now = ktime_get_ns();
+	if (op == NGNFS_BTX_OP_WRITE) {
+		for (i = 0; i < req->nr_addrs; i++) {
+			req->sent_ns[i] = now;
+			req->order[i] = i;
+		}
+		req->nr_tried = req->nr_addrs;
+		req->nr_sending = req->nr_addrs;
+		req->nr_pending = req->nr_addrs;
+	} else {
+		order_replicas(nfi, req);
+		i = reserve_read(req, now);
+		req->hedge_ns = now + hedge_delay(nfi, &req->addrs[i]);
+	}
+	nr = req->nr_addrs;
+
+	rcu_read_lock();
+	rhashtable_lookup_get_insert_fast(&binf->ht, &req->rhead, btr_msg_ht_params);
+	rcu_read_unlock();
+
+	/* only wake the hedge thread if it'd sleep past our deadline */
+	if (op != NGNFS_BTX_OP_WRITE && nr > 1) {
+		mutex_lock(&binf->mutex);
+		list_add_tail(&req->hedge_head, &binf->hedge_list);
+		if (req->hedge_ns < binf->hedge_wake_ns) {
+			binf->hedge_wake_ns = req->hedge_ns;
+			WRITE_ONCE(binf->hedge_kick, true);
+			kick = true;
+		}
+		mutex_unlock(&binf->mutex);
+		if (kick)
+			wake_up(&binf->hedge_waitq);
+	}
+
+	/* the req can be freed once the final reserved send finishes */
+	if (op == NGNFS_BTX_OP_WRITE) {
+		for (i = 0; i < nr; i++) {
+			send_reserved(nfi, binf, req, i, data_page, &act);
+			finish_act(nfi, binf, req, NULL, &act);
+		}
+	} else {
+		send_reserved(nfi, binf, req, i, NULL, &act);
+		finish_act(nfi, binf, req, NULL, &act);
+	}
+
+	return 0;
+}
+
+/*
+ * Send reads that have passed their hedge deadline to their next
+ * replica and sleep until the next deadline or until a submitted read
+ * has an earlier deadline.  Reads that have run out of replicas stay
+ * in flight until one of their replicas replies.
+ */
+static void hedge_thread(struct thread *thr, void *arg)
+{
+	struct btr_msg_info *binf = arg;
+	struct ngnfs_fs_info *nfi = binf->nfi;
+	struct btr_msg_req *reqs[BTR_MSG_HEDGE_BATCH];
+	int inds[BTR_MSG_HEDGE_BATCH];
+	struct btr_msg_req *req;
+	struct btr_msg_req *tmp;
+	struct btr_msg_act act;
+	u64 next;
+	u64 now;
+	int nr;
+	int i;
+
+	while (!thread_should_return(thr)) {
+		now = ktime_get_ns();
+		next = U64_MAX;
+		nr = 0;
+
+		mutex_lock(&binf->mutex);
+		WRITE_ONCE(binf->hedge_kick, false);
+		list_for_each_entry_safe(req, tmp, &binf->hedge_list, hedge_head) {
+			if (req->hedge_ns > now) {
+				next = min(next, req->hedge_ns);
+				continue;
+			}
+
+			if (nr == BTR_MSG_HEDGE_BATCH) {
+				next = now;
+				break;
+			}
+
+			i = reserve_read(req, now);
+			if (i < 0 || req->nr_tried == req->nr_addrs) {
+				list_del_init(&req->hedge_head);
+			} else {
+				req->hedge_ns = now + hedge_delay(nfi, &req->addrs[i]);
+				next = min(next, req->hedge_ns);
+			}
+
+			if (i >= 0) {
+				reqs[nr] = req;
+				inds[nr] = i;
+				nr++;
+			}
+		}
+		binf->hedge_wake_ns = next;
+		mutex_unlock(&binf->mutex);
+
+		for (i = 0; i < nr; i++) {
+			send_reserved(nfi, binf, reqs[i], inds[i], NULL, &act);
+			finish_act(nfi, binf, reqs[i], NULL, &act);
+		}
+
+		if (next == U64_MAX) {
+			wait_event(&binf->hedge_waitq, READ_ONCE(binf->hedge_kick) ||
+				   thread_should_return(thr));
+		} else if (next > now) {
+			wait_event_timeout(&binf->hedge_waitq, READ_ONCE(binf->hedge_kick) ||
+					   thread_should_return(thr), next - now);
+		}
+	}
+}
+
 static int ngnfs_btr_msg_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
 {
 	return 32; /* XXX *shrug* */
@@ -98,27 +595,98 @@ static int ngnfs_btr_msg_queue_depth(struct ngnfs_fs_info *nfi, void *btr_info)
 
 static void *ngnfs_btr_msg_setup(struct ngnfs_fs_info *nfi, void *arg)
 {
+	struct ngnfs_btr_msg_options *opts = arg;
+	struct btr_msg_info *binf;
 	int ret;
 
+	binf = kzalloc(sizeof(struct btr_msg_info), GFP_NOFS);
+	if (!binf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	binf->nfi = nfi;
+	atomic64_set(&binf->next_id, 0);
+	binf->write_quorum = opts ? opts->write_quorum : 0;
+	mutex_init(&binf->mutex);
+	INIT_LIST_HEAD(&binf->hedge_list);
+	binf->hedge_wake_ns = U64_MAX;
+	init_waitqueue_head(&binf->hedge_waitq);
+	thread_init(&binf->hedge_thr);
+
+	ret = rhashtable_init(&binf->ht, &btr_msg_ht_params);
+	if (ret < 0) {
+		kfree(binf);
+		goto out;
+	}
+
+	ret = thread_start(&binf->hedge_thr, hedge_thread, binf);
+	if (ret < 0) {
+		rhashtable_destroy(&binf->ht);
+		kfree(binf);
+		goto out;
+	}
+
 	ret = ngnfs_msg_register_recv(nfi, NGNFS_MSG_GET_BLOCK_RESULT,
 				      ngnfs_btr_msg_get_block_result) ?:
 	      ngnfs_msg_register_recv(nfi, NGNFS_MSG_WRITE_BLOCK_RESULT,
 				      ngnfs_btr_msg_write_block_result);
-	if (ret < 0)
-		return ERR_PTR(ret);
+	if (ret < 0) {
+		ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCK_RESULT,
+					  ngnfs_btr_msg_get_block_result);
+		thread_stop_indicate(&binf->hedge_thr);
+		wake_up(&binf->hedge_waitq);
+		thread_stop_wait(&binf->hedge_thr);
+		rhashtable_destroy(&binf->ht);
+		kfree(binf);
+	}
+out:
+	return ret < 0 ? ERR_PTR(ret) : binf;
+}
 
-	return NULL;
+/*
+ * Stop hedging so that we don't send more requests while the block
+ * layer is tearing down.
+ */
+static void ngnfs_btr_msg_shutdown(struct ngnfs_fs_info *nfi, void *btr_info)
+{
+	struct btr_msg_info *binf = btr_info;
+
+	if (binf) {
+		thread_stop_indicate(&binf->hedge_thr);
+		wake_up(&binf->hedge_waitq);
+		thread_stop_wait(&binf->hedge_thr);
+	}
+}
+
+/*
+ * Blocks can be destroyed with requests still waiting for replies
+ * which will never arrive.
+ */
+static void free_ht_req(void *ptr, void *arg)
+{
+	struct btr_msg_req *req = ptr;
+
+	kfree(req);
 }
 
 static void ngnfs_btr_msg_destroy(struct ngnfs_fs_info *nfi, void *btr_info)
 {
+	struct btr_msg_info *binf = btr_info;
+
 	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_GET_BLOCK_RESULT, ngnfs_btr_msg_get_block_result);
 	ngnfs_msg_unregister_recv(nfi, NGNFS_MSG_WRITE_BLOCK_RESULT,
 				  ngnfs_btr_msg_write_block_result);
+
+	if (binf) {
+		rhashtable_free_and_destroy(&binf->ht, free_ht_req, NULL);
+		kfree(binf);
+	}
 }
 
 struct ngnfs_block_transport_ops ngnfs_btr_msg_ops = {
 	.setup = ngnfs_btr_msg_setup,
+	.shutdown = ngnfs_btr_msg_shutdown,
 	.destroy = ngnfs_btr_msg_destroy,
 	.queue_depth = ngnfs_btr_msg_queue_depth,
 	.submit_block = ngnfs_btr_msg_submit_block,
@@ -2,8 +2,18 @@
 #ifndef NGNFS_SHARED_BTR_MSG_H
 #define NGNFS_SHARED_BTR_MSG_H
 
+#include "shared/lk/types.h"
+
 #include "shared/block.h"
 
+/*
+ * Block writes complete once @write_quorum replicas have written them,
+ * 0 waits for all the replicas.
+ */
+struct ngnfs_btr_msg_options {
+	u8 write_quorum;
+};
+
 extern struct ngnfs_block_transport_ops ngnfs_btr_msg_ops;
 
 #endif
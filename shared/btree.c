@@ -1,14 +1,17 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#include <nmmintrin.h>
+
 #include "shared/lk/bitops.h"
 #include "shared/lk/bug.h"
+#include "shared/lk/build_bug.h"
 #include "shared/lk/byteorder.h"
 #include "shared/lk/container_of.h"
 #include "shared/lk/errno.h"
+#include "shared/lk/limits.h"
 #include "shared/lk/math.h"
 #include "shared/lk/minmax.h"
 #include "shared/lk/types.h"
-#include "shared/lk/sort.h"
 #include "shared/lk/stddef.h"
 #include "shared/lk/string.h"
 #include "shared/lk/unaligned.h"
@@ -38,9 +41,21 @@
  * avoiding having to worry about referencing block contents after we
  * return.
  *
+ * Leaf blocks can be flagged to store the prefix shared by all their
+ * keys once.  Searches compare the key with the common prefix and then
+ * search the stored remainders of the item keys.  The common prefix is
+ * changed as blocks are repacked: it shrinks when a key without it is
+ * inserted, and grows to the longest prefix shared by the first and
+ * last keys when an insertion would otherwise not fit.  Items moved
+ * between blocks are measured by their full key sizes so that the
+ * destination has room even if its common prefix shrinks.
+ *
+ * Blocks can also be flagged with a fixed key size.  Keys of that size
+ * are searched by comparing their big-endian u64 words without the
+ * generic length tiebreak, with the search specialized for each size.
+ *
  * XXX:
  *  - zero freed space as we move/compact/delete items
- *  - per-cpu item sorting offset array to avoid double sort
  */
 
 /*
@@ -137,9 +152,49 @@ static inline u16 used_size(struct ngnfs_btree_block *bt)
 	return NGNFS_BLOCK_SIZE - (sizeof(struct ngnfs_btree_block) + le16_to_cpu(bt->total_free));
 }
 
-static inline u16 used_pct(struct ngnfs_btree_block *bt)
+/*
+ * The common key prefix of flagged leaf blocks is stored at the end of
+ * the block, items are stored before it.
+ */
+static inline u16 items_end(struct ngnfs_btree_block *bt)
+{
+	return NGNFS_BLOCK_SIZE - bt->prefix_size;
+}
+
+static inline void *common_prefix_ptr(struct ngnfs_btree_block *bt)
+{
+	return (void *)bt + items_end(bt);
+}
+
+/*
+ * The number of bytes the items would use if their full keys were
+ * stored, which can only be more than the used size for blocks with a
+ * common prefix.
+ */
+static inline u32 full_used_size(struct ngnfs_btree_block *bt)
+{
+	return used_size(bt) + (u32)le16_to_cpu(bt->nr_items) * bt->prefix_size - bt->prefix_size;
+}
+
+static inline u16 full_used_pct(struct ngnfs_btree_block *bt)
 {
-	return (u32)used_size(bt) * 100 / NGNFS_BTREE_MAX_FREE;
+	return full_used_size(bt) * 100 / NGNFS_BTREE_MAX_FREE;
+}
+
+/*
+ * Make sure that the contiguous avail_free region can hold the given
+ * number of bytes, compacting if the total free space can.  Returns
+ * false if the block doesn't have room.
+ */
+static bool make_avail(struct ngnfs_btree_block *bt, u16 size)
+{
+	if (le16_to_cpu(bt->total_free) < size)
+		return false;
+
+	if (le16_to_cpu(bt->avail_free) < size)
+		ngnfs_btree_compact(bt);
+
+	return true;
 }
 
 /*
@@ -164,7 +219,102 @@ static inline void memmove_tail_offs(struct ngnfs_btree_block *bt, u16 pos, s16
 static inline int cmp_keys(const void *key_a, const u16 size_a,
 			   const void *key_b, const u16 size_b)
 {
-	return memcmp(key_a, key_b, min(size_a, size_b)) ?: ((int)size_b - (int)size_a);
+	return memcmp(key_a, key_b, min(size_a, size_b)) ?: ((int)size_a - (int)size_b);
+}
+
+/*
+ * Keys are compared by their first 8 bytes as a big-endian integer
+ * before comparing the full keys.  Shorter keys are padded with zeros
+ * so prefixes order the same as keys, with equal prefixes needing a
+ * full comparison.
+ */
+#define KEY_PREFIX_SIZE	sizeof(u64)
+
+static inline u64 key_prefix(const void *key, u16 size)
+{
+	u8 buf[KEY_PREFIX_SIZE] = { 0, };
+
+	if (size >= KEY_PREFIX_SIZE)
+		return get_unaligned_be64(key);
+
+	memcpy(buf, key, size);
+	return get_unaligned_be64(buf);
+}
+
+/*
+ * SSE only has signed 64bit compares so searches flip the sign bits of
+ * prefixes and compare them as signed.
+ */
+static inline s64 flip_prefix(u64 pfx)
+{
+	return pfx ^ (1ULL << 63);
+}
+
+static inline s64 item_prefix(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp,
+			      u16 pos)
+{
+	struct ngnfs_btree_item *item;
+
+	if (bp)
+		return bp->pfxs[pos];
+
+	item = item_ptr(bt, pos);
+	return flip_prefix(key_prefix(key_ptr(item), item->key_size));
+}
+
+static inline int cmp_prefix_key(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp,
+				 s64 pfx, const void *key, const u16 size, u16 pos)
+{
+	s64 item_pfx = item_prefix(bt, bp, pos);
+	struct ngnfs_btree_item *item;
+
+	if (pfx != item_pfx)
+		return pfx < item_pfx ? -1 : 1;
+
+	item = item_ptr(bt, pos);
+	return cmp_keys(key, size, key_ptr(item), item->key_size);
+}
+
+/*
+ * Binary search narrows down to this many items which are then
+ * compared all at once.
+ */
+#define SEARCH_SCAN_NR	8
+
+/*
+ * Return the number of items in the range whose key prefixes are less
+ * than the search prefix.  Unused lanes are filled with the largest
+ * prefix which is never less.  A prefix array is loaded directly, the
+ * items after the range have greater keys and its padding is the
+ * largest prefix.
+ */
+static u16 count_prefixes_less(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp,
+			       u16 first, u16 nr, s64 pfx)
+{
+	s64 buf[SEARCH_SCAN_NR];
+	const s64 *pfxs;
+	__m128i search;
+	__m128i gt;
+	u16 count = 0;
+	int i;
+
+	BUILD_BUG_ON(SEARCH_SCAN_NR > NGNFS_BTREE_PREFIXES_PAD);
+
+	if (bp) {
+		pfxs = &bp->pfxs[first];
+	} else {
+		for (i = 0; i < SEARCH_SCAN_NR; i++)
+			buf[i] = i < nr ? item_prefix(bt, NULL, first + i) : S64_MAX;
+		pfxs = buf;
+	}
+
+	search = _mm_set1_epi64x(pfx);
+	for (i = 0; i < SEARCH_SCAN_NR; i += 2) {
+		gt = _mm_cmpgt_epi64(search, _mm_loadu_si128((const __m128i *)&pfxs[i]));
+		count += hweight_long(_mm_movemask_pd(_mm_castsi128_pd(gt)));
+	}
+
+	return count;
 }
 
 /*
@@ -172,35 +322,279 @@ static inline int cmp_keys(const void *key_a, const u16 size_a,
  * given key would occupy.  This can return the next position after the
  * current array if the item would be inserted after all the existing
  * items.
+ *
+ * Each binary search probe is a dependent load through the offset
+ * array so we compare cheap key prefixes and only compare full keys
+ * when prefixes are equal.  Once the search is narrowed down we find
+ * the position amongst the remaining items with one vector compare of
+ * their prefixes.  With a prefix array the items are only loaded to
+ * compare full keys when prefixes are equal.
  */
 struct btree_search_result {
 	u16 pos;
 	s16 cmp;
 };
-static struct btree_search_result btree_search(struct ngnfs_btree_block *bt, void *key,
-					       u16 key_size)
+static struct btree_search_result search_items(struct ngnfs_btree_block *bt,
+					       struct ngnfs_btree_prefixes *bp,
+					       void *key, u16 key_size)
 {
 	struct btree_search_result res = { .pos = 0, .cmp = 1 };
-	struct ngnfs_btree_item *item;
+	s64 pfx = flip_prefix(key_prefix(key, key_size));
 	s16 first = 0;
 	s16 last = le16_to_cpu(bt->nr_items) - 1;
+	s16 mid;
+	int cmp;
+
+	while (last - first >= SEARCH_SCAN_NR) {
+		mid = (first + last) >> 1;
+		cmp = cmp_prefix_key(bt, bp, pfx, key, key_size, mid);
+
+		if (cmp == 0) {
+			res.pos = mid;
+			res.cmp = 0;
+			return res;
+		} else if (cmp < 0) {
+			last = mid - 1;
+		} else {
+			first = mid + 1;
+		}
+	}
 
-	while (first <= last) {
-		res.pos = (first + last) >> 1;
-		item = item_ptr(bt, res.pos);
-		res.cmp = cmp_keys(key, key_size, key_ptr(item), item->key_size);
+	if (first > last) {
+		res.pos = first;
+		return res;
+	}
 
-		if (res.cmp == 0)
+	/* skip the lesser prefixes, then compare full keys while prefixes are equal */
+	res.pos = first + count_prefixes_less(bt, bp, first, last - first + 1, pfx);
+	for (; res.pos <= last; res.pos++) {
+		res.cmp = cmp_prefix_key(bt, bp, pfx, key, key_size, res.pos);
+		if (res.cmp <= 0)
 			break;
-		else if (res.cmp < 0)
-			last = res.pos - 1;
-		else
-			first = ++res.pos;
 	}
 
 	return res;
 }
 
+/*
+ * Return the size of all the keys in a block flagged with a fixed key
+ * size, or 0 if its keys can have any size.
+ */
+static inline u8 fixed_key_size(struct ngnfs_btree_block *bt)
+{
+	if (bt->flags & NGNFS_BTREE_FLAG_KEY8)
+		return 8;
+	if (bt->flags & NGNFS_BTREE_FLAG_KEY16)
+		return 16;
+	return 0;
+}
+
+static bool valid_key_size(struct ngnfs_btree_block *bt, size_t key_size)
+{
+	u8 fixed = fixed_key_size(bt);
+
+	return key_size > 0 && key_size <= NGNFS_BTREE_KEY_SIZE_MAX &&
+	       (fixed == 0 || key_size == fixed);
+}
+
+/*
+ * Compare keys made of one or two big-endian u64 words.  The words'
+ * comparisons are combined without branching, the first word's result
+ * outweighs the second's.
+ */
+static __always_inline int cmp_words(const void *key_a, const void *key_b, const int words)
+{
+	u64 a = get_unaligned_be64(key_a);
+	u64 b = get_unaligned_be64(key_b);
+	int cmp = (a > b) - (a < b);
+
+	if (words == 2) {
+		a = get_unaligned_be64(key_a + sizeof(u64));
+		b = get_unaligned_be64(key_b + sizeof(u64));
+		cmp = cmp * 2 + ((a > b) - (a < b));
+	}
+
+	return cmp;
+}
+
+/*
+ * Search a block whose keys all have the search key's fixed size.  The
+ * binary search only chooses between positions so the compiler can
+ * avoid unpredictable branches, and one final comparison finds if the
+ * key exists.
+ */
+static __always_inline struct btree_search_result search_fixed(struct ngnfs_btree_block *bt,
+							       void *key, const int words)
+{
+	struct btree_search_result res = { .pos = 0, .cmp = 1 };
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 base = 0;
+	u16 half;
+	u16 n;
+
+	if (nr == 0)
+		return res;
+
+	for (n = nr; n > 1; n -= half) {
+		half = n >> 1;
+		base = cmp_words(key_ptr(item_ptr(bt, base + half)), key, words) < 0 ?
+		       base + half : base;
+	}
+
+	res.pos = base;
+	res.cmp = cmp_words(key, key_ptr(item_ptr(bt, base)), words);
+	if (res.cmp > 0) {
+		res.pos++;
+		res.cmp = res.pos < nr ? cmp_words(key, key_ptr(item_ptr(bt, res.pos)), words) : 1;
+	}
+
+	return res;
+}
+
+/*
+ * Keys without a block's common prefix sort before or after all of its
+ * items, otherwise we search for the rest of the key after the prefix.
+ * A prefix array built from the block's current items is used in place
+ * of the fixed size search.
+ */
+static struct btree_search_result btree_search(struct ngnfs_btree_block *bt,
+					       struct ngnfs_btree_prefixes *bp,
+					       void *key, u16 key_size)
+{
+	struct btree_search_result res = { .pos = 0, .cmp = -1 };
+	u8 fixed = fixed_key_size(bt);
+	u8 ps = bt->prefix_size;
+	int cmp;
+
+	if (bp && bp->nr != le16_to_cpu(bt->nr_items))
+		bp = NULL;
+
+	if (fixed != 0 && key_size == fixed && !bp)
+		return fixed == 8 ? search_fixed(bt, key, 1) : search_fixed(bt, key, 2);
+
+	if (ps > 0) {
+		cmp = memcmp(key, common_prefix_ptr(bt), key_size < ps ? key_size : ps);
+		if (cmp < 0 || (cmp == 0 && key_size <= ps))
+			return res;
+		if (cmp > 0) {
+			res.pos = le16_to_cpu(bt->nr_items);
+			res.cmp = 1;
+			return res;
+		}
+	}
+
+	return search_items(bt, bp, key + ps, key_size - ps);
+}
+
+/*
+ * Copy an item's full key, including its block's common prefix, into
+ * the buffer which must be able to hold the max key size.
+ */
+static u8 full_key(struct ngnfs_btree_block *bt, struct ngnfs_btree_item *item, u8 *buf)
+{
+	u8 ps = bt->prefix_size;
+
+	memcpy(buf, common_prefix_ptr(bt), ps);
+	memcpy(buf + ps, key_ptr(item), item->key_size);
+
+	return ps + item->key_size;
+}
+
+/*
+ * Compare a full key with an item's key which might be stored without
+ * its block's common prefix.
+ */
+static int cmp_key_item(struct ngnfs_btree_block *bt, void *key, u16 key_size,
+			struct ngnfs_btree_item *item)
+{
+	u8 ps = bt->prefix_size;
+	int cmp;
+
+	if (ps > 0) {
+		cmp = memcmp(key, common_prefix_ptr(bt), key_size < ps ? key_size : ps);
+		if (cmp != 0)
+			return cmp;
+		if (key_size <= ps)
+			return -1;
+	}
+
+	return cmp_keys(key + ps, key_size - ps, key_ptr(item), item->key_size);
+}
+
+static bool has_common_prefix(struct ngnfs_btree_block *bt, void *key, u16 key_size)
+{
+	return key_size > bt->prefix_size &&
+	       memcmp(key, common_prefix_ptr(bt), bt->prefix_size) == 0;
+}
+
+/*
+ * The prefix shared by all the keys in a sorted set is the prefix
+ * shared by the least and greatest keys.  It can include all of the
+ * least key if it's a prefix of the greatest, but a common prefix has
+ * to be shorter than all the keys.
+ */
+static u8 shared_prefix_size(void *lo, u8 lo_size, void *hi, u8 hi_size)
+{
+	u8 *a = lo;
+	u8 *b = hi;
+	u8 n = 0;
+
+	if (lo_size == 0)
+		return 0;
+
+	while (n < lo_size && n < hi_size && a[n] == b[n])
+		n++;
+
+	return n == lo_size ? n - 1 : n;
+}
+
+/*
+ * Return the size of the longest common prefix of a flagged block's
+ * keys and an optional additional key.  Blocks without items don't
+ * have a common prefix.
+ */
+static u8 best_prefix_size(struct ngnfs_btree_block *bt, void *key, u16 key_size)
+{
+	u8 lo_buf[NGNFS_BTREE_KEY_SIZE_MAX];
+	u8 hi_buf[NGNFS_BTREE_KEY_SIZE_MAX];
+	u16 nr = le16_to_cpu(bt->nr_items);
+	void *lo = lo_buf;
+	void *hi = hi_buf;
+	u8 lo_size;
+	u8 hi_size;
+
+	if (!(bt->flags & NGNFS_BTREE_FLAG_PREFIX) || nr == 0)
+		return 0;
+
+	lo_size = full_key(bt, item_ptr(bt, 0), lo_buf);
+	hi_size = full_key(bt, item_ptr(bt, nr - 1), hi_buf);
+
+	if (key && cmp_keys(key, key_size, lo, lo_size) < 0) {
+		lo = key;
+		lo_size = key_size;
+	} else if (key && cmp_keys(key, key_size, hi, hi_size) > 0) {
+		hi = key;
+		hi_size = key_size;
+	}
+
+	return shared_prefix_size(lo, lo_size, hi, hi_size);
+}
+
+/*
+ * Returns true if the block's items and a new item would fit in the
+ * given used size if the items' keys were stored after the given common
+ * prefix.  Each item's key changes by the difference in prefix sizes
+ * and the stored prefix changes once.
+ */
+static bool fits_with_prefix(struct ngnfs_btree_block *bt, u8 ps, u16 key_size, u16 val_size,
+			     u32 max_used)
+{
+	int nr = le16_to_cpu(bt->nr_items);
+
+	return (int)used_size(bt) + (nr - 1) * ((int)bt->prefix_size - ps) +
+	       ITEM_OFF_SIZE + key_val_size(key_size - ps, val_size) <= (int)max_used;
+}
+
 static void insert_item(struct ngnfs_btree_block *bt, u16 pos, void *key, size_t key_size,
 			void *val, size_t val_size)
 {
@@ -252,6 +646,216 @@ static void remove_item(struct ngnfs_btree_block *bt, u16 pos)
 	le16_add_cpu(&bt->nr_items, -1);
 }
 
+/*
+ * Rebuilding a block copies it aside and writes its items back.  Each
+ * thread has its own copy so that rebuilding doesn't allocate.
+ */
+static __thread u8 scratch_block[NGNFS_BLOCK_SIZE] __attribute__((__aligned__(16)));
+
+/*
+ * Add an item after the existing items in a block that is being
+ * rebuilt.  Items are packed down from the end of the item region so
+ * there's never free space between them.  Returns false if the item
+ * and its offset would overlap.
+ */
+static bool pack_item(struct ngnfs_btree_block *bt, u16 *off, void *key, u8 key_size,
+		      void *val, u16 val_size)
+{
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 size = key_val_size(key_size, val_size);
+	struct ngnfs_btree_item *item;
+
+	if (*off < offsetof(struct ngnfs_btree_block, item_off[nr + 1]) + size)
+		return false;
+
+	*off -= size;
+	le16_add_cpu(&bt->nr_items, 1);
+	set_item_off(bt, nr, *off);
+
+	item = item_ptr(bt, nr);
+	item->key_size = key_size;
+	put_unaligned_le16(val_size, &item->val_size);
+	memcpy(key_ptr(item), key, key_size);
+	memcpy(val_ptr(item), val, val_size);
+
+	return true;
+}
+
+/*
+ * Start rebuilding a block by removing its items and setting its common
+ * prefix, returning the offset that packed items end at.
+ */
+static u16 reset_items(struct ngnfs_btree_block *bt, void *prefix, u8 prefix_size)
+{
+	bt->nr_items = 0;
+	bt->prefix_size = prefix_size;
+	memcpy(common_prefix_ptr(bt), prefix, prefix_size);
+
+	return items_end(bt);
+}
+
+static void finish_items(struct ngnfs_btree_block *bt, u16 off)
+{
+	set_avail_free_end(bt, off);
+	bt->total_free = bt->avail_free;
+}
+
+/*
+ * Pack an item from another block after the existing items, storing
+ * its key after the destination's common prefix.
+ */
+static bool pack_block_item(struct ngnfs_btree_block *bt, u16 *off,
+			    struct ngnfs_btree_block *src, struct ngnfs_btree_item *item)
+{
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
+	u8 ps = bt->prefix_size;
+	u8 key_size;
+
+	if (src->prefix_size == ps)
+		return pack_item(bt, off, key_ptr(item), item->key_size, val_ptr(item),
+				 get_unaligned_le16(&item->val_size));
+
+	key_size = full_key(src, item, key);
+	return pack_item(bt, off, key + ps, key_size - ps, val_ptr(item),
+			 get_unaligned_le16(&item->val_size));
+}
+
+/*
+ * Rebuild a block with a new common prefix size.  The caller has made
+ * sure that the prefix is shared by all the keys and that the items
+ * fit.
+ */
+static void repack(struct ngnfs_btree_block *bt, u8 prefix_size)
+{
+	struct ngnfs_btree_block *old = (void *)scratch_block;
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 off;
+	u16 i;
+
+	memcpy(old, bt, NGNFS_BLOCK_SIZE);
+	if (nr > 0)
+		full_key(old, item_ptr(old, 0), key);
+
+	off = reset_items(bt, key, prefix_size);
+	for (i = 0; i < nr; i++)
+		BUG_ON(!pack_block_item(bt, &off, old, item_ptr(old, i)));
+	finish_items(bt, off);
+}
+
+/*
+ * Make room to insert an item with the given full key, returning the
+ * part of the key that's stored in the item.  The used size after
+ * insertion can't exceed @max_used.  Blocks with common prefixes are
+ * repacked if the key doesn't have the prefix, or if a longer shared
+ * prefix would make room for the item.
+ */
+static int make_item_avail(struct ngnfs_btree_block *bt, void **key, size_t *key_size,
+			   size_t val_size, u32 max_used)
+{
+	u8 ps = bt->prefix_size;
+
+	if ((bt->flags & NGNFS_BTREE_FLAG_PREFIX) &&
+	    (!has_common_prefix(bt, *key, *key_size) ||
+	     !fits_with_prefix(bt, ps, *key_size, val_size, max_used)))
+		ps = best_prefix_size(bt, *key, *key_size);
+
+	if (!fits_with_prefix(bt, ps, *key_size, val_size, max_used))
+		return -ENOSPC;
+
+	if (ps != bt->prefix_size)
+		repack(bt, ps);
+
+	*key += ps;
+	*key_size -= ps;
+	BUG_ON(!make_avail(bt, ITEM_OFF_SIZE + key_val_size(*key_size, val_size)));
+
+	return 0;
+}
+
+static void pack_run(struct ngnfs_btree_block *bt, u16 *off, struct ngnfs_btree_block *src,
+		     u16 first, u16 nr)
+{
+	u16 i;
+
+	for (i = first; i < first + nr; i++)
+		BUG_ON(!pack_block_item(bt, off, src, item_ptr(src, i)));
+}
+
+/*
+ * Return the size of the common prefix of the keys of a sorted run of
+ * items from the least and greatest items, leaving the least key in
+ * the caller's buffer.
+ */
+static u8 run_prefix_size(struct ngnfs_btree_block *lo_bt, struct ngnfs_btree_item *lo_item,
+			  struct ngnfs_btree_block *hi_bt, struct ngnfs_btree_item *hi_item,
+			  u8 *lo)
+{
+	u8 hi[NGNFS_BTREE_KEY_SIZE_MAX];
+	u8 lo_size = full_key(lo_bt, lo_item, lo);
+	u8 hi_size = full_key(hi_bt, hi_item, hi);
+
+	return shared_prefix_size(lo, lo_size, hi, hi_size);
+}
+
+/*
+ * Move items between blocks that can have common prefixes by repacking
+ * both blocks with the prefixes shared by their resulting items.  The
+ * caller has made sure that the full keys of the moved items fit in
+ * the destination.
+ */
+static void move_repacked(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *src,
+			  bool src_first, u16 nr)
+{
+	struct ngnfs_btree_block *old = (void *)scratch_block;
+	struct ngnfs_btree_item *lo;
+	struct ngnfs_btree_item *hi;
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
+	u16 dst_nr = le16_to_cpu(dst->nr_items);
+	u16 src_nr = le16_to_cpu(src->nr_items);
+	u16 first = src_first ? 0 : src_nr - nr;
+	u16 off;
+	u8 ps = 0;
+
+	memcpy(old, dst, NGNFS_BLOCK_SIZE);
+
+	if (dst->flags & NGNFS_BTREE_FLAG_PREFIX) {
+		if (src_first) {
+			lo = dst_nr ? item_ptr(old, 0) : item_ptr(src, 0);
+			hi = item_ptr(src, nr - 1);
+			ps = run_prefix_size(dst_nr ? old : src, lo, src, hi, key);
+		} else {
+			lo = item_ptr(src, first);
+			hi = dst_nr ? item_ptr(old, dst_nr - 1) : item_ptr(src, src_nr - 1);
+			ps = run_prefix_size(src, lo, dst_nr ? old : src, hi, key);
+		}
+	}
+
+	off = reset_items(dst, key, ps);
+	if (src_first) {
+		pack_run(dst, &off, old, 0, dst_nr);
+		pack_run(dst, &off, src, first, nr);
+	} else {
+		pack_run(dst, &off, src, first, nr);
+		pack_run(dst, &off, old, 0, dst_nr);
+	}
+	finish_items(dst, off);
+
+	/* then repack the items that remain in the source */
+	memcpy(old, src, NGNFS_BLOCK_SIZE);
+	first = src_first ? nr : 0;
+	src_nr -= nr;
+	ps = 0;
+
+	if ((src->flags & NGNFS_BTREE_FLAG_PREFIX) && src_nr > 0)
+		ps = run_prefix_size(old, item_ptr(old, first), old,
+				     item_ptr(old, first + src_nr - 1), key);
+
+	off = reset_items(src, key, ps);
+	pack_run(src, &off, old, first, src_nr);
+	finish_items(src, off);
+}
+
 /*
  * Move items from the end of one btree block to the opposite end of
  * another.
@@ -260,48 +864,56 @@ static void remove_item(struct ngnfs_btree_block *bt, u16 pos)
  * the last item in the dst, or vice versa.
  *
  * @drain_src tells us if we're moving all the items from the src into
- * the dst or if we're trying to balance the space consumed by the items
- * in the blocks.  We always move at least one item, even if we weren't
- * draining and the item utilization of the blocks is equal as we're
- * called.
+ * the dst or if we're moving @move_pct of the difference in the space
+ * consumed by the items in the blocks, with 50 balancing them.  We
+ * always move at least one item, even if we weren't draining and the
+ * item utilization of the blocks is equal as we're called, and we
+ * never empty the src unless we're draining it.
  */
 static void move_items(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *src,
-		       bool src_first, bool drain_src)
+		       bool src_first, bool drain_src, u8 move_pct)
 {
 	struct ngnfs_btree_item *src_item;
 	struct ngnfs_btree_item *dst_item;
-	s16 target;
-	s16 moving;
+	u16 src_nr = le16_to_cpu(src->nr_items);
+	int target;
+	int moving;
+	int room;
 	u16 size;
 	u16 off;
 	u16 nr;
 	u16 s;
 	u16 d;
-	s16 i;
+	u16 i;
 
-	BUG_ON(le16_to_cpu(src->nr_items) == 0);
+	BUG_ON(src_nr == 0);
 
-	/* find the number of items to move */
+	/* find the number of items to move, measured by their full key sizes */
 	if (drain_src) {
-		nr = le16_to_cpu(src->nr_items);
+		nr = src_nr;
 		moving = used_size(src);
 	} else {
-		target = (used_size(src) - used_size(dst)) >> 1;
-		nr = 0;
+		target = ((int)full_used_size(src) - (int)full_used_size(dst)) * move_pct / 100;
+		room = NGNFS_BTREE_MAX_FREE - full_used_size(dst);
 		moving = 0;
-		if (src_first) {
-			for (i = 0; moving <= target && i < le16_to_cpu(src->nr_items); i++, nr++)
-				moving += total_item_size(item_ptr(src, i));
-		} else {
-			for (i = le16_to_cpu(src->nr_items) - 1; i >= 0; i--, nr++)
-				moving += total_item_size(item_ptr(src, i));
+		for (nr = 0; nr == 0 || nr < src_nr - 1; nr++) {
+			i = src_first ? nr : src_nr - 1 - nr;
+			size = total_item_size(item_ptr(src, i)) + src->prefix_size;
+			if (nr > 0 && (moving > target || moving + size > room))
+				break;
+			moving += size;
 		}
 	}
 
+	if ((dst->flags | src->flags) & NGNFS_BTREE_FLAG_PREFIX) {
+		move_repacked(dst, src, src_first, nr);
+		return;
+	}
+
 	/* setup item regions for iterative walk of both regions */
 	if (src_first) {
 		s = 0;
-		d = le16_to_cpu(dst->nr_items) - nr;
+		d = le16_to_cpu(dst->nr_items);
 	} else {
 		s = le16_to_cpu(src->nr_items) - nr;
 		d = 0;
@@ -313,6 +925,7 @@ static void move_items(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *
 		memmove_tail_offs(dst, 0, nr);
 
 	off = avail_free_end(dst);
+	le16_add_cpu(&dst->nr_items, nr);
 	for (i = 0; i < nr; i++) {
 		src_item = item_ptr(src, s + i);
 		size = item_size(src_item);
@@ -330,8 +943,8 @@ static void move_items(struct ngnfs_btree_block *dst, struct ngnfs_btree_block *
 
 	le16_add_cpu(&src->nr_items, -nr);
 	le16_add_cpu(&src->total_free, moving);
+	le16_add_cpu(&src->avail_free, nr * ITEM_OFF_SIZE);
 
-	le16_add_cpu(&dst->nr_items, nr);
 	le16_add_cpu(&dst->total_free, -moving);
 	dst->avail_free = dst->total_free; /* dst was compacted, total == avail */
 }
@@ -349,42 +962,60 @@ static void init_btree_ref(struct ngnfs_btree_ref *ref, struct ngnfs_btree_block
 static void insert_parent_item(struct ngnfs_btree_block *bt, u16 pos,
 			       struct ngnfs_btree_block *child)
 {
-	struct ngnfs_btree_item *last = last_item_ptr(child);
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
 	struct ngnfs_btree_ref ref;
+	u8 key_size;
 
 	init_btree_ref(&ref, child);
+	key_size = full_key(child, last_item_ptr(child), key);
 
-	insert_item(bt, pos, key_ptr(last), last->key_size, &ref, sizeof(ref));
+	/* callers ensure that parents have room for a parent item */
+	BUG_ON(!make_avail(bt, ITEM_OFF_SIZE + key_val_size(key_size, sizeof(ref))));
+	insert_item(bt, pos, key, key_size, &ref, sizeof(ref));
 }
 
+/*
+ * Keys are variable length so we replace the parent item rather than
+ * overwriting its key.
+ */
 static void update_parent_key(struct ngnfs_btree_block *bt, u16 pos,
 			      struct ngnfs_btree_block *child)
 {
 	struct ngnfs_btree_item *item = item_ptr(bt, pos);
-	struct ngnfs_btree_item *last = last_item_ptr(child);
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
+	struct ngnfs_btree_ref ref;
+	u8 key_size;
 
 	/* should be verified on read */
-	BUG_ON(item->key_size != last->key_size);
+	BUG_ON(get_unaligned_le16(&item->val_size) != sizeof(ref));
 
-	memcpy(key_ptr(item), key_ptr(last), last->key_size);
+	memcpy(&ref, val_ptr(item), sizeof(ref));
+	remove_item(bt, pos);
+
+	key_size = full_key(child, last_item_ptr(child), key);
+	BUG_ON(!make_avail(bt, ITEM_OFF_SIZE + key_val_size(key_size, sizeof(ref))));
+	insert_item(bt, pos, key, key_size, &ref, sizeof(ref));
 }
 
 static void update_parent_ref(struct ngnfs_btree_block *bt, u16 pos,
 			      struct ngnfs_btree_block *child)
 {
 	struct ngnfs_btree_item *item = item_ptr(bt, pos);
-	struct ngnfs_btree_item *last = last_item_ptr(child);
 	struct ngnfs_btree_ref ref;
 
 	init_btree_ref(&ref, child);
 
 	/* should be verified on read */
-	BUG_ON(get_unaligned_le16(&item->val_size) != get_unaligned_le16(&last->val_size));
+	BUG_ON(get_unaligned_le16(&item->val_size) != sizeof(ref));
 
-	memcpy(val_ptr(item), val_ptr(last), get_unaligned_le16(&last->val_size));
+	memcpy(val_ptr(item), &ref, sizeof(ref));
 }
 
-void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level)
+/*
+ * Only leaf blocks can be flagged to store a common key prefix, parent
+ * blocks ignore the prefix flag.
+ */
+void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level, u8 flags)
 {
 	/* XXX do we want to zero the block here?  callers' responsibility? */
 	bt->bnr = 0; /* XXX */
@@ -392,6 +1023,8 @@ void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level)
 	bt->total_free = cpu_to_le16(NGNFS_BTREE_MAX_FREE);
 	bt->avail_free = bt->total_free;
 	bt->level = level;
+	bt->flags = level ? flags & ~NGNFS_BTREE_FLAG_PREFIX : flags;
+	bt->prefix_size = 0;
 }
 
 int ngnfs_btree_lookup(struct ngnfs_btree_block *bt, void *key, size_t key_size,
@@ -401,7 +1034,7 @@ int ngnfs_btree_lookup(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 	struct ngnfs_btree_item *item;
 	int ret;
 
-	res = btree_search(bt, key, key_size);
+	res = btree_search(bt, NULL, key, key_size);
 
 	if (res.cmp == 0) {
 		item = item_ptr(bt, res.pos);
@@ -421,28 +1054,75 @@ int ngnfs_btree_insert(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 	struct btree_search_result res;
 	int ret;
 
-	if (WARN_ON_ONCE(key_size == 0 || key_size > NGNFS_BTREE_KEY_SIZE_MAX ||
-			 val_size > NGNFS_BTREE_VAL_SIZE_MAX))
+	if (WARN_ON_ONCE(!valid_key_size(bt, key_size) || val_size > NGNFS_BTREE_VAL_SIZE_MAX))
 		return -EINVAL;
 
-	res = btree_search(bt, key, key_size);
+	res = btree_search(bt, NULL, key, key_size);
 
 	if (res.cmp == 0) {
 		ret = -EEXIST;
 	} else {
-		insert_item(bt, res.pos, key, key_size, val, val_size);
-		ret = 0;
+		ret = make_item_avail(bt, &key, &key_size, val_size, NGNFS_BTREE_MAX_FREE);
+		if (ret == 0)
+			insert_item(bt, res.pos, key, key_size, val, val_size);
 	}
 
 	return ret;
 }
 
+/*
+ * Add an item after all the existing items without searching, for
+ * building blocks from sorted items.  Returns -ENOSPC if the item would
+ * take the block's utilization past the fill percentage, though an
+ * empty block always accepts an item.
+ */
+int ngnfs_btree_append(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+		       void *val, size_t val_size, u8 fill_pct)
+{
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u32 max_used = NGNFS_BTREE_MAX_FREE;
+	int ret;
+
+	if (WARN_ON_ONCE(!valid_key_size(bt, key_size) || val_size > NGNFS_BTREE_VAL_SIZE_MAX))
+		return -EINVAL;
+
+	if (nr > 0) {
+		if (cmp_key_item(bt, key, key_size, last_item_ptr(bt)) <= 0)
+			return -EINVAL;
+
+		max_used = (u32)fill_pct * NGNFS_BTREE_MAX_FREE / 100;
+	}
+
+	ret = make_item_avail(bt, &key, &key_size, val_size, max_used);
+	if (ret == 0)
+		insert_item(bt, nr, key, key_size, val, val_size);
+
+	return ret;
+}
+
+/*
+ * Append a parent item that references the child block, for building
+ * parent blocks from sorted children.
+ */
+int ngnfs_btree_append_child(struct ngnfs_btree_block *bt, struct ngnfs_btree_block *child,
+			     u8 fill_pct)
+{
+	u8 key[NGNFS_BTREE_KEY_SIZE_MAX];
+	struct ngnfs_btree_ref ref;
+	u8 key_size;
+
+	init_btree_ref(&ref, child);
+	key_size = full_key(child, last_item_ptr(child), key);
+
+	return ngnfs_btree_append(bt, key, key_size, &ref, sizeof(ref), fill_pct);
+}
+
 int ngnfs_btree_delete(struct ngnfs_btree_block *bt, void *key, size_t key_size)
 {
 	struct btree_search_result res;
 	int ret;
 
-	res = btree_search(bt, key, key_size);
+	res = btree_search(bt, NULL, key, key_size);
 
 	if (res.cmp == 0) {
 		remove_item(bt, res.pos);
@@ -454,16 +1134,423 @@ int ngnfs_btree_delete(struct ngnfs_btree_block *bt, void *key, size_t key_size)
 	return ret;
 }
 
+/*
+ * Replace the value of an existing item.  Values of the same size are
+ * overwritten.  The lowest item in the block can grow into or shrink
+ * back into the contiguous free region by moving its header and key,
+ * and other items can shrink in place, leaving free space after their
+ * value.  Only growing other items falls back to removing and
+ * reinserting the item.  Returns -ENOENT if the key doesn't exist and
+ * -ENOSPC if the new value doesn't fit, leaving the item unchanged.
+ */
+int ngnfs_btree_update(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+		       void *val, size_t val_size)
+{
+	struct btree_search_result res;
+	struct ngnfs_btree_item *item;
+	u16 head_size;
+	u16 old_size;
+	u16 off;
+	int delta;
+
+	if (WARN_ON_ONCE(val_size > NGNFS_BTREE_VAL_SIZE_MAX))
+		return -EINVAL;
+
+	res = btree_search(bt, NULL, key, key_size);
+	if (res.cmp != 0)
+		return -ENOENT;
+
+	item = item_ptr(bt, res.pos);
+	old_size = get_unaligned_le16(&item->val_size);
+	delta = (int)val_size - (int)old_size;
+
+	if (delta == 0) {
+		memcpy(val_ptr(item), val, val_size);
+		return 0;
+	}
+
+	off = get_item_off(bt, res.pos);
+	if (off == avail_free_end(bt) && delta <= (int)le16_to_cpu(bt->avail_free)) {
+		head_size = key_val_size(item->key_size, 0);
+		off -= delta;
+		memmove((void *)bt + off, item, head_size);
+		set_item_off(bt, res.pos, off);
+		le16_add_cpu(&bt->avail_free, -delta);
+		le16_add_cpu(&bt->total_free, -delta);
+
+	} else if (delta < 0) {
+		le16_add_cpu(&bt->total_free, -delta);
+
+	} else {
+		if (le16_to_cpu(bt->total_free) < delta)
+			return -ENOSPC;
+
+		/* the stored key doesn't include the block's common prefix */
+		key += bt->prefix_size;
+		key_size -= bt->prefix_size;
+		remove_item(bt, res.pos);
+		BUG_ON(!make_avail(bt, ITEM_OFF_SIZE + key_val_size(key_size, val_size)));
+		insert_item(bt, res.pos, key, key_size, val, val_size);
+		return 0;
+	}
+
+	item = item_ptr(bt, res.pos);
+	put_unaligned_le16(val_size, &item->val_size);
+	memcpy(val_ptr(item), val, val_size);
+	return 0;
+}
+
+/*
+ * Return the size of the longest common prefix of a flagged block's
+ * keys and the keys of the first and last insertions in a batch,
+ * leaving the least of the keys in the caller's buffer.
+ */
+static u8 batch_prefix_size(struct ngnfs_btree_block *bt, struct ngnfs_btree_op *ops,
+			    unsigned int nr_ops, u8 *lo)
+{
+	u8 hi_buf[NGNFS_BTREE_KEY_SIZE_MAX];
+	struct ngnfs_btree_op *first = NULL;
+	struct ngnfs_btree_op *last = NULL;
+	u16 nr = le16_to_cpu(bt->nr_items);
+	void *hi = hi_buf;
+	u8 lo_size = 0;
+	u8 hi_size = 0;
+	unsigned int o;
+
+	if (!(bt->flags & NGNFS_BTREE_FLAG_PREFIX))
+		return 0;
+
+	for (o = 0; o < nr_ops; o++) {
+		if (ops[o].type == NGNFS_BTREE_OP_INSERT) {
+			if (!first)
+				first = &ops[o];
+			last = &ops[o];
+		}
+	}
+
+	if (nr > 0) {
+		lo_size = full_key(bt, item_ptr(bt, 0), lo);
+		hi_size = full_key(bt, item_ptr(bt, nr - 1), hi_buf);
+	}
+
+	if (first && (nr == 0 || cmp_keys(first->key, first->key_size, lo, lo_size) < 0)) {
+		memcpy(lo, first->key, first->key_size);
+		lo_size = first->key_size;
+	}
+	if (last && (nr == 0 || cmp_keys(last->key, last->key_size, hi, hi_size) > 0)) {
+		hi = last->key;
+		hi_size = last->key_size;
+	}
+
+	return shared_prefix_size(lo, lo_size, hi, hi_size);
+}
+
+/*
+ * Apply a sorted batch of insertions and deletions to the block.  The
+ * existing items and the ops are merged in one pass that writes the
+ * resulting items into a compacted block in key order, rather than
+ * shifting the offset array for each item.
+ *
+ * The batch is applied entirely or not at all.  Returns -EINVAL if the
+ * ops aren't sorted or have invalid sizes, -EEXIST if an inserted key
+ * exists, -ENOENT if a deleted key doesn't exist, and -ENOSPC if the
+ * resulting items don't fit.  The block is unchanged if an error is
+ * returned.
+ */
+int ngnfs_btree_apply_batch(struct ngnfs_btree_block *bt, struct ngnfs_btree_op *ops,
+			    unsigned int nr_ops)
+{
+	struct ngnfs_btree_block *old = (void *)scratch_block;
+	struct ngnfs_btree_item *item = NULL;
+	struct ngnfs_btree_op *op = NULL;
+	u8 prefix[NGNFS_BTREE_KEY_SIZE_MAX];
+	unsigned int o = 0;
+	u16 nr;
+	u16 off;
+	u16 i = 0;
+	u8 ps;
+	int cmp;
+	int ret;
+
+	if (nr_ops == 0)
+		return 0;
+
+	memcpy(old, bt, NGNFS_BLOCK_SIZE);
+	nr = le16_to_cpu(old->nr_items);
+
+	ps = batch_prefix_size(old, ops, nr_ops, prefix);
+	off = reset_items(bt, prefix, ps);
+
+	while (i < nr || o < nr_ops) {
+		if (o < nr_ops && op != &ops[o]) {
+			op = &ops[o];
+			if (WARN_ON_ONCE(!valid_key_size(old, op->key_size) ||
+					 op->val_size > NGNFS_BTREE_VAL_SIZE_MAX ||
+					 op->type > NGNFS_BTREE_OP_DELETE) ||
+			    (o > 0 && cmp_keys(op->key, op->key_size,
+					       ops[o - 1].key, ops[o - 1].key_size) <= 0)) {
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+
+		if (i < nr)
+			item = item_ptr(old, i);
+
+		if (i < nr && o < nr_ops)
+			cmp = cmp_key_item(old, op->key, op->key_size, item);
+		else
+			cmp = i < nr ? 1 : -1;
+
+		if (cmp > 0) {
+			/* existing item sorts before the next op */
+			if (!pack_block_item(bt, &off, old, item)) {
+				ret = -ENOSPC;
+				goto out;
+			}
+			i++;
+
+		} else if (op->type == NGNFS_BTREE_OP_DELETE) {
+			if (cmp < 0) {
+				ret = -ENOENT;
+				goto out;
+			}
+			/* skip the deleted item */
+			i++;
+			o++;
+
+		} else {
+			if (cmp == 0) {
+				ret = -EEXIST;
+				goto out;
+			}
+			/* only unsorted ops can be outside the first and last inserted keys */
+			if (!has_common_prefix(bt, op->key, op->key_size)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			if (!pack_item(bt, &off, op->key + ps, op->key_size - ps, op->val,
+				       op->val_size)) {
+				ret = -ENOSPC;
+				goto out;
+			}
+			o++;
+		}
+	}
+
+	/* blocks without items don't have a common prefix */
+	if (bt->nr_items == 0)
+		off = reset_items(bt, prefix, 0);
+
+	finish_items(bt, off);
+	ret = 0;
+out:
+	if (ret < 0)
+		memcpy(bt, old, NGNFS_BLOCK_SIZE);
+
+	return ret;
+}
+
+int ngnfs_btree_cmp_keys(const void *key_a, size_t size_a, const void *key_b, size_t size_b)
+{
+	return cmp_keys(key_a, size_a, key_b, size_b);
+}
+
+/*
+ * Return the position of the first item whose key is greater than or
+ * equal to the search key, or strictly greater if @after is set.  This
+ * returns nr_items if all the items are less than the key.
+ */
+u16 ngnfs_btree_search_pos(struct ngnfs_btree_block *bt, void *key, size_t key_size, bool after)
+{
+	return ngnfs_btree_search_pos_prefixes(bt, NULL, key, key_size, after);
+}
+
+/*
+ * Search for a position like _search_pos with the block's prefix array
+ * from _build_prefixes.  The array must have been built from the
+ * block's current items.
+ */
+u16 ngnfs_btree_search_pos_prefixes(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp,
+				    void *key, size_t key_size, bool after)
+{
+	struct btree_search_result res;
+
+	res = btree_search(bt, bp, key, key_size);
+	if (res.cmp == 0 && after)
+		res.pos++;
+
+	return res.pos;
+}
+
+/*
+ * Gather the key prefixes of a block's items into the prefix array.
+ * This returns false if the block has more items than the array can
+ * hold, which only leaf blocks can, and leaves the array empty so that
+ * searches of the block don't use it.
+ */
+bool ngnfs_btree_build_prefixes(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp)
+{
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 i;
+
+	if (nr > NGNFS_BTREE_PREFIXES_NR) {
+		bp->nr = 0;
+		return false;
+	}
+
+	for (i = 0; i < nr; i++)
+		bp->pfxs[i] = item_prefix(bt, NULL, i);
+	for (; i < nr + NGNFS_BTREE_PREFIXES_PAD; i++)
+		bp->pfxs[i] = S64_MAX;
+	bp->nr = nr;
+
+	return true;
+}
+
+/*
+ * Copy the key and value of the item at the given position.  The key
+ * buffer must be able to hold the max key size.  Like lookup, this
+ * returns the number of value bytes copied.
+ */
+int ngnfs_btree_item_at(struct ngnfs_btree_block *bt, u16 pos, void *key, size_t *key_size,
+			void *val, size_t val_size)
+{
+	struct ngnfs_btree_item *item;
+	int ret;
+
+	if (pos >= le16_to_cpu(bt->nr_items))
+		return -ENOENT;
+
+	item = item_ptr(bt, pos);
+	if (key)
+		*key_size = full_key(bt, item, key);
+
+	ret = min(val_size, get_unaligned_le16(&item->val_size));
+	if (ret > 0)
+		memcpy(val, val_ptr(item), ret);
+
+	return ret;
+}
+
+/*
+ * Return the block number of the child referenced by the parent item
+ * at the given position.
+ */
+int ngnfs_btree_child(struct ngnfs_btree_block *bt, u16 pos, u64 *bnr)
+{
+	struct ngnfs_btree_item *item;
+	struct ngnfs_btree_ref ref;
+
+	if (bt->level == 0 || pos >= le16_to_cpu(bt->nr_items))
+		return -EIO;
+
+	item = item_ptr(bt, pos);
+	if (get_unaligned_le16(&item->val_size) != sizeof(ref))
+		return -EIO;
+
+	memcpy(&ref, val_ptr(item), sizeof(ref));
+	*bnr = le64_to_cpu(ref.bnr);
+	return 0;
+}
+
+/*
+ * Returns true if an item with the given key and value size could be
+ * inserted, possibly after compaction or repacking with a different
+ * common prefix.  The key can be null if it isn't known, in which case
+ * we assume that the keys would be stored without a common prefix.
+ */
+bool ngnfs_btree_has_room(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+			  size_t val_size)
+{
+	if (!(bt->flags & NGNFS_BTREE_FLAG_PREFIX))
+		return le16_to_cpu(bt->total_free) >= ITEM_OFF_SIZE + key_val_size(key_size, val_size);
+
+	if (!key)
+		return fits_with_prefix(bt, 0, key_size, val_size, NGNFS_BTREE_MAX_FREE);
+
+	return (has_common_prefix(bt, key, key_size) &&
+		fits_with_prefix(bt, bt->prefix_size, key_size, val_size, NGNFS_BTREE_MAX_FREE)) ||
+	       fits_with_prefix(bt, best_prefix_size(bt, key, key_size), key_size, val_size,
+				NGNFS_BTREE_MAX_FREE);
+}
+
+/*
+ * Returns true if a non-root block has fallen under the minimum
+ * utilization and should be refilled from a sibling.
+ */
+bool ngnfs_btree_underfull(struct ngnfs_btree_block *bt)
+{
+	return full_used_pct(bt) < NGNFS_BTREE_MIN_USED_PCT;
+}
+
+/*
+ * Parent item keys must be greater than or equal to all the keys in
+ * their child.  Inserting a key greater than all the parent keys
+ * increases the last parent key on the way down to the leaf.
+ */
+void ngnfs_btree_extend_last(struct ngnfs_btree_block *bt, void *key, size_t key_size)
+{
+	u16 pos = le16_to_cpu(bt->nr_items) - 1;
+	struct ngnfs_btree_item *item = item_ptr(bt, pos);
+	struct ngnfs_btree_ref ref;
+
+	/* should be verified on read */
+	BUG_ON(get_unaligned_le16(&item->val_size) != sizeof(ref));
+
+	memcpy(&ref, val_ptr(item), sizeof(ref));
+	remove_item(bt, pos);
+
+	BUG_ON(!make_avail(bt, ITEM_OFF_SIZE + key_val_size(key_size, sizeof(ref))));
+	insert_item(bt, pos, key, key_size, &ref, sizeof(ref));
+}
+
+/*
+ * Grow the tree by moving all the root's items into its new empty
+ * child and leaving a single parent item in the root that references
+ * it.  The child's bnr must already be set.
+ */
+void ngnfs_btree_grow(struct ngnfs_btree_block *root, struct ngnfs_btree_block *child)
+{
+	__le64 bnr = child->bnr;
+	u8 level = root->level;
+
+	memcpy(child, root, NGNFS_BLOCK_SIZE);
+	child->bnr = bnr;
+
+	bnr = root->bnr;
+	ngnfs_btree_init_block(root, level + 1, child->flags);
+	root->bnr = bnr;
+
+	insert_parent_item(root, 0, child);
+}
+
+/*
+ * Shrink the tree by copying the only child of the root into the root.
+ * The caller frees the child.
+ */
+void ngnfs_btree_shrink(struct ngnfs_btree_block *root, struct ngnfs_btree_block *child)
+{
+	__le64 bnr = root->bnr;
+
+	memcpy(root, child, NGNFS_BLOCK_SIZE);
+	root->bnr = bnr;
+}
+
 /*
  * Split the items from a full block into its empty lesser sibling.
  * Moving items to the left maintains the separator key in the existing
  * block ref and we only have to add the new sibling parent item with
  * its new separator key.
+ *
+ * @split_pct is the percentage of the block's used space that's moved
+ * to the lesser sibling.  50 balances the blocks, greater values leave
+ * room in the block for appended items.
  */
 void ngnfs_btree_split(struct ngnfs_btree_block *parent, u16 bt_pos,
-		       struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib)
+		       struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib, u8 split_pct)
 {
-	move_items(sib, bt, true, false);
+	move_items(sib, bt, true, false, split_pct);
 	insert_parent_item(parent, bt_pos, sib);
 }
 
@@ -487,9 +1574,9 @@ void ngnfs_btree_refill(struct ngnfs_btree_block *parent, u16 bt_pos, u16 sib_po
 			struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib)
 {
 	bool src_first = sib_pos > bt_pos;
-	bool drain_src = used_pct(bt) + used_pct(sib) <= NGNFS_BTREE_MIN_USED_PCT * 2;
+	bool drain_src = full_used_pct(bt) + full_used_pct(sib) <= NGNFS_BTREE_MIN_USED_PCT * 2;
 
-	move_items(bt, sib, src_first, drain_src);
+	move_items(bt, sib, src_first, drain_src, 50);
 
 	if (sib->nr_items != 0) {
 		/* update the left parent's separator key between the two blocks */
@@ -508,44 +1595,20 @@ void ngnfs_btree_refill(struct ngnfs_btree_block *parent, u16 bt_pos, u16 sib_po
 	}
 }
 
-static int cmp_item_off(const void *a, const void *b, const void *priv)
-{
-	const __le16 *off_a = a;
-	const __le16 *off_b = b;
-
-	return (int)le16_to_cpu(*off_b) - (int)le16_to_cpu(*off_a);
-}
-
-static int cmp_item_key(const void *a, const void *b, const void *priv)
-{
-	const __le16 *off_a = a;
-	const __le16 *off_b = b;
-	const struct ngnfs_btree_block *bt = priv;
-	struct ngnfs_btree_item *item_a = (void *)bt + le16_to_cpu(*off_a);
-	struct ngnfs_btree_item *item_b = (void *)bt + le16_to_cpu(*off_b);
-
-	return cmp_keys(key_ptr(item_a), item_a->key_size,
-			key_ptr(item_b), item_b->key_size);
-}
-
-/* kernel's lib/sort.c doesn't have a _16 variant */
-static void swap_words_16(void *a, void *b, int n, const void *priv)
-{
-        do {
-                u16 t = *(u16 *)(a + (n -= 4));
-                *(u16 *)(a + n) = *(u16 *)(b + n);
-                *(u16 *)(b + n) = t;
-        } while (n);
-}
-
 /*
  * Move all the items to the end of the block so that all the free space
  * is gathered for allocation between the item offsets and the first
  * item.
+ *
+ * All the items are after the contiguous free region so we copy that
+ * part of the block aside and pack the items back down from the end in
+ * key order.  That leaves the offset array sorted without comparing
+ * any keys.
  */
 void ngnfs_btree_compact(struct ngnfs_btree_block *bt)
 {
 	struct ngnfs_btree_item *item;
+	u16 start;
 	u16 size;
 	u16 off;
 	u16 nr;
@@ -554,84 +1617,109 @@ void ngnfs_btree_compact(struct ngnfs_btree_block *bt)
 	if (bt->avail_free == bt->total_free)
 		return;
 
-	nr = le16_to_cpu(bt->nr_items);
-	sort_r(&bt->item_off[0], nr, sizeof(bt->item_off[0]), cmp_item_off, swap_words_16, bt);
+	start = avail_free_end(bt);
+	memcpy(scratch_block + start, (void *)bt + start, NGNFS_BLOCK_SIZE - start);
 
-	off = NGNFS_BLOCK_SIZE;
-	for (i = nr - 1; i >= 0; i--) {
-		item = item_ptr(bt, i);
+	nr = le16_to_cpu(bt->nr_items);
+	off = items_end(bt);
+	for (i = 0; i < nr; i++) {
+		item = (void *)scratch_block + get_item_off(bt, i);
 		size = item_size(item);
 		off -= size;
-		if (get_item_off(bt, i) != off) {
-			set_item_off(bt, i, off);
-			memmove(item_ptr(bt, i), item, size);
-		}
+		memcpy((void *)bt + off, item, size);
+		set_item_off(bt, i, off);
 	}
 
 	bt->avail_free = bt->total_free;
+}
+
+/*
+ * Mark the bytes covered by an item in a bitmap of the block, returning
+ * false if any of them were already marked by another item.
+ */
+static bool mark_item_bytes(u64 *map, u16 start, u16 len)
+{
+	u64 mask;
+	u16 bit;
+	u16 nr;
+
+	while (len > 0) {
+		bit = start & 63;
+		nr = min(len, (u16)(64 - bit));
+		mask = (nr == 64 ? ~0ULL : ((1ULL << nr) - 1)) << bit;
 
-	sort_r(&bt->item_off[0], nr, sizeof(bt->item_off[0]), cmp_item_key, swap_words_16, bt);
+		if (map[start >> 6] & mask)
+			return false;
+		map[start >> 6] |= mask;
+
+		start += nr;
+		len -= nr;
+	}
+
+	return true;
 }
 
+/*
+ * Verify the structure of a block without modifying it so that it can
+ * be called on every block that's read.  Items must be within the
+ * block after the contiguous free region, can't overlap each other,
+ * must account for all the used space, and must be in strictly
+ * increasing key order.  Parent items must all contain child refs.
+ *
+ * This is linear in the number of items and the block size, overlap is
+ * found with a bitmap of the bytes in the block.
+ */
 bool ngnfs_btree_verify(struct ngnfs_btree_block *bt)
 {
+	u64 map[NGNFS_BLOCK_SIZE / 64] = { 0, };
+	struct ngnfs_btree_item *prev = NULL;
 	struct ngnfs_btree_item *item;
-	struct ngnfs_btree_item *prev;
-	unsigned long start;
-	unsigned long size;
-	unsigned long off;
-	u16 free;
+	u32 used;
+	u16 start;
+	u16 size;
 	u16 nr;
 	u16 i;
 
 	nr = le16_to_cpu(bt->nr_items);
-	if (nr > NGNFS_BTREE_MAX_ITEMS)
+	if (nr > NGNFS_BTREE_MAX_ITEMS ||
+	    (bt->flags & ~NGNFS_BTREE_FLAGS_ALL) ||
+	    (bt->level > 0 && (bt->flags & NGNFS_BTREE_FLAG_PREFIX)) ||
+	    hweight_long(bt->flags) > 1 ||
+	    (bt->prefix_size > 0 && !(bt->flags & NGNFS_BTREE_FLAG_PREFIX)) ||
+	    le16_to_cpu(bt->total_free) > NGNFS_BTREE_MAX_FREE ||
+	    le16_to_cpu(bt->avail_free) > le16_to_cpu(bt->total_free) ||
+	    avail_free_end(bt) > items_end(bt))
 		return false;
 
-	sort_r(&bt->item_off[0], nr, sizeof(bt->item_off[0]), cmp_item_off, swap_words_16, bt);
-
-	/* item payloads must be after the offset array and within the block, and not overlap */
-	off = offsetof(struct ngnfs_btree_block, item_off[nr]);
-	free = 0;
+	used = 0;
 	for (i = 0; i < nr; i++) {
 		start = get_item_off(bt, i);
-		if (start < off || (start + sizeof(struct ngnfs_btree_item)) > NGNFS_BLOCK_SIZE)
+		if (start < avail_free_end(bt) ||
+		    start > items_end(bt) - sizeof(struct ngnfs_btree_item))
 			return false;
 
 		item = item_ptr(bt, i);
 		size = item_size(item);
-		if (size > NGNFS_BLOCK_SIZE || start + size > NGNFS_BLOCK_SIZE)
+		if (item->key_size == 0 ||
+		    (fixed_key_size(bt) && item->key_size != fixed_key_size(bt)) ||
+		    get_unaligned_le16(&item->val_size) > NGNFS_BTREE_VAL_SIZE_MAX ||
+		    size > items_end(bt) - start ||
+		    !mark_item_bytes(map, start, size))
 			return false;
 
-		if (start > off)
-			free += start - off;
-
-		off = start + size;
-	}
-	free += NGNFS_BLOCK_SIZE - off;
-
-	/* avail_free can't overlap with any existing items */
-	if (avail_free_end(bt) > get_item_off(bt, 0))
-		return false;
-
-	/* total free matches free space */
-	if (le16_to_cpu(bt->total_free) != free)
-		return false;
-
-	/* XXX this will clobber(/fix) bad key sorting, but we can at least test dupes */
-	sort_r(&bt->item_off[0], nr, sizeof(bt->item_off[0]), cmp_item_key, swap_words_16, bt);
-
-	prev = item_ptr(bt, 0);
-	for (i = 1; i < nr; i++) {
-		item = item_ptr(bt, i);
+		if (bt->level > 0 &&
+		    get_unaligned_le16(&item->val_size) != sizeof(struct ngnfs_btree_ref))
+			return false;
 
 		/* sorted keys must strictly increase */
-		if (cmp_keys(key_ptr(item), item->key_size,
-			     key_ptr(prev), prev->key_size) <= 0)
+		if (prev && cmp_keys(key_ptr(item), item->key_size,
+				     key_ptr(prev), prev->key_size) <= 0)
 			return false;
 
+		used += ITEM_OFF_SIZE + size;
 		prev = item;
 	}
 
-	return true;
+	/* total free matches free space, the common prefix is used space */
+	return le16_to_cpu(bt->total_free) == NGNFS_BTREE_MAX_FREE - bt->prefix_size - used;
 }
@@ -2,18 +2,77 @@
 #ifndef NGNFS_SHARED_BTREE_H
 #define NGNFS_SHARED_BTREE_H
 
+#include "shared/lk/stddef.h"
+
 #include "shared/format-block.h"
 
-void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level);
+/*
+ * Batches of item changes are described by arrays of ops in strictly
+ * increasing key order.  Deletion ops ignore their val.
+ */
+enum {
+	NGNFS_BTREE_OP_INSERT = 0,
+	NGNFS_BTREE_OP_DELETE,
+};
+
+struct ngnfs_btree_op {
+	void *key;
+	void *val;
+	u16 val_size;
+	u8 key_size;
+	u8 type;
+};
+
+/*
+ * The key prefixes of a parent block's items can be gathered into an
+ * array so that searches don't load each probed item through its
+ * offset.  The array is only valid for the block contents it was built
+ * from and is padded so that searches can scan past the last item.
+ */
+#define NGNFS_BTREE_PREFIXES_NR								\
+	(NGNFS_BTREE_MAX_FREE / (sizeof_field(struct ngnfs_btree_block, item_off[0]) +	\
+				 sizeof(struct ngnfs_btree_item) + 1 +			\
+				 sizeof(struct ngnfs_btree_ref)))
+#define NGNFS_BTREE_PREFIXES_PAD	8
+
+struct ngnfs_btree_prefixes {
+	u16 nr;
+	s64 pfxs[NGNFS_BTREE_PREFIXES_NR + NGNFS_BTREE_PREFIXES_PAD];
+};
+
+void ngnfs_btree_init_block(struct ngnfs_btree_block *bt, u8 level, u8 flags);
 
 int ngnfs_btree_lookup(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 		       void *val, size_t val_size);
 int ngnfs_btree_insert(struct ngnfs_btree_block *bt, void *key, size_t key_size,
 		       void *val, size_t val_size);
 int ngnfs_btree_delete(struct ngnfs_btree_block *bt, void *key, size_t key_size);
+int ngnfs_btree_update(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+		       void *val, size_t val_size);
+int ngnfs_btree_apply_batch(struct ngnfs_btree_block *bt, struct ngnfs_btree_op *ops,
+			    unsigned int nr_ops);
+int ngnfs_btree_append(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+		       void *val, size_t val_size, u8 fill_pct);
+int ngnfs_btree_append_child(struct ngnfs_btree_block *bt, struct ngnfs_btree_block *child,
+			     u8 fill_pct);
+
+int ngnfs_btree_cmp_keys(const void *key_a, size_t size_a, const void *key_b, size_t size_b);
+u16 ngnfs_btree_search_pos(struct ngnfs_btree_block *bt, void *key, size_t key_size, bool after);
+u16 ngnfs_btree_search_pos_prefixes(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp,
+				    void *key, size_t key_size, bool after);
+bool ngnfs_btree_build_prefixes(struct ngnfs_btree_block *bt, struct ngnfs_btree_prefixes *bp);
+int ngnfs_btree_item_at(struct ngnfs_btree_block *bt, u16 pos, void *key, size_t *key_size,
+			void *val, size_t val_size);
+int ngnfs_btree_child(struct ngnfs_btree_block *bt, u16 pos, u64 *bnr);
+bool ngnfs_btree_has_room(struct ngnfs_btree_block *bt, void *key, size_t key_size,
+			  size_t val_size);
+bool ngnfs_btree_underfull(struct ngnfs_btree_block *bt);
+void ngnfs_btree_extend_last(struct ngnfs_btree_block *bt, void *key, size_t key_size);
+void ngnfs_btree_grow(struct ngnfs_btree_block *root, struct ngnfs_btree_block *child);
+void ngnfs_btree_shrink(struct ngnfs_btree_block *root, struct ngnfs_btree_block *child);
 
 void ngnfs_btree_split(struct ngnfs_btree_block *parent, u16 bt_pos,
-		       struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib);
+		       struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib, u8 split_pct);
 void ngnfs_btree_refill(struct ngnfs_btree_block *parent, u16 bt_pos, u16 sib_pos,
 			struct ngnfs_btree_block *bt, struct ngnfs_btree_block *sib);
 void ngnfs_btree_compact(struct ngnfs_btree_block *bt);
@@ -32,16 +32,42 @@ struct ngnfs_btree_item {
  */
 #define NGNFS_BTREE_VAL_SIZE_MAX	512
 
+/*
+ * The crc is a crc32c of the rest of the block after the crc field.
+ * It's maintained by the block cache which expects it to be the first
+ * field in all blocks.  It's calculated as blocks are written and
+ * verified as they're read.
+ *
+ * Leaf blocks with the prefix flag can store a prefix shared by
+ * all their keys once, in the final prefix_size bytes of the block,
+ * and their items only store the remainder of each key.  The prefix is
+ * always shorter than every key so that stored keys are never empty.
+ * The prefix bytes are included in the used space.
+ *
+ * Blocks in trees whose keys are all 8 or 16 bytes can be flagged with
+ * their key size, which is then the size of every item key in the
+ * block.  The key size flags are used by parent and leaf blocks but
+ * can't be combined with the prefix flag.
+ */
 struct ngnfs_btree_block {
-	__le64 bnr;
+	__le32 crc;
 	__le16 nr_items;
 	__le16 total_free;
+	__le64 bnr;
 	__le16 avail_free;
 	__u8 level;
-	__u8 _pad;
+	__u8 flags;
+	__u8 prefix_size;
+	__u8 _pad[3];
 	__le16 item_off[];
 };
 
+#define NGNFS_BTREE_FLAG_PREFIX		(1 << 0)
+#define NGNFS_BTREE_FLAG_KEY8		(1 << 1)
+#define NGNFS_BTREE_FLAG_KEY16		(1 << 2)
+#define NGNFS_BTREE_FLAGS_ALL		(NGNFS_BTREE_FLAG_PREFIX | NGNFS_BTREE_FLAG_KEY8 | \
+					 NGNFS_BTREE_FLAG_KEY16)
+
 /*
  * The minimum utilization of a block, as measured by the percentage of
  * the block after the header that contains items.  As a block's
@@ -39,14 +39,21 @@ struct ngnfs_msg_header {
 #define NGNFS_MSG_MAX_CTL_SIZE	255
 #define NGNFS_MSG_MAX_DATA_SIZE 4096
 
+/*
+ * Block requests carry an id chosen by the sender which is returned in
+ * the result so that senders can match results to the requests that
+ * they sent to multiple devds.
+ */
 struct ngnfs_msg_get_block {
 	__le64 bnr;
+	__le64 id;
 	__u8 access;
 	__u8 _pad[7];
 };
 
 struct ngnfs_msg_get_block_result {
 	__le64 bnr;
+	__le64 id;
 	__u8 access;
 	__u8 err;
 	__u8 _pad[6];
@@ -54,10 +61,12 @@ struct ngnfs_msg_get_block_result {
 
 struct ngnfs_msg_write_block {
 	__le64 bnr;
+	__le64 id;
 };
 
 struct ngnfs_msg_write_block_result {
 	__le64 bnr;
+	__le64 id;
 	__u8 err;
 	__u8 _pad[7];
 };
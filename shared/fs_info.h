@@ -6,6 +6,7 @@
  * The _fs_info struct is the global system context reference.  Each layer has its
  * info per-system info stored here.
  */
+struct devd_map_info;
 struct ngnfs_block_info;
 struct ngnfs_manifest_info;
 struct ngnfs_msg_info;
@@ -14,6 +15,7 @@ struct ngnfs_fs_info {
 	struct ngnfs_block_info *block_info;
 	struct ngnfs_manifest_info *manifest_info;
 	struct ngnfs_msg_info *msg_info;
+	struct devd_map_info *map_info;
 };
 
 #define INIT_NGNFS_FS_INFO { NULL, }
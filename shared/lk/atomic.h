@@ -60,6 +60,18 @@ static inline bool PREFIX##dec_and_test(ATOMIC *v)			\
 	return uatomic_add_return(&v->counter, -1) == 0;		\
 }									\
 									\
+static inline TYPE PREFIX##dec_if_positive(ATOMIC *v)			\
+{									\
+	TYPE old;							\
+									\
+	do {								\
+		old = uatomic_read(&v->counter);			\
+	} while (old > 0 &&						\
+		 uatomic_cmpxchg(&v->counter, old, old - 1) != old);	\
+									\
+	return old - 1;							\
+}									\
+									\
 static inline void PREFIX##add(TYPE i, ATOMIC *v)			\
 {									\
 	uatomic_add(&v->counter, i);					\
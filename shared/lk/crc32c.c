@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * We're always built with -msse4.2 so we unconditionally use the crc32
+ * instruction instead of the kernel's table-driven fallback.
+ *
+ * A single dependent chain of crc32 instructions is limited by the
+ * instruction's latency (3 cycles) though it can issue every cycle.
+ * Larger buffers are split into three adjacent streams whose crcs are
+ * calculated concurrently and then combined.  Combining shifts the
+ * earlier crc over the length of the following stream, which is a
+ * multiplication by x^(8 * len) modulo the polynomial.  We precompute
+ * the multiplication for the two stream lengths we use as bytewise
+ * tables.
+ *
+ * The long stream length is chosen so that three streams cover all but
+ * a small tail of a 4KiB block or message data page.
+ */
+
+#include <nmmintrin.h>
+
+#include "shared/lk/crc32c.h"
+#include "shared/lk/types.h"
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+#define LONG_LEN	1360
+#define SHORT_LEN	256
+
+static u32 long_shift[4][256];
+static u32 short_shift[4][256];
+
+/*
+ * Multiply two reflected polynomials modulo the crc32c polynomial.
+ */
+static u32 gf2_multiply(u32 a, u32 b)
+{
+	u32 prod = 0;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (a & (0x80000000U >> i))
+			prod ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return prod;
+}
+
+static void init_shift_table(u32 table[4][256], unsigned int len)
+{
+	u32 xpow = 0x80000000U; /* x^0 */
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < len * 8; i++)
+		xpow = (xpow & 1) ? (xpow >> 1) ^ CRC32C_POLY : xpow >> 1;
+
+	for (n = 0; n < 256; n++) {
+		table[0][n] = gf2_multiply(xpow, n);
+		table[1][n] = gf2_multiply(xpow, n << 8);
+		table[2][n] = gf2_multiply(xpow, n << 16);
+		table[3][n] = gf2_multiply(xpow, (u32)n << 24);
+	}
+}
+
+__attribute__((constructor)) static void init_crc32c_tables(void)
+{
+	init_shift_table(long_shift, LONG_LEN);
+	init_shift_table(short_shift, SHORT_LEN);
+}
+
+static inline u32 shift_crc(u32 table[4][256], u32 crc)
+{
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+	       table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+/*
+ * Calculate the crc of three adjacent len byte streams, len must be a
+ * multiple of 8.
+ */
+static inline u32 crc32c_triple(u32 crc, const u8 *p, unsigned int len, u32 table[4][256])
+{
+	const u8 *end = p + len;
+	u64 crc0 = crc;
+	u64 crc1 = 0;
+	u64 crc2 = 0;
+
+	do {
+		crc0 = _mm_crc32_u64(crc0, *(const u64 *)p);
+		crc1 = _mm_crc32_u64(crc1, *(const u64 *)(p + len));
+		crc2 = _mm_crc32_u64(crc2, *(const u64 *)(p + (2 * len)));
+		p += 8;
+	} while (p < end);
+
+	crc0 = shift_crc(table, crc0) ^ crc1;
+	return shift_crc(table, crc0) ^ crc2;
+}
+
+u32 crc32c(u32 crc, const void *address, unsigned int length)
+{
+	const u8 *p = address;
+
+	while (length > 0 && ((unsigned long)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		length--;
+	}
+
+	while (length >= 3 * LONG_LEN) {
+		crc = crc32c_triple(crc, p, LONG_LEN, long_shift);
+		p += 3 * LONG_LEN;
+		length -= 3 * LONG_LEN;
+	}
+
+	while (length >= 3 * SHORT_LEN) {
+		crc = crc32c_triple(crc, p, SHORT_LEN, short_shift);
+		p += 3 * SHORT_LEN;
+		length -= 3 * SHORT_LEN;
+	}
+
+	while (length >= 8) {
+		crc = _mm_crc32_u64(crc, *(const u64 *)p);
+		p += 8;
+		length -= 8;
+	}
+
+	while (length > 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+		length--;
+	}
+
+	return crc;
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_LK_CRC32C_H
+#define NGNFS_SHARED_LK_CRC32C_H
+
+#include "shared/lk/types.h"
+
+/*
+ * Like the kernel's crc32c() this updates the raw crc register without
+ * inverting the input or output.  Callers typically seed with ~0.
+ */
+u32 crc32c(u32 crc, const void *address, unsigned int length);
+
+#endif
@@ -101,6 +101,17 @@ void *rhashtable_lookup_get_insert_fast(struct rhashtable *ht, struct rhash_head
 	return NULL;
 }
 
+/*
+ * Returns -ENOENT if the object was already removed.
+ *
+ * The caller holds the rcu_read_lock.
+ */
+int rhashtable_remove_fast(struct rhashtable *ht, struct rhash_head *head,
+			   const struct rhashtable_params params)
+{
+	return cds_lfht_del(ht->lfht, head_to_node(head)) ? -ENOENT : 0;
+}
+
 /*
  * XXX starting with simple fixed size for now.
  */
@@ -15,3 +15,14 @@ ktime_t ktime_get_real(void)
 
 	return timespec_to_ktime(ts);
 }
+
+ktime_t ktime_get(void)
+{
+	struct timespec ts;
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(ret == 0);
+
+	return timespec_to_ktime(ts);
+}
@@ -4,8 +4,8 @@
 
 /*
  * So far we've only needed the basic
- * wait_event/waitqueue_active/wake_up pattern so we can implement it
- * with futexes and atomics.
+ * wait_event{,_timeout}/waitqueue_active/wake_up pattern so we can
+ * implement it with futexes and atomics.
  *
  * It's not portable, but it's easy and quick.  We could go for more
  * portable and heavy implementations in terms of pthread mutexes and
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
 
 #include "shared/urcu.h"
 
@@ -65,6 +66,47 @@ do {												\
 	}											\
 } while (0)
 
+/*
+ * Without jiffies the timeout is in nanoseconds.  Like the kernel, this
+ * evaluates to 0 if the timeout elapsed with the condition false, and
+ * is non-zero otherwise.
+ */
+#define wait_event_timeout(wq_head, condition, timeout_ns)					\
+({												\
+	__typeof__(wq_head) _wq = (wq_head);							\
+	struct timespec _now;									\
+	struct timespec _ts;									\
+	uint32_t _ctr;										\
+	long long _left;									\
+	long long _end;										\
+	long _ret;										\
+	int _cond;										\
+												\
+	clock_gettime(CLOCK_MONOTONIC, &_now);							\
+	_end = (_now.tv_sec * 1000000000LL) + _now.tv_nsec + (timeout_ns);			\
+	_cond = !!(condition);									\
+	if (!_cond) {										\
+		uatomic_inc(&_wq->nr_waiting);							\
+		for (;;) {									\
+			_ctr = uatomic_read(&_wq->wake_counter);				\
+			cmm_barrier();								\
+			_cond = !!(condition);							\
+			clock_gettime(CLOCK_MONOTONIC, &_now);					\
+			_left = _end - ((_now.tv_sec * 1000000000LL) + _now.tv_nsec);		\
+			if (_cond || _left <= 0)						\
+				break;								\
+			_ts.tv_sec = _left / 1000000000LL;					\
+			_ts.tv_nsec = _left % 1000000000LL;					\
+			_ret = syscall(SYS_futex, &_wq->wake_counter, FUTEX_WAIT, _ctr,		\
+				       &_ts, NULL, 0);						\
+			assert(_ret == 0 || (errno == EAGAIN || errno == EWOULDBLOCK ||		\
+					     errno == EINTR || errno == ETIMEDOUT));		\
+		}										\
+		uatomic_dec(&_wq->nr_waiting);							\
+	}											\
+	_cond;											\
+})
+
 /*
  * The caller is responsible for ordering of sleeping and waking.  This
  * implementation just needs to make sure that concurrent sleeping and
@@ -1,10 +1,36 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+/*
+ * The manifest maps the fs block number space to the addresses of the
+ * devd servers that store the blocks.
+ *
+ * Blocks are mapped in aligned extents of 2^extent_shift blocks so that
+ * runs of adjacent blocks live on the same devd and can be coalesced
+ * into larger IOs.  The extents are then either striped across the
+ * addresses in order, which is simple but remaps nearly every extent
+ * when an address is added, or are placed on a consistent hash ring.
+ * Each address is hashed to a number of virtual node points on the
+ * ring and an extent is stored by the address of the first point at or
+ * after the extent's hash.  Adding an address then only moves the
+ * extents that hash to just before its new points.  The ring points are
+ * hashed from the addresses themselves so the mapping doesn't depend on
+ * the order that the addresses were given in.
+ *
+ * Extents can be replicated on multiple addresses.  Striped replicas
+ * are stored on the addresses following the first, and ring replicas
+ * on the next distinct addresses around the ring from the first point.
+ *
+ * The mapping is built during setup and isn't modified after that so
+ * lookups don't need any locking.
+ */
+
 #include "shared/lk/errno.h"
+#include "shared/lk/jhash.h"
 #include "shared/lk/list.h"
 #include "shared/lk/in.h"
 #include "shared/lk/math64.h"
 #include "shared/lk/slab.h"
+#include "shared/lk/sort.h"
 #include "shared/lk/stddef.h"
 #include "shared/lk/string.h"
 #include "shared/lk/types.h"
@@ -12,44 +38,184 @@
 #include "shared/fs_info.h"
 #include "shared/manifest.h"
 
+struct ring_point {
+	u32 hash;
+	u32 ind;
+};
+
 struct ngnfs_manifest_info {
+	u8 map;
+	u8 extent_shift;
+	u8 nr_replicas;
 	u8 nr_addrs;
+	u32 nr_points;
+	struct ring_point *points;
 	struct sockaddr_in addrs[];
 };
 
-int ngnfs_manifest_map_block(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addr)
+static u32 hash_extent(u64 ext)
+{
+	return jhash_2words((u32)ext, (u32)(ext >> 32), 0);
+}
+
+/*
+ * Find the first point at or after the hash, wrapping around to the
+ * first point.
+ */
+static u32 ring_lookup(struct ngnfs_manifest_info *mfinf, u32 hash)
+{
+	struct ring_point *points = mfinf->points;
+	u32 lo = 0;
+	u32 hi = mfinf->nr_points;
+	u32 mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (points[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == mfinf->nr_points)
+		lo = 0;
+
+	return lo;
+}
+
+/*
+ * Walk around the ring from the first point, collecting the addresses
+ * of points whose addresses haven't been seen yet.
+ */
+static void ring_replicas(struct ngnfs_manifest_info *mfinf, u64 ext, u32 *inds)
+{
+	u32 pt = ring_lookup(mfinf, hash_extent(ext));
+	int nr = 0;
+	int i;
+
+	while (nr < mfinf->nr_replicas) {
+		for (i = 0; i < nr && inds[i] != mfinf->points[pt].ind; i++)
+			;
+		if (i == nr)
+			inds[nr++] = mfinf->points[pt].ind;
+
+		if (++pt == mfinf->nr_points)
+			pt = 0;
+	}
+}
+
+/*
+ * Fill the caller's array with the addresses of all the replicas of the
+ * block, returning the number of replicas.  The array must have room
+ * for NGNFS_MANIFEST_MAX_REPLICAS addresses.
+ */
+int ngnfs_manifest_map_replicas(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addrs)
 {
 	struct ngnfs_manifest_info *mfinf = nfi->manifest_info;
+	u64 ext = bnr >> mfinf->extent_shift;
+	u32 inds[NGNFS_MANIFEST_MAX_REPLICAS];
 	u32 rem;
+	int i;
 
-	div_u64_rem(bnr, mfinf->nr_addrs, &rem);
-	*addr = mfinf->addrs[rem];
+	if (mfinf->map == NGNFS_MANIFEST_MAP_RING) {
+		ring_replicas(mfinf, ext, inds);
+	} else {
+		div_u64_rem(ext, mfinf->nr_addrs, &rem);
+		for (i = 0; i < mfinf->nr_replicas; i++)
+			inds[i] = (rem + i) % mfinf->nr_addrs;
+	}
 
+	for (i = 0; i < mfinf->nr_replicas; i++)
+		addrs[i] = mfinf->addrs[inds[i]];
+
+	return mfinf->nr_replicas;
+}
+
+static int cmp_ring_points(const void *A, const void *B, const void *priv)
+{
+	const struct ring_point *a = A;
+	const struct ring_point *b = B;
+
+	return a->hash < b->hash ? -1 : a->hash > b->hash ? 1 :
+	       a->ind < b->ind ? -1 : a->ind > b->ind ? 1 : 0;
+}
+
+static int build_ring(struct ngnfs_manifest_info *mfinf, u16 nr_vnodes)
+{
+	struct sockaddr_in *addr;
+	struct ring_point *pt;
+	u32 i;
+	u16 v;
+
+	mfinf->nr_points = (u32)mfinf->nr_addrs * nr_vnodes;
+	mfinf->points = kmalloc(mfinf->nr_points * sizeof(mfinf->points[0]), GFP_NOFS);
+	if (!mfinf->points)
+		return -ENOMEM;
+
+	pt = mfinf->points;
+	for (i = 0; i < mfinf->nr_addrs; i++) {
+		addr = &mfinf->addrs[i];
+		for (v = 0; v < nr_vnodes; v++) {
+			pt->hash = jhash_3words(addr->sin_addr.s_addr, addr->sin_port, v, 0);
+			pt->ind = i;
+			pt++;
+		}
+	}
+
+	sort_r(mfinf->points, mfinf->nr_points, sizeof(mfinf->points[0]), cmp_ring_points,
+	       NULL, NULL);
 	return 0;
 }
 
+static bool addr_present(struct sockaddr_in *addrs, int nr, struct sockaddr_in *addr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (addrs[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    addrs[i].sin_port == addr->sin_port)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Just a u8 to limit the largest possible allocation.
  *
- * It's surprisingly ok to have duplicate addresses in the array
- * currently because we're not actually mapping the fs scoped block
- * numbers to device block numbers.  Each device must be able to store
- * the entire block space.
+ * Duplicate addresses are rejected.  Replicas are placed on distinct
+ * entries in the array so a duplicated devd could be given more than
+ * one of a block's replicas.
+ *
+ * Null options stripe individual blocks across the addresses without
+ * replication.
  */
-int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 nr)
+int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 nr,
+			 struct ngnfs_manifest_options *opts)
 {
 	struct ngnfs_manifest_addr_head *ahead;
 	struct ngnfs_manifest_info *mfinf;
 	struct sockaddr_in *addr;
 	int ret;
 
+	if (nr == 0 || (opts && (opts->map >= NGNFS_MANIFEST_MAP__NR ||
+		     opts->extent_shift > NGNFS_MANIFEST_MAX_EXTENT_SHIFT ||
+		     opts->nr_vnodes > NGNFS_MANIFEST_MAX_VNODES ||
+		     opts->nr_replicas > NGNFS_MANIFEST_MAX_REPLICAS || opts->nr_replicas > nr)))
+		return -EINVAL;
+
 	mfinf = kmalloc(offsetof(struct ngnfs_manifest_info, addrs[nr]), GFP_NOFS);
 	if (!mfinf) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
+	mfinf->map = opts ? opts->map : NGNFS_MANIFEST_MAP_STRIPE;
+	mfinf->extent_shift = opts ? opts->extent_shift : 0;
+	mfinf->nr_replicas = (opts && opts->nr_replicas) ? opts->nr_replicas : 1;
 	mfinf->nr_addrs = nr;
+	mfinf->nr_points = 0;
+	mfinf->points = NULL;
 
 	addr = &mfinf->addrs[0];
 	list_for_each_entry(ahead, list, head) {
@@ -58,6 +224,11 @@ int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 n
 			goto out;
 		}
 
+		if (addr_present(mfinf->addrs, addr - mfinf->addrs, &ahead->addr)) {
+			ret = -EINVAL;
+			goto out;
+		}
+
 		*addr = ahead->addr;
 		addr++;
 	}
@@ -67,11 +238,19 @@ int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 n
 		goto out;
 	}
 
+	if (mfinf->map == NGNFS_MANIFEST_MAP_RING) {
+		ret = build_ring(mfinf, opts->nr_vnodes ?: NGNFS_MANIFEST_DEF_VNODES);
+		if (ret < 0)
+			goto out;
+	}
+
 	nfi->manifest_info = mfinf;
 	ret = 0;
 out:
-	if (ret < 0)
+	if (ret < 0 && mfinf) {
+		kfree(mfinf->points);
 		kfree(mfinf);
+	}
 	return ret;
 }
 
@@ -80,6 +259,7 @@ void ngnfs_manifest_destroy(struct ngnfs_fs_info *nfi)
 	struct ngnfs_manifest_info *mfinf = nfi->manifest_info;
 
 	if (mfinf) {
+		kfree(mfinf->points);
 		kfree(mfinf);
 		nfi->manifest_info = NULL;
 	}
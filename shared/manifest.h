@@ -4,6 +4,7 @@
 
 #include "shared/lk/in.h"
 #include "shared/lk/list.h"
+#include "shared/lk/types.h"
 
 #include "shared/fs_info.h"
 
@@ -12,8 +13,35 @@ struct ngnfs_manifest_addr_head {
 	struct sockaddr_in addr;
 };
 
-int ngnfs_manifest_map_block(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addr);
-int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 nr);
+enum {
+	/* stripe extents across the addresses in the order they were given */
+	NGNFS_MANIFEST_MAP_STRIPE = 0,
+	/* place extents on a consistent hash ring of the addresses */
+	NGNFS_MANIFEST_MAP_RING,
+	NGNFS_MANIFEST_MAP__NR,
+};
+
+#define NGNFS_MANIFEST_MAX_EXTENT_SHIFT	32
+#define NGNFS_MANIFEST_DEF_VNODES	128
+#define NGNFS_MANIFEST_MAX_VNODES	1024
+#define NGNFS_MANIFEST_MAX_REPLICAS	8
+
+/*
+ * Blocks are mapped to addresses in aligned extents of
+ * 2^extent_shift blocks so that runs of adjacent blocks are stored
+ * together.  The ring places each address at @nr_vnodes points.  Each
+ * extent is stored on @nr_replicas different addresses.
+ */
+struct ngnfs_manifest_options {
+	u8 map;
+	u8 extent_shift;
+	u16 nr_vnodes;
+	u8 nr_replicas;
+};
+
+int ngnfs_manifest_map_replicas(struct ngnfs_fs_info *nfi, u64 bnr, struct sockaddr_in *addrs);
+int ngnfs_manifest_setup(struct ngnfs_fs_info *nfi, struct list_head *list, u8 nr,
+			 struct ngnfs_manifest_options *opts);
 void ngnfs_manifest_destroy(struct ngnfs_fs_info *nfi);
 
 #endif
@@ -26,6 +26,7 @@
 #include "shared/manifest.h"
 #include "shared/mount.h"
 #include "shared/msg.h"
+#include "shared/mtr-shm.h"
 #include "shared/mtr-socket.h"
 #include "shared/nerr.h"
 #include "shared/options.h"
@@ -36,26 +37,66 @@ struct mount_options {
 	struct list_head addr_list;
 	u8 nr_addrs;
 	char *trace_path;
+	struct ngnfs_manifest_options mf_opts;
+	struct ngnfs_btr_msg_options btr_opts;
+	struct ngnfs_msg_transport_ops *mtr_ops;
+	struct ngnfs_mtr_socket_options sock_opts;
 };
 
 static struct option_more mount_moreopts[] = {
+	{ .longopt = { "conns", required_argument, NULL, 'c' },
+	  .arg = "nr",
+	  .desc = "number of tcp connections to each devd server (default 1)", },
+
 	{ .longopt = { "devd_addr", required_argument, NULL, 'd' },
 	  .arg = "addr:port",
 	  .desc = "IPv4 address of devd server", },
 
+	{ .longopt = { "extent_shift", required_argument, NULL, 'e' },
+	  .arg = "bits",
+	  .desc = "map runs of 2^bits blocks to each devd server (default 0)", },
+
+	{ .longopt = { "map", required_argument, NULL, 'm' },
+	  .arg = "stripe|ring",
+	  .desc = "map blocks to devd servers in order (default) or by consistent hashing", },
+
+	{ .longopt = { "replicas", required_argument, NULL, 'r' },
+	  .arg = "nr",
+	  .desc = "store each block on nr devd servers (default 1)", },
+
+	{ .longopt = { "shm", no_argument, NULL, 's' },
+	  .desc = "use shared memory to reach devd servers on this host, falling back to tcp", },
+
+	{ .longopt = { "steer", required_argument, NULL, 'S' },
+	  .arg = "hash|class",
+	  .desc = "steer messages to connections by block number hash (default) or message class", },
+
 	{ .longopt = { "trace_file", required_argument, NULL, 't' },
 	  .arg = "file_path",
 	  .desc = "append debugging traces to this file",
 	  .required = 1, },
+
+	{ .longopt = { "write_quorum", required_argument, NULL, 'w' },
+	  .arg = "nr",
+	  .desc = "complete block writes once nr replicas have written them (default all)", },
 };
 
 static int parse_mount_opt(int c, char *str, void *arg)
 {
 	struct mount_options *opts = arg;
 	struct ngnfs_manifest_addr_head *ahead;
+	unsigned long long ull;
 	int ret = -EINVAL;
 
 	switch(c) {
+	case 'c':
+		ret = parse_ull(&ull, str, 1, NGNFS_MTR_SOCKET_MAX_CONNS);
+		if (ret < 0) {
+			log("error parsing -c connection count");
+			goto out;
+		}
+		opts->sock_opts.nr_conns = ull;
+		break;
 	case 'd':
 		if (opts->nr_addrs == U8_MAX) {
 			log("too many -d addresses specified, exceeded limit of %u", U8_MAX);
@@ -78,9 +119,58 @@ static int parse_mount_opt(int c, char *str, void *arg)
 		list_add_tail(&ahead->head, &opts->addr_list);
 		opts->nr_addrs++;
 		break;
+	case 'e':
+		ret = parse_ull(&ull, str, 0, NGNFS_MANIFEST_MAX_EXTENT_SHIFT);
+		if (ret < 0) {
+			log("error parsing -e extent shift");
+			goto out;
+		}
+		opts->mf_opts.extent_shift = ull;
+		break;
+	case 'm':
+		if (!strcmp(str, "stripe")) {
+			opts->mf_opts.map = NGNFS_MANIFEST_MAP_STRIPE;
+		} else if (!strcmp(str, "ring")) {
+			opts->mf_opts.map = NGNFS_MANIFEST_MAP_RING;
+		} else {
+			log("unknown -m manifest map '%s'", str);
+			ret = -EINVAL;
+			goto out;
+		}
+		break;
+	case 'r':
+		ret = parse_ull(&ull, str, 1, NGNFS_MANIFEST_MAX_REPLICAS);
+		if (ret < 0) {
+			log("error parsing -r replica count");
+			goto out;
+		}
+		opts->mf_opts.nr_replicas = ull;
+		break;
+	case 's':
+		opts->mtr_ops = &ngnfs_mtr_shm_ops;
+		break;
+	case 'S':
+		if (!strcmp(str, "hash")) {
+			opts->sock_opts.steer = NGNFS_MTR_SOCKET_STEER_HASH;
+		} else if (!strcmp(str, "class")) {
+			opts->sock_opts.steer = NGNFS_MTR_SOCKET_STEER_CLASS;
+		} else {
+			log("unknown -S steering policy '%s'", str);
+			ret = -EINVAL;
+			goto out;
+		}
+		break;
 	case 't':
 		ret = strdup_nerr(&opts->trace_path, str);
 		break;
+	case 'w':
+		ret = parse_ull(&ull, str, 1, NGNFS_MANIFEST_MAX_REPLICAS);
+		if (ret < 0) {
+			log("error parsing -w write quorum");
+			goto out;
+		}
+		opts->btr_opts.write_quorum = ull;
+		break;
 	}
 
 	ret = 0;
@@ -90,7 +180,9 @@ out:
 
 int ngnfs_mount(struct ngnfs_fs_info *nfi, int argc, char **argv)
 {
-	struct mount_options opts = { .addr_list = LIST_HEAD_INIT(opts.addr_list), };
+	struct mount_options opts = { .addr_list = LIST_HEAD_INIT(opts.addr_list),
+				      .mtr_ops = &ngnfs_mtr_socket_ops,
+				      .sock_opts = { .nr_conns = 1, }, };
 	struct ngnfs_manifest_addr_head *ahead;
 	struct ngnfs_manifest_addr_head *tmp;
 	int ret;
@@ -106,10 +198,24 @@ int ngnfs_mount(struct ngnfs_fs_info *nfi, int argc, char **argv)
 		goto out;
 	}
 
+	if (opts.mf_opts.nr_replicas > opts.nr_addrs) {
+		log("-r replica count %u exceeds the %u -d devd addresses",
+		    opts.mf_opts.nr_replicas, opts.nr_addrs);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (opts.btr_opts.write_quorum > (opts.mf_opts.nr_replicas ?: 1)) {
+		log("-w write quorum %u exceeds the %u replicas",
+		    opts.btr_opts.write_quorum, opts.mf_opts.nr_replicas ?: 1);
+		ret = -EINVAL;
+		goto out;
+	}
+
 	ret = trace_setup(opts.trace_path) ?:
-	      ngnfs_manifest_setup(nfi, &opts.addr_list, opts.nr_addrs) ?:
-	      ngnfs_msg_setup(nfi, &ngnfs_mtr_socket_ops, NULL, NULL) ?:
-	      ngnfs_block_setup(nfi, &ngnfs_btr_msg_ops, NULL);
+	      ngnfs_manifest_setup(nfi, &opts.addr_list, opts.nr_addrs, &opts.mf_opts) ?:
+	      ngnfs_msg_setup(nfi, opts.mtr_ops, &opts.sock_opts, NULL) ?:
+	      ngnfs_block_setup(nfi, &ngnfs_btr_msg_ops, &opts.btr_opts);
 out:
 	if (ret < 0)
 		ngnfs_unmount(nfi);
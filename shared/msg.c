@@ -14,6 +14,17 @@
  * The receive path is marshalled by having layers register receive
  * handlers for a u8 type in a message header.
  *
+ * Messages are protected by a crc32c of the header, ctl, and data
+ * payloads.  Sending transports store the crc in the header and we
+ * verify it before calling receive handlers.
+ *
+ * Layers that send requests and receive their replies can record the
+ * requests in flight to each peer and the latency of their replies.
+ * Each peer keeps an exponentially weighted moving average of its
+ * latency and of the deviation of samples from the average, like tcp's
+ * rtt estimator.  The estimates are updated without locking and can
+ * lose concurrent samples, they're only hints.
+ *
  * Most of the heavy lifting is handled by message transport layers.
  * They register ops to be called by messaging and call into messaging
  * with incoming peer connections or messages.
@@ -27,12 +38,14 @@
 
 #include "shared/lk/byteorder.h"
 #include "shared/lk/bug.h"
+#include "shared/lk/crc32c.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/kernel.h"
 #include "shared/lk/limits.h"
 #include "shared/lk/rcupdate.h"
 #include "shared/lk/rhashtable.h"
+#include "shared/lk/rwonce.h"
 #include "shared/lk/stddef.h"
 
 #include "shared/msg.h"
@@ -51,6 +64,9 @@ struct ngnfs_peer {
 	atomic_t refcount;
 	struct rhash_head rhead;
 	struct sockaddr_in addr;
+	atomic_t nr_inflight;
+	u64 lat_ns;
+	u64 lat_dev_ns;
 	void *info;
 };
 
@@ -107,12 +123,13 @@ static struct ngnfs_peer *get_peer(struct ngnfs_fs_info *nfi, struct ngnfs_msg_i
 	}
 
 	atomic_set(&peer->refcount, 1);
+	atomic_set(&peer->nr_inflight, 0);
 	memcpy(&peer->addr, addr, sizeof(peer->addr)); /* memcpy for ht memcmp */
 
 	if (minf->mtr_ops->peer_info_size > 0) {
 		peer->info = (peer + 1);
 		if (minf->mtr_ops->init_peer)
-			minf->mtr_ops->init_peer(peer->info, nfi);
+			minf->mtr_ops->init_peer(peer->info, nfi, minf->mtr_info);
 	}
 
 	atomic_inc(&peer->refcount);
@@ -188,6 +205,30 @@ int ngnfs_msg_verify_header(struct ngnfs_msg_header *hdr)
 	return 0;
 }
 
+/*
+ * Calculate the crc of a message described by the desc.  The crc
+ * covers the header, with its crc field zeroed, followed by the ctl and
+ * data payloads.
+ */
+u32 ngnfs_msg_crc(struct ngnfs_msg_desc *mdesc)
+{
+	struct ngnfs_msg_header hdr = {
+		.crc = 0,
+		.data_size = cpu_to_le16(mdesc->data_size),
+		.ctl_size = mdesc->ctl_size,
+		.type = mdesc->type,
+	};
+	u32 crc;
+
+	crc = crc32c(~0, &hdr, sizeof(hdr));
+	if (mdesc->ctl_size)
+		crc = crc32c(crc, mdesc->ctl_buf, mdesc->ctl_size);
+	if (mdesc->data_size)
+		crc = crc32c(crc, page_address(mdesc->data_page), mdesc->data_size);
+
+	return crc;
+}
+
 /*
  * Establish a peer context and then hand the send off to the transport.
  * The transport will be copying the buf and page contents so the caller
@@ -211,13 +252,94 @@ int ngnfs_msg_send(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
 	return ret;
 }
 
+/*
+ * Record that a request is about to be sent to the peer.  This creates
+ * the peer, like sending does, so that its reply can be recorded.
+ */
+void ngnfs_msg_peer_sent(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer;
+
+	peer = get_peer(nfi, minf, addr, NULL);
+	if (!IS_ERR(peer)) {
+		atomic_inc(&peer->nr_inflight);
+		put_peer(minf, peer);
+	}
+}
+
+/*
+ * Record that a request sent to the peer is finished.  Its latency is
+ * only sampled if it's non-zero, callers can skip failed or unusually
+ * slow requests.  Callers can't always tell if a reply was for a
+ * request that they counted so the count doesn't go below zero.
+ */
+void ngnfs_msg_peer_replied(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr, u64 lat_ns)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer;
+	s64 diff;
+	s64 avg;
+	s64 dev;
+
+	rcu_read_lock();
+	peer = rhashtable_lookup(&minf->ht, addr, ngnfs_msg_ht_params);
+	if (peer) {
+		atomic_dec_if_positive(&peer->nr_inflight);
+		if (lat_ns) {
+			avg = READ_ONCE(peer->lat_ns);
+			dev = READ_ONCE(peer->lat_dev_ns);
+			if (avg == 0) {
+				avg = lat_ns;
+				dev = lat_ns / 2;
+			} else {
+				diff = (s64)lat_ns - avg;
+				avg += diff / 8;
+				dev += ((diff < 0 ? -diff : diff) - dev) / 4;
+			}
+			WRITE_ONCE(peer->lat_ns, avg);
+			WRITE_ONCE(peer->lat_dev_ns, dev);
+		}
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Give the caller the peer's latency estimates and number of requests
+ * in flight.  Peers without samples have zero latency.
+ */
+void ngnfs_msg_peer_stats(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr,
+			  struct ngnfs_msg_peer_stats *stats)
+{
+	struct ngnfs_msg_info *minf = nfi->msg_info;
+	struct ngnfs_peer *peer;
+
+	rcu_read_lock();
+	peer = rhashtable_lookup(&minf->ht, addr, ngnfs_msg_ht_params);
+	if (peer) {
+		stats->lat_ns = READ_ONCE(peer->lat_ns);
+		stats->lat_dev_ns = READ_ONCE(peer->lat_dev_ns);
+		stats->nr_inflight = atomic_read(&peer->nr_inflight);
+	} else {
+		stats->lat_ns = 0;
+		stats->lat_dev_ns = 0;
+		stats->nr_inflight = 0;
+	}
+	rcu_read_unlock();
+}
+
 /*
  * The caller has only verified the internal validity of the header.
+ * The transport set the desc's crc from the header, which we check
+ * unless the transport can't corrupt messages.
  */
 int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc)
 {
 	struct ngnfs_msg_info *minf = nfi->msg_info;
 
+	if (!minf->mtr_ops->no_crc && mdesc->crc != ngnfs_msg_crc(mdesc))
+		return -EBADMSG;
+
 	if (mdesc->type < ARRAY_SIZE(minf->recv_fns) && minf->recv_fns[mdesc->type])
 		return minf->recv_fns[mdesc->type](nfi, mdesc);
 	else
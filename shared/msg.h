@@ -20,6 +20,8 @@ struct ngnfs_msg_desc {
 	struct sockaddr_in *addr;
 	void *ctl_buf;
 	struct page *data_page;
+	u32 crc;		/* only set by receiving transports */
+	u32 steer;		/* only used by sending transports */
 	u16 data_size;
 	u8 ctl_size;
 	u8 type;
@@ -33,26 +35,46 @@ struct ngnfs_msg_transport_ops {
 	void (*stop_listen)(struct ngnfs_fs_info *nfi, void *info);
 
 	size_t peer_info_size;
-	void (*init_peer)(void *info, struct ngnfs_fs_info *nfi);
+	void (*init_peer)(void *info, struct ngnfs_fs_info *nfi, void *mtr_info);
 	void (*destroy_peer)(void *info);
 	int (*start)(void *info, struct sockaddr_in *addr, void *accepted);
 	int (*send)(void *info, struct ngnfs_msg_desc *mdesc);
+
+	/*
+	 * Transports that can't corrupt messages in flight (say, by
+	 * only copying in memory) can skip calculating and verifying
+	 * the message crc.
+	 */
+	bool no_crc;
 };
 
 u8 ngnfs_msg_err(int eno);
 int ngnfs_msg_errno(u8 err);
 
 int ngnfs_msg_verify_header(struct ngnfs_msg_header *hdr);
+u32 ngnfs_msg_crc(struct ngnfs_msg_desc *mdesc);
 
 int ngnfs_msg_send(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc);
+
+struct ngnfs_msg_peer_stats {
+	u64 lat_ns;
+	u64 lat_dev_ns;
+	int nr_inflight;
+};
+
+void ngnfs_msg_peer_sent(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr);
+void ngnfs_msg_peer_replied(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr, u64 lat_ns);
+void ngnfs_msg_peer_stats(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr,
+			  struct ngnfs_msg_peer_stats *stats);
 int ngnfs_msg_recv(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc);
 int ngnfs_msg_accept(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr, void *arg);
 
 /*
  * The receive path does basic checks of the incoming receive packet.
  * The ctl and data sizes will match the size of the buffers in the
- * desc.  The type will be valid in that it determines which recv method
- * to call.  The recv method is responsible for all other checks.
+ * desc and the crc will match the contents.  The type will be valid in
+ * that it determines which recv method to call.  The recv method is
+ * responsible for all other checks.
  */
 typedef int (ngnfs_msg_recv_fn_t)(struct ngnfs_fs_info *nfi, struct ngnfs_msg_desc *mdesc);
 
@@ -0,0 +1,401 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "shared/lk/atomic.h"
+#include "shared/lk/barrier.h"
+#include "shared/lk/err.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/list.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/rcupdate.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/wait.h"
+
+#include "shared/log.h"
+#include "shared/msg.h"
+#include "shared/mtr-loop.h"
+#include "shared/thread.h"
+
+/*
+ * Provide a msg transport that delivers messages between fs_info
+ * instances in the same process.  This lets a process run both client
+ * and devd stacks, exercising the full message and block paths without
+ * sockets or other processes, which is the basis for network-free
+ * benchmarks and tests.
+ *
+ * Each fs_info sets up messaging with these ops and the devd instances
+ * listen on addresses as usual.  Listening addresses are only entered
+ * in a process-wide list.  Starting a peer for a listening address
+ * accepts a peer in the listener's fs_info and links the two peers.
+ * Accepted peers are given unique addresses with INADDR_ANY and an
+ * incrementing port.
+ *
+ * Sending copies the message and enqueues it on the remote peer's
+ * lock-free receive queue.  Each peer has a receive thread which calls
+ * the receive handlers so that handlers are called in the receiver's
+ * context and are free to send, just as with real transports.
+ *
+ * Messages are only copied in memory so we don't calculate crcs.
+ */
+
+/*
+ * The link between two peers is shared by both.  Senders find the
+ * remote peer under rcu so that a peer can't be destroyed while
+ * messages are being queued for it.  An error is recorded in the link
+ * if either end's receive thread fails so that both ends stop sending.
+ */
+struct loop_link {
+	atomic_t refcount;
+	int err;
+	struct loop_peer_info *ends[2];
+};
+
+struct loop_peer_info {
+	struct ngnfs_fs_info *nfi;
+	struct sockaddr_in addr;
+	wait_queue_head_t waitq;
+	struct cds_wfcq_head recv_q_head;
+	struct cds_wfcq_tail recv_q_tail;
+	struct thread recv_thr;
+	struct loop_link *link;
+	int side;
+	int err;
+	bool started;
+};
+
+struct loop_listen_info {
+	struct list_head head;
+	struct ngnfs_fs_info *nfi;
+	struct sockaddr_in addr;
+	u16 next_port;
+};
+
+struct loop_msg {
+	struct cds_wfcq_node q_node;
+	struct page *data_page;
+	u16 data_size;
+	u8 ctl_size;
+	u8 type;
+	u8 ctl[];
+};
+
+static LIST_HEAD(loop_listeners);
+static struct mutex loop_listeners_mutex = { .ptm = PTHREAD_MUTEX_INITIALIZER };
+
+static void free_msg(struct loop_msg *lmsg)
+{
+	if (lmsg->data_page)
+		put_page(lmsg->data_page);
+	free(lmsg);
+}
+
+static void put_link(struct loop_link *link)
+{
+	if (link && atomic_dec_return(&link->refcount) == 0)
+		free(link);
+}
+
+static void loop_recv_thread(struct thread *thr, void *arg)
+{
+	struct loop_peer_info *pinf = arg;
+	struct ngnfs_msg_desc mdesc;
+	struct cds_wfcq_node *node;
+	struct cds_wfcq_head head;
+	struct cds_wfcq_tail tail;
+	struct loop_msg *lmsg;
+	int ret = 0;
+
+	cds_wfcq_init(&head, &tail);
+	mdesc.addr = &pinf->addr;
+
+	while (!thread_should_return(thr)) {
+
+		wait_event(&pinf->waitq, !cds_wfcq_empty(&pinf->recv_q_head, &pinf->recv_q_tail) ||
+			   thread_should_return(thr));
+
+		__cds_wfcq_splice_nonblocking(&head, &tail, &pinf->recv_q_head, &pinf->recv_q_tail);
+
+		while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
+			assert(node != CDS_WFCQ_WOULDBLOCK);
+			lmsg = caa_container_of(node, struct loop_msg, q_node);
+
+			mdesc.ctl_buf = lmsg->ctl;
+			mdesc.data_page = lmsg->data_page;
+			mdesc.crc = 0;
+			mdesc.data_size = lmsg->data_size;
+			mdesc.ctl_size = lmsg->ctl_size;
+			mdesc.type = lmsg->type;
+
+			ret = ngnfs_msg_recv(pinf->nfi, &mdesc);
+			free_msg(lmsg);
+			if (ret < 0)
+				goto out;
+		}
+	}
+
+out:
+	while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
+		assert(node != CDS_WFCQ_WOULDBLOCK);
+		free_msg(caa_container_of(node, struct loop_msg, q_node));
+	}
+
+	if (ret < 0) {
+		if (pinf->err == 0)
+			pinf->err = ret;
+		uatomic_cmpxchg(&pinf->link->err, 0, ret);
+	}
+}
+
+static int attach_link(struct loop_peer_info *pinf, struct loop_link *link, int side)
+{
+	pinf->link = link;
+	pinf->side = side;
+	atomic_inc(&link->refcount);
+	rcu_assign_pointer(link->ends[side], pinf);
+
+	return thread_start(&pinf->recv_thr, loop_recv_thread, pinf);
+}
+
+/*
+ * Find the listener for the address and accept a linked peer in its
+ * fs_info.  We hold the listener mutex so that the listener can't be
+ * stopped while we accept.
+ */
+static int connect_listener(struct loop_peer_info *pinf, struct loop_link *link)
+{
+	struct loop_listen_info *linf;
+	struct sockaddr_in addr;
+	int tries;
+	int ret;
+
+	mutex_lock(&loop_listeners_mutex);
+
+	ret = -ECONNREFUSED;
+	list_for_each_entry(linf, &loop_listeners, head) {
+		if (linf->addr.sin_addr.s_addr != pinf->addr.sin_addr.s_addr ||
+		    linf->addr.sin_port != pinf->addr.sin_port)
+			continue;
+
+		tries = 0;
+		do {
+			if (++linf->next_port == 0)
+				linf->next_port++;
+			addr = (struct sockaddr_in) {
+				.sin_family = AF_INET,
+				.sin_addr.s_addr = htonl(INADDR_ANY),
+				.sin_port = htons(linf->next_port),
+			};
+			ret = ngnfs_msg_accept(linf->nfi, &addr, link);
+		} while (ret == -EEXIST && ++tries < U16_MAX);
+		break;
+	}
+
+	mutex_unlock(&loop_listeners_mutex);
+
+	return ret;
+}
+
+/*
+ * A null accepted arg comes from a send and we connect to the
+ * listener, otherwise we're being accepted with the connecting peer's
+ * link.  Errors are recorded and returned by sends.
+ *
+ * The peer is visible to other senders before it's started so they
+ * wait for us to publish the link, or the error, before sending.
+ */
+static int loop_start(void *info, struct sockaddr_in *addr, void *accepted)
+{
+	struct loop_peer_info *pinf = info;
+	struct loop_link *link;
+	int ret;
+
+	pinf->addr = *addr;
+
+	if (accepted) {
+		ret = attach_link(pinf, accepted, 1);
+		goto out;
+	}
+
+	link = calloc(1, sizeof(struct loop_link));
+	if (!link) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	atomic_set(&link->refcount, 0);
+
+	ret = attach_link(pinf, link, 0) ?:
+	      connect_listener(pinf, link);
+out:
+	if (ret < 0) {
+		log("error starting loopback peer "IPV4F": "ENOF, IPV4A(addr), ENOA(-ret));
+		pinf->err = ret;
+	}
+
+	smp_wmb(); /* store link and err before started */
+	WRITE_ONCE(pinf->started, true);
+	wake_up(&pinf->waitq);
+
+	return 0;
+}
+
+static int loop_send(void *info, struct ngnfs_msg_desc *mdesc)
+{
+	struct loop_peer_info *pinf = info;
+	struct loop_peer_info *remote;
+	struct loop_link *link;
+	struct loop_msg *lmsg;
+	int ret;
+
+	wait_event(&pinf->waitq, READ_ONCE(pinf->started));
+	smp_rmb(); /* load started before link and err */
+
+	/* the link is set unless starting failed */
+	link = pinf->link;
+	ret = pinf->err ?: READ_ONCE(link->err);
+	if (ret < 0)
+		return ret;
+
+	lmsg = malloc(sizeof(struct loop_msg) + mdesc->ctl_size);
+	if (!lmsg)
+		return -ENOMEM;
+
+	cds_wfcq_node_init(&lmsg->q_node);
+	lmsg->data_size = mdesc->data_size;
+	lmsg->ctl_size = mdesc->ctl_size;
+	lmsg->type = mdesc->type;
+
+	if (mdesc->ctl_size)
+		memcpy(lmsg->ctl, mdesc->ctl_buf, mdesc->ctl_size);
+
+	/* the sender can modify its page after we return */
+	if (mdesc->data_size) {
+		lmsg->data_page = alloc_page(GFP_NOFS);
+		if (!lmsg->data_page) {
+			free(lmsg);
+			return -ENOMEM;
+		}
+		memcpy(page_address(lmsg->data_page), page_address(mdesc->data_page),
+		       mdesc->data_size);
+	} else {
+		lmsg->data_page = NULL;
+	}
+
+	rcu_read_lock();
+	remote = rcu_dereference(link->ends[!pinf->side]);
+	if (remote) {
+		cds_wfcq_enqueue(&remote->recv_q_head, &remote->recv_q_tail, &lmsg->q_node);
+		wake_up(&remote->waitq);
+		ret = 0;
+	} else {
+		ret = -ESHUTDOWN;
+	}
+	rcu_read_unlock();
+
+	if (ret < 0)
+		free_msg(lmsg);
+
+	return ret;
+}
+
+static void loop_init_peer(void *info, struct ngnfs_fs_info *nfi, void *mtr_info)
+{
+	struct loop_peer_info *pinf = info;
+
+	pinf->nfi = nfi;
+	init_waitqueue_head(&pinf->waitq);
+	cds_wfcq_init(&pinf->recv_q_head, &pinf->recv_q_tail);
+	thread_init(&pinf->recv_thr);
+}
+
+/*
+ * Unlink from the remote and wait for sends that might have seen us
+ * before stopping the receive thread so that nothing can be queued
+ * once it has drained the queue.  Messages queued after the receive
+ * thread failed are freed here.
+ */
+static void loop_destroy_peer(void *info)
+{
+	struct loop_peer_info *pinf = info;
+	struct loop_link *link = pinf->link;
+	struct cds_wfcq_node *node;
+
+	if (link) {
+		rcu_assign_pointer(link->ends[pinf->side], NULL);
+		synchronize_rcu();
+	}
+
+	thread_stop_indicate(&pinf->recv_thr);
+	wake_up(&pinf->waitq);
+	thread_stop_wait(&pinf->recv_thr);
+
+	while ((node = __cds_wfcq_dequeue_nonblocking(&pinf->recv_q_head, &pinf->recv_q_tail))) {
+		assert(node != CDS_WFCQ_WOULDBLOCK);
+		free_msg(caa_container_of(node, struct loop_msg, q_node));
+	}
+
+	put_link(link);
+}
+
+static void *loop_start_listen(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	struct loop_listen_info *linf;
+	struct loop_listen_info *exist;
+	int ret;
+
+	linf = calloc(1, sizeof(struct loop_listen_info));
+	if (!linf)
+		return ERR_PTR(-ENOMEM);
+
+	linf->nfi = nfi;
+	linf->addr = *addr;
+
+	mutex_lock(&loop_listeners_mutex);
+	ret = 0;
+	list_for_each_entry(exist, &loop_listeners, head) {
+		if (exist->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    exist->addr.sin_port == addr->sin_port) {
+			ret = -EADDRINUSE;
+			break;
+		}
+	}
+	if (ret == 0)
+		list_add_tail(&linf->head, &loop_listeners);
+	mutex_unlock(&loop_listeners_mutex);
+
+	if (ret < 0) {
+		log("loopback listening address "IPV4F" already in use", IPV4A(addr));
+		free(linf);
+		linf = ERR_PTR(ret);
+	}
+
+	return linf;
+}
+
+static void loop_stop_listen(struct ngnfs_fs_info *nfi, void *info)
+{
+	struct loop_listen_info *linf = info;
+
+	if (!IS_ERR_OR_NULL(linf)) {
+		mutex_lock(&loop_listeners_mutex);
+		list_del_init(&linf->head);
+		mutex_unlock(&loop_listeners_mutex);
+		free(linf);
+	}
+}
+
+struct ngnfs_msg_transport_ops ngnfs_mtr_loop_ops = {
+	.start_listen = loop_start_listen,
+	.stop_listen = loop_stop_listen,
+
+	.peer_info_size = sizeof(struct loop_peer_info),
+	.init_peer = loop_init_peer,
+	.destroy_peer = loop_destroy_peer,
+	.start = loop_start,
+	.send = loop_send,
+
+	.no_crc = true,
+};
@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_MTR_LOOP_H
+#define NGNFS_SHARED_MTR_LOOP_H
+
+#include "shared/msg.h"
+
+extern struct ngnfs_msg_transport_ops ngnfs_mtr_loop_ops;
+
+#endif
@@ -0,0 +1,802 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#define _GNU_SOURCE /* memfd_create, accept4 */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "shared/lk/barrier.h"
+#include "shared/lk/build_bug.h"
+#include "shared/lk/byteorder.h"
+#include "shared/lk/cache.h"
+#include "shared/lk/container_of.h"
+#include "shared/lk/err.h"
+#include "shared/lk/kernel.h"
+#include "shared/lk/limits.h"
+#include "shared/lk/math.h"
+#include "shared/lk/mutex.h"
+#include "shared/lk/rwonce.h"
+#include "shared/lk/wait.h"
+
+#include "shared/log.h"
+#include "shared/msg.h"
+#include "shared/mtr-shm.h"
+#include "shared/mtr-socket.h"
+#include "shared/thread.h"
+
+/*
+ * Provide a msg transport for peers on the same host that copies
+ * messages through rings in shared memory instead of through the
+ * network stack.
+ *
+ * A listener binds an abstract unix socket whose name is derived from
+ * its listening address.  A connecting peer tries to connect to that
+ * socket.  If it succeeds it creates a memfd region with a ring for
+ * each direction and passes the memfd to the listener.  Messages are
+ * then copied into and out of the rings and the futex waitqs in the
+ * region act as doorbells between the processes.  The unix socket is
+ * only kept around to notice when the other process goes away.
+ *
+ * If there's no listener on the unix socket then the peer falls back to
+ * using the socket transport with the remainder of its peer info.
+ * Listening starts both the socket listener and the unix listener.
+ * Peers on the same host have to be given the same address that the
+ * listener was started with to find its unix socket.
+ *
+ * We still copy into and out of the rings.  The block cache holds on
+ * to received data pages so they can't be loaned from the ring, but
+ * we avoid the socket's send buffer allocation and all of the kernel's
+ * copies.
+ *
+ * Accepted shm peers don't have a meaningful address.  The listener
+ * gives them unique addresses with INADDR_ANY and an incrementing port
+ * which can't collide with connected tcp peers.
+ */
+
+#define SHM_RING_SHIFT	20
+#define SHM_RING_SIZE	(1U << SHM_RING_SHIFT)
+#define SHM_RING_MASK	(SHM_RING_SIZE - 1)
+#define SHM_REC_ALIGN	8
+
+/*
+ * The head and tail are free running byte counters.  Only the consumer
+ * advances the head and only the producer advances the tail.  Records
+ * are a message header followed by the ctl and data payloads and are
+ * padded to keep headers aligned.  A record never wraps, a header with
+ * zero ctl and data sizes pads out the rest of the ring.
+ */
+struct shm_ring {
+	u64 head ____cacheline_aligned;
+	wait_queue_head_t space_waitq;
+	u64 tail ____cacheline_aligned;
+	wait_queue_head_t data_waitq;
+	u8 buf[SHM_RING_SIZE] ____cacheline_aligned;
+};
+
+/* the connecting peer sends on rings[0] and the accepting peer on rings[1] */
+struct shm_region {
+	int closed;
+	struct shm_ring rings[2];
+};
+
+enum {
+	SHM_MODE_PENDING = 0,
+	SHM_MODE_SHM,
+	SHM_MODE_SOCKET,
+};
+
+/*
+ * The socket transport's peer info follows ours so that we can fall
+ * back to using it.
+ */
+struct shm_peer_info {
+	struct ngnfs_fs_info *nfi;
+	struct sockaddr_in addr;
+	wait_queue_head_t waitq;
+	struct mutex send_mutex;
+	struct thread recv_thr;
+	struct thread watch_thr;
+	struct shm_region *region;
+	struct shm_ring *tx;
+	struct shm_ring *rx;
+	int fd;
+	int mode;
+	int err;
+	int shutdown;
+	u8 sock_info[] __attribute__((__aligned__(8)));
+};
+
+struct shm_listen_info {
+	struct ngnfs_fs_info *nfi;
+	struct thread listen_thr;
+	void *sock_info;
+	int fd;
+	u16 next_port;
+};
+
+/*
+ * Accepted peers are started with this.  The socket listener starts
+ * peers with a pointer to its accepted fd so the fd must come first;
+ * start tells them apart by the fd's socket domain.
+ */
+struct shm_accepted {
+	int fd;
+	int mem_fd;
+};
+
+static socklen_t init_unix_addr(struct sockaddr_un *sun, struct sockaddr_in *addr)
+{
+	int len;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	/* abstract socket names start with a null */
+	len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1, "ngnfs-shm-"IPV4F,
+		       IPV4A(addr));
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static u32 rec_size(u8 ctl_size, u16 data_size)
+{
+	return round_up((u32)sizeof(struct ngnfs_msg_header) + ctl_size + data_size,
+			SHM_REC_ALIGN);
+}
+
+static bool region_closed(struct shm_peer_info *pinf)
+{
+	return READ_ONCE(pinf->region->closed) != 0;
+}
+
+/*
+ * Stop activity on the peer.  Marking the region closed tells both
+ * processes to stop using the rings and shutting down the unix socket
+ * wakes the watch thread.  This can be called multiple times.
+ */
+static void shutdown_peer(struct shm_peer_info *pinf, int err)
+{
+	int i;
+
+	if (uatomic_cmpxchg(&pinf->shutdown, 0, 1) == 0) {
+		thread_stop_indicate(&pinf->recv_thr);
+		thread_stop_indicate(&pinf->watch_thr);
+		if (pinf->region) {
+			WRITE_ONCE(pinf->region->closed, 1);
+			smp_mb();
+			for (i = 0; i < ARRAY_SIZE(pinf->region->rings); i++) {
+				wake_up(&pinf->region->rings[i].space_waitq);
+				wake_up(&pinf->region->rings[i].data_waitq);
+			}
+		}
+		if (pinf->fd >= 0)
+			shutdown(pinf->fd, SHUT_RDWR);
+	}
+
+	/* don't really mind if this races */
+	if (err < 0 && pinf->err == 0)
+		pinf->err = err;
+}
+
+static u32 ring_space(struct shm_ring *ring, u64 tail)
+{
+	return SHM_RING_SIZE - (u32)(tail - READ_ONCE(ring->head));
+}
+
+/*
+ * Copy a message into the tail of our send ring.  Senders are
+ * serialized by the mutex and wait for the remote to free space if the
+ * ring is full.
+ */
+static int ring_send(struct shm_peer_info *pinf, struct ngnfs_msg_desc *mdesc)
+{
+	struct shm_ring *ring = pinf->tx;
+	struct ngnfs_msg_header *hdr;
+	u32 size;
+	u32 pad;
+	u32 off;
+	u64 tail;
+	int ret;
+
+	size = rec_size(mdesc->ctl_size, mdesc->data_size);
+
+	mutex_lock(&pinf->send_mutex);
+
+	tail = ring->tail;
+	off = tail & SHM_RING_MASK;
+	pad = (SHM_RING_SIZE - off < size) ? SHM_RING_SIZE - off : 0;
+
+	wait_event(&ring->space_waitq, ring_space(ring, tail) >= pad + size ||
+		   region_closed(pinf));
+	if (region_closed(pinf)) {
+		ret = -ESHUTDOWN;
+		goto out;
+	}
+
+	/* don't write into space until we've seen the consumer's head */
+	smp_mb();
+
+	if (pad) {
+		hdr = (void *)&ring->buf[off];
+		hdr->data_size = 0;
+		hdr->ctl_size = 0;
+		tail += pad;
+		off = 0;
+	}
+
+	hdr = (void *)&ring->buf[off];
+	hdr->crc = cpu_to_le32(ngnfs_msg_crc(mdesc));
+	hdr->data_size = cpu_to_le16(mdesc->data_size);
+	hdr->ctl_size = mdesc->ctl_size;
+	hdr->type = mdesc->type;
+
+	if (mdesc->ctl_size)
+		memcpy(hdr + 1, mdesc->ctl_buf, mdesc->ctl_size);
+	if (mdesc->data_size)
+		memcpy((void *)(hdr + 1) + mdesc->ctl_size, page_address(mdesc->data_page),
+		       mdesc->data_size);
+
+	/* publish the record before the tail */
+	smp_wmb();
+	WRITE_ONCE(ring->tail, tail + size);
+	wake_up(&ring->data_waitq);
+	ret = 0;
+out:
+	mutex_unlock(&pinf->send_mutex);
+	return ret;
+}
+
+/*
+ * Copy messages out of the receive ring and pass them to the msg core.
+ * The records are copied out and the space released before calling
+ * receive handlers so that the remote can keep sending while we
+ * process.  The header is copied before it's verified so that the
+ * remote can't change it under us.  Records that extend past the tail
+ * or the end of the ring tear down the peer.
+ */
+static void shm_recv_thread(struct thread *thr, void *arg)
+{
+	struct shm_peer_info *pinf = arg;
+	struct shm_ring *ring = pinf->rx;
+	struct page *ctl_page = NULL;
+	struct ngnfs_msg_header hdr;
+	struct ngnfs_msg_desc mdesc;
+	void *rec;
+	u64 head;
+	u64 tail;
+	u32 size;
+	u32 off;
+	int ret;
+
+	ctl_page = alloc_page(GFP_NOFS);
+	if (!ctl_page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mdesc.addr = &pinf->addr;
+	mdesc.ctl_buf = page_address(ctl_page);
+
+	head = ring->head;
+	ret = 0;
+	while (!thread_should_return(thr)) {
+
+		wait_event(&ring->data_waitq, READ_ONCE(ring->tail) != head ||
+			   region_closed(pinf) || thread_should_return(thr));
+		if (region_closed(pinf)) {
+			ret = -ESHUTDOWN;
+			break;
+		}
+
+		/* see the records before the tail that published them */
+		tail = READ_ONCE(ring->tail);
+		smp_rmb();
+
+		if (tail - head > SHM_RING_SIZE) {
+			ret = -EINVAL;
+			break;
+		}
+
+		while (head != tail) {
+			off = head & SHM_RING_MASK;
+			rec = &ring->buf[off];
+			if (tail - head < sizeof(hdr)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			memcpy(&hdr, rec, sizeof(hdr));
+
+			if (hdr.ctl_size == 0 && hdr.data_size == 0) {
+				size = SHM_RING_SIZE - off;
+				if (tail - head < size) {
+					ret = -EINVAL;
+					goto out;
+				}
+				head += size;
+				continue;
+			}
+
+			ret = ngnfs_msg_verify_header(&hdr);
+			if (ret < 0)
+				goto out;
+
+			mdesc.crc = le32_to_cpu(hdr.crc);
+			mdesc.data_size = le16_to_cpu(hdr.data_size);
+			mdesc.ctl_size = hdr.ctl_size;
+			mdesc.type = hdr.type;
+
+			size = rec_size(mdesc.ctl_size, mdesc.data_size);
+			if (off + size > SHM_RING_SIZE || tail - head < size) {
+				ret = -EINVAL;
+				goto out;
+			}
+
+			if (mdesc.data_size) {
+				mdesc.data_page = alloc_page(GFP_NOFS);
+				if (!mdesc.data_page) {
+					ret = -ENOMEM;
+					goto out;
+				}
+				memcpy(page_address(mdesc.data_page),
+				       rec + sizeof(hdr) + mdesc.ctl_size, mdesc.data_size);
+			} else {
+				mdesc.data_page = NULL;
+			}
+
+			if (mdesc.ctl_size)
+				memcpy(mdesc.ctl_buf, rec + sizeof(hdr), mdesc.ctl_size);
+
+			head += size;
+
+			/* finish copying out before releasing the space */
+			smp_mb();
+			WRITE_ONCE(ring->head, head);
+			wake_up(&ring->space_waitq);
+
+			ret = ngnfs_msg_recv(pinf->nfi, &mdesc);
+
+			if (mdesc.data_page) {
+				put_page(mdesc.data_page);
+				mdesc.data_page = NULL;
+			}
+			if (ret < 0)
+				goto out;
+		}
+
+		WRITE_ONCE(ring->head, head);
+		wake_up(&ring->space_waitq);
+	}
+
+out:
+	if (ctl_page)
+		put_page(ctl_page);
+	shutdown_peer(pinf, ret);
+}
+
+/*
+ * Nothing is ever sent over the unix socket after the memfd.  A read
+ * returns when the remote process closes it or we shut it down.
+ */
+static void shm_watch_thread(struct thread *thr, void *arg)
+{
+	struct shm_peer_info *pinf = arg;
+	ssize_t sret;
+	char c;
+
+	do {
+		sret = read(pinf->fd, &c, 1);
+	} while (sret > 0 || (sret < 0 && errno == EINTR));
+
+	shutdown_peer(pinf, -ESHUTDOWN);
+}
+
+static int map_region(struct shm_peer_info *pinf, int mem_fd, bool accepted)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   mem_fd, 0);
+	if (ptr == MAP_FAILED)
+		return -errno;
+
+	pinf->region = ptr;
+	pinf->tx = &pinf->region->rings[!!accepted];
+	pinf->rx = &pinf->region->rings[!accepted];
+
+	return 0;
+}
+
+static int send_mem_fd(int fd, int mem_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] = { 0, };
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char c = 0;
+	ssize_t sret;
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mem_fd, sizeof(int));
+
+	sret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (sret < 0)
+		return -errno;
+	if (sret != 1)
+		return -EIO;
+
+	return 0;
+}
+
+static int recv_mem_fd(int fd, int *mem_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t sret;
+	char c;
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	sret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (sret < 0)
+		return -errno;
+	if (sret == 0)
+		return -ESHUTDOWN;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -EINVAL;
+
+	memcpy(mem_fd, CMSG_DATA(cmsg), sizeof(int));
+	return 0;
+}
+
+/*
+ * Try to connect to a listener's unix socket and give it a new region.
+ * -ECONNREFUSED tells the caller that there's no local listener.
+ */
+static int shm_connect(struct shm_peer_info *pinf)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	int mem_fd = -1;
+	int fd = -1;
+	int ret;
+	int i;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	len = init_unix_addr(&sun, &pinf->addr);
+	ret = connect(fd, (struct sockaddr *)&sun, len);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	mem_fd = memfd_create("ngnfs-shm", MFD_CLOEXEC);
+	if (mem_fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* truncating zeroes the region */
+	ret = ftruncate(mem_fd, sizeof(struct shm_region));
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = map_region(pinf, mem_fd, false);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(pinf->region->rings); i++) {
+		init_waitqueue_head(&pinf->region->rings[i].space_waitq);
+		init_waitqueue_head(&pinf->region->rings[i].data_waitq);
+	}
+
+	ret = send_mem_fd(fd, mem_fd);
+	if (ret < 0)
+		goto out;
+
+	pinf->fd = fd;
+	fd = -1;
+out:
+	if (mem_fd >= 0)
+		close(mem_fd);
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0 && ret != -ECONNREFUSED)
+		log("error connecting to shm peer "IPV4F": "ENOF, IPV4A(&pinf->addr), ENOA(-ret));
+
+	return ret;
+}
+
+static bool is_unix_socket(int fd)
+{
+	socklen_t len;
+	int domain;
+
+	len = sizeof(domain);
+	return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
+/*
+ * Start a peer in the msg core.  A null accepted arg comes from a send
+ * and we try to connect to a local listener, falling back to the
+ * socket transport if there isn't one.  Otherwise we've either been
+ * given an accepted tcp socket or an accepted shm region.
+ *
+ * This is synchronous so concurrent senders wait for the mode to be
+ * set.  Like the socket transport, errors are recorded in the peer and
+ * returned by sends.
+ */
+static int shm_start(void *info, struct sockaddr_in *addr, void *accepted)
+{
+	struct shm_peer_info *pinf = info;
+	struct shm_accepted *sacc;
+	int mode = SHM_MODE_SHM;
+	int ret;
+
+	pinf->addr = *addr;
+
+	if (accepted && !is_unix_socket(*(int *)accepted)) {
+		mode = SHM_MODE_SOCKET;
+	} else if (accepted) {
+		sacc = container_of(accepted, struct shm_accepted, fd);
+		pinf->fd = sacc->fd;
+		sacc->fd = -1;
+		ret = map_region(pinf, sacc->mem_fd, true);
+		close(sacc->mem_fd);
+		sacc->mem_fd = -1;
+	} else {
+		ret = shm_connect(pinf);
+		if (ret == -ECONNREFUSED)
+			mode = SHM_MODE_SOCKET;
+	}
+
+	if (mode == SHM_MODE_SOCKET) {
+		ret = ngnfs_mtr_socket_ops.start(pinf->sock_info, addr, accepted);
+	} else if (ret == 0) {
+		ret = thread_start(&pinf->recv_thr, shm_recv_thread, pinf) ?:
+		      thread_start(&pinf->watch_thr, shm_watch_thread, pinf);
+	}
+
+	if (ret < 0)
+		shutdown_peer(pinf, ret);
+
+	WRITE_ONCE(pinf->mode, mode);
+	wake_up(&pinf->waitq);
+
+	return 0;
+}
+
+static int shm_send(void *info, struct ngnfs_msg_desc *mdesc)
+{
+	struct shm_peer_info *pinf = info;
+
+	wait_event(&pinf->waitq, READ_ONCE(pinf->mode) != SHM_MODE_PENDING);
+
+	if (pinf->mode == SHM_MODE_SOCKET)
+		return ngnfs_mtr_socket_ops.send(pinf->sock_info, mdesc);
+
+	if (pinf->err)
+		return pinf->err;
+
+	return ring_send(pinf, mdesc);
+}
+
+static void shm_init_peer(void *info, struct ngnfs_fs_info *nfi, void *mtr_info)
+{
+	struct shm_peer_info *pinf = info;
+
+	pinf->nfi = nfi;
+	init_waitqueue_head(&pinf->waitq);
+	mutex_init(&pinf->send_mutex);
+	thread_init(&pinf->recv_thr);
+	thread_init(&pinf->watch_thr);
+	pinf->fd = -1;
+
+	ngnfs_mtr_socket_ops.init_peer(pinf->sock_info, nfi, mtr_info);
+}
+
+static void shm_destroy_peer(void *info)
+{
+	struct shm_peer_info *pinf = info;
+
+	shutdown_peer(pinf, 0);
+	thread_stop_wait(&pinf->recv_thr);
+	thread_stop_wait(&pinf->watch_thr);
+
+	if (pinf->region)
+		munmap(pinf->region, sizeof(struct shm_region));
+	if (pinf->fd >= 0)
+		close(pinf->fd);
+
+	ngnfs_mtr_socket_ops.destroy_peer(pinf->sock_info);
+}
+
+/*
+ * Accept connections on the unix socket and start peers with the
+ * regions they send us.  The fds are owned by started peers, we close
+ * whatever they didn't take.
+ */
+static void shm_listen_thread(struct thread *thr, void *arg)
+{
+	struct shm_listen_info *linf = arg;
+	struct shm_accepted sacc;
+	struct sockaddr_in addr;
+	int tries;
+	int ret = 0;
+
+	while (!thread_should_return(thr)) {
+
+		sacc.fd = accept4(linf->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (sacc.fd < 0) {
+			ret = -errno;
+			if (ret == -EINTR || ret == -ECONNABORTED)
+				continue;
+			if (!thread_should_return(thr))
+				log("shm accept error: "ENOF, ENOA(-ret));
+			break;
+		}
+		sacc.mem_fd = -1;
+
+		ret = recv_mem_fd(sacc.fd, &sacc.mem_fd);
+		if (ret == 0) {
+			tries = 0;
+			do {
+				if (++linf->next_port == 0)
+					linf->next_port++;
+				addr = (struct sockaddr_in) {
+					.sin_family = AF_INET,
+					.sin_addr.s_addr = htonl(INADDR_ANY),
+					.sin_port = htons(linf->next_port),
+				};
+				ret = ngnfs_msg_accept(linf->nfi, &addr, &sacc.fd);
+			} while (ret == -EEXIST && ++tries < U16_MAX);
+		}
+
+		if (sacc.mem_fd >= 0)
+			close(sacc.mem_fd);
+		if (sacc.fd >= 0)
+			close(sacc.fd);
+	}
+
+	if (!thread_should_return(thr)) {
+		log("fatal shm listening thread error: "ENOF, ENOA(-ret));
+		exit(1);
+	}
+}
+
+static void shm_stop_listen(struct ngnfs_fs_info *nfi, void *info)
+{
+	struct shm_listen_info *linf = info;
+
+	if (!IS_ERR_OR_NULL(linf)) {
+		thread_stop_indicate(&linf->listen_thr);
+		if (linf->fd >= 0)
+			shutdown(linf->fd, SHUT_RDWR);
+		thread_stop_wait(&linf->listen_thr);
+		if (linf->fd >= 0)
+			close(linf->fd);
+		ngnfs_mtr_socket_ops.stop_listen(nfi, linf->sock_info);
+		free(linf);
+	}
+}
+
+static void *shm_start_listen(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
+{
+	struct shm_listen_info *linf = NULL;
+	struct sockaddr_un sun;
+	socklen_t len;
+	int ret;
+
+	linf = calloc(1, sizeof(struct shm_listen_info));
+	if (!linf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	linf->nfi = nfi;
+	thread_init(&linf->listen_thr);
+	linf->fd = -1;
+
+	linf->sock_info = ngnfs_mtr_socket_ops.start_listen(nfi, addr);
+	if (IS_ERR(linf->sock_info)) {
+		ret = PTR_ERR(linf->sock_info);
+		goto out;
+	}
+
+	linf->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (linf->fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	len = init_unix_addr(&sun, addr);
+	ret = bind(linf->fd, (struct sockaddr *)&sun, len);
+	if (ret < 0) {
+		ret = -errno;
+		log("binding shm socket for "IPV4F" failed", IPV4A(addr));
+		goto out;
+	}
+
+	ret = listen(linf->fd, 255);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = thread_start(&linf->listen_thr, shm_listen_thread, linf);
+	if (ret < 0)
+		log("error creating shm listen thread: "ENOF, ENOA(-ret));
+out:
+	if (ret < 0) {
+		shm_stop_listen(nfi, linf);
+		linf = ERR_PTR(ret);
+	}
+
+	return linf;
+}
+
+/*
+ * The socket transport's peer info is stored after ours so our size
+ * depends on its.  We don't have any info of our own so the socket
+ * transport's setup arg and info are ours.
+ */
+static void *shm_setup(struct ngnfs_fs_info *nfi, void *arg)
+{
+	BUILD_BUG_ON(sizeof(struct ngnfs_msg_header) != SHM_REC_ALIGN);
+
+	ngnfs_mtr_shm_ops.peer_info_size = sizeof(struct shm_peer_info) +
+					   ngnfs_mtr_socket_ops.peer_info_size;
+
+	return ngnfs_mtr_socket_ops.setup(nfi, arg);
+}
+
+static void shm_destroy(struct ngnfs_fs_info *nfi, void *mtr_info)
+{
+	ngnfs_mtr_socket_ops.destroy(nfi, mtr_info);
+}
+
+struct ngnfs_msg_transport_ops ngnfs_mtr_shm_ops = {
+	.setup = shm_setup,
+	.destroy = shm_destroy,
+	.start_listen = shm_start_listen,
+	.stop_listen = shm_stop_listen,
+
+	.init_peer = shm_init_peer,
+	.destroy_peer = shm_destroy_peer,
+	.start = shm_start,
+	.send = shm_send,
+};
@@ -20,21 +20,44 @@
 
 /*
  * Provide a msg transport based on threads using sockets.
+ *
+ * Connecting peers can open multiple connections to spread send and
+ * receive processing across threads and to keep large messages from
+ * delaying others.  Each connection has its own send and receive
+ * threads and messages are steered to a connection by the sender's
+ * steer hint or by their class.  Messages steered to the same
+ * connection are delivered in order.  Each accepted connection is its
+ * own peer, identified by its remote port, so responses are sent back
+ * on the connection that delivered the request.
  */
 
-struct socket_peer_info {
-	struct ngnfs_fs_info *nfi;
-	struct sockaddr_in addr;
+struct socket_info {
+	u8 nr_conns;
+	u8 steer;
+};
+
+struct socket_peer_info;
+
+struct socket_conn {
+	struct socket_peer_info *pinf;
 	wait_queue_head_t waitq;
 	struct cds_wfcq_head send_q_head;
 	struct cds_wfcq_tail send_q_tail;
 	struct thread connect_thr;
-	struct thread listen_thr;
 	struct thread send_thr;
 	struct thread recv_thr;
 	int fd;
+};
+
+struct socket_peer_info {
+	struct ngnfs_fs_info *nfi;
+	struct sockaddr_in addr;
+	struct thread listen_thr;
+	u8 nr_conns;
+	u8 steer;
 	int err;
 	int shutdown;
+	struct socket_conn conns[NGNFS_MTR_SOCKET_MAX_CONNS];
 };
 
 struct socket_send_buf {
@@ -45,20 +68,26 @@ struct socket_send_buf {
 };
 
 /*
- * Stop activity on the peer.  We shut down the socket and indicate that
+ * Stop activity on the peer.  We shut down the sockets and indicate that
  * the threads should return.  Resources are cleaned up as the peer is
  * freed after the threads have been joined.  This can be called
  * multiple times on a given peer.
  */
 static void shutdown_peer(struct socket_peer_info *pinf, int err)
 {
+	struct socket_conn *conn;
+	int i;
+
 	if (uatomic_cmpxchg(&pinf->shutdown, 0, 1) == 0) {
-		thread_stop_indicate(&pinf->connect_thr);
 		thread_stop_indicate(&pinf->listen_thr);
-		thread_stop_indicate(&pinf->send_thr);
-		thread_stop_indicate(&pinf->recv_thr);
-		if (pinf->fd >= 0)
-			shutdown(pinf->fd, SHUT_RDWR);
+		for (i = 0; i < pinf->nr_conns; i++) {
+			conn = &pinf->conns[i];
+			thread_stop_indicate(&conn->connect_thr);
+			thread_stop_indicate(&conn->send_thr);
+			thread_stop_indicate(&conn->recv_thr);
+			if (conn->fd >= 0)
+				shutdown(conn->fd, SHUT_RDWR);
+		}
 	}
 
 	/* don't really mind if this races */
@@ -119,7 +148,7 @@ static int iov_append(struct iovec *iov, int iovcnt, void *base, size_t len)
 
 static void socket_send_thread(struct thread *thr, void *arg)
 {
-	struct socket_peer_info *pinf = arg;
+	struct socket_conn *conn = arg;
 	struct socket_send_buf *sbuf;
 	struct cds_wfcq_node *node;
 	struct cds_wfcq_head head;
@@ -131,10 +160,10 @@ static void socket_send_thread(struct thread *thr, void *arg)
 
 	while (!thread_should_return(thr)) {
 
-		wait_event(&pinf->waitq, !cds_wfcq_empty(&pinf->send_q_head, &pinf->send_q_tail) ||
+		wait_event(&conn->waitq, !cds_wfcq_empty(&conn->send_q_head, &conn->send_q_tail) ||
 			   thread_should_return(thr));
 
-		__cds_wfcq_splice_nonblocking(&head, &tail, &pinf->send_q_head, &pinf->send_q_tail);
+		__cds_wfcq_splice_nonblocking(&head, &tail, &conn->send_q_head, &conn->send_q_tail);
 
 		while ((node = __cds_wfcq_dequeue_nonblocking(&head, &tail))) {
 			/* testing the theory that a single splice will never need to block */
@@ -143,7 +172,7 @@ static void socket_send_thread(struct thread *thr, void *arg)
 
 			iov_append(&iov, 0, &sbuf->hdr, sbuf->size);
 
-			ret = whole_iovec(writev, pinf->fd, &iov, 1);
+			ret = whole_iovec(writev, conn->fd, &iov, 1);
 			if (ret < 0)
 				goto out;
 
@@ -159,12 +188,13 @@ out:
 		free(sbuf);
 	}
 
-	shutdown_peer(pinf, ret);
+	shutdown_peer(conn->pinf, ret);
 }
 
 static void socket_recv_thread(struct thread *thr, void *arg)
 {
-	struct socket_peer_info *pinf = arg;
+	struct socket_conn *conn = arg;
+	struct socket_peer_info *pinf = conn->pinf;
 	struct page *ctl_page = NULL;
 	struct ngnfs_msg_header hdr;
 	struct ngnfs_msg_desc mdesc;
@@ -188,7 +218,7 @@ static void socket_recv_thread(struct thread *thr, void *arg)
 	while (!thread_should_return(thr)) {
 
 		iov_append(iov, 0, &hdr, sizeof(hdr));
-		ret = whole_iovec(readv, pinf->fd, iov, 1);
+		ret = whole_iovec(readv, conn->fd, iov, 1);
 		if (ret < 0)
 			break;
 
@@ -196,6 +226,7 @@ static void socket_recv_thread(struct thread *thr, void *arg)
 		if (ret < 0)
 			break;
 
+		mdesc.crc = le32_to_cpu(hdr.crc);
 		mdesc.data_size = le16_to_cpu(hdr.data_size);
 		mdesc.ctl_size = hdr.ctl_size;
 		mdesc.type = hdr.type;
@@ -213,7 +244,7 @@ static void socket_recv_thread(struct thread *thr, void *arg)
 		iovcnt = iov_append(iov, 0, page_address(ctl_page), mdesc.ctl_size);
 		iovcnt = iov_append(iov, iovcnt, page_address(mdesc.data_page), mdesc.data_size);
 
-		ret = whole_iovec(readv, pinf->fd, iov, iovcnt);
+		ret = whole_iovec(readv, conn->fd, iov, iovcnt);
 		if (ret < 0)
 			break;
 
@@ -231,10 +262,10 @@ out:
 	shutdown_peer(pinf, ret);
 }
 
-static int start_send_recv(struct socket_peer_info *pinf)
+static int start_send_recv(struct socket_conn *conn)
 {
-	return thread_start(&pinf->send_thr, socket_send_thread, pinf) ?:
-	       thread_start(&pinf->recv_thr, socket_recv_thread, pinf);
+	return thread_start(&conn->send_thr, socket_send_thread, conn) ?:
+	       thread_start(&conn->recv_thr, socket_recv_thread, conn);
 }
 
 /*
@@ -258,7 +289,8 @@ static int set_connected_options(int fd)
 
 static void socket_connect_thread(struct thread *thr, void *arg)
 {
-	struct socket_peer_info *pinf = arg;
+	struct socket_conn *conn = arg;
+	struct socket_peer_info *pinf = conn->pinf;
 	int fd = -1;
 	int ret;
 
@@ -270,7 +302,7 @@ static void socket_connect_thread(struct thread *thr, void *arg)
 
 	ret = connect(fd, (struct sockaddr *)&pinf->addr, sizeof(pinf->addr));
 	if (ret < 0) {
-		ret = -ret;
+		ret = -errno;
 		log("error creating send thread: "ENOF, ENOA(-ret));
 		goto out;
 	}
@@ -279,10 +311,10 @@ static void socket_connect_thread(struct thread *thr, void *arg)
 	if (ret < 0)
 		goto out;
 
-	pinf->fd = fd;
+	conn->fd = fd;
 	fd = -1;
 
-	ret = start_send_recv(pinf);
+	ret = start_send_recv(conn);
 out:
 	if (fd >= 0)
 		close(fd);
@@ -303,7 +335,7 @@ static void socket_listen_thread(struct thread *thr, void *arg)
 	while (!thread_should_return(thr)) {
 
 		len = sizeof(addr);
-		fd = accept(pinf->fd, (struct sockaddr *)&addr, &len);
+		fd = accept(pinf->conns[0].fd, (struct sockaddr *)&addr, &len);
 		if (fd < 0) {
 			ret = -errno;
 			log("accept error: "ENOF, ENOA(-ret));
@@ -331,56 +363,90 @@ static void socket_listen_thread(struct thread *thr, void *arg)
 	}
 }
 
-static void socket_init_peer(void *info, struct ngnfs_fs_info *nfi)
+/*
+ * Peers are initialized with the configured number of connections
+ * though accepted peers only ever use their first.
+ */
+static void socket_init_peer(void *info, struct ngnfs_fs_info *nfi, void *mtr_info)
 {
 	struct socket_peer_info *pinf = info;
+	struct socket_info *sinf = mtr_info;
+	struct socket_conn *conn;
+	int i;
 
 	pinf->nfi = nfi;
-	init_waitqueue_head(&pinf->waitq);
-	cds_wfcq_init(&pinf->send_q_head, &pinf->send_q_tail);
-	thread_init(&pinf->connect_thr);
 	thread_init(&pinf->listen_thr);
-	thread_init(&pinf->send_thr);
-	thread_init(&pinf->recv_thr);
-	pinf->fd = -1;
+	pinf->nr_conns = sinf ? sinf->nr_conns : 1;
+	pinf->steer = sinf ? sinf->steer : NGNFS_MTR_SOCKET_STEER_HASH;
+
+	for (i = 0; i < pinf->nr_conns; i++) {
+		conn = &pinf->conns[i];
+		conn->pinf = pinf;
+		init_waitqueue_head(&conn->waitq);
+		cds_wfcq_init(&conn->send_q_head, &conn->send_q_tail);
+		thread_init(&conn->connect_thr);
+		thread_init(&conn->send_thr);
+		thread_init(&conn->recv_thr);
+		conn->fd = -1;
+	}
 }
 
 static void socket_destroy_peer(void *info)
 {
 	struct socket_peer_info *pinf = info;
+	struct socket_conn *conn;
+	struct cds_wfcq_node *node;
+	int i;
 
-	thread_stop_wait(&pinf->connect_thr);
 	thread_stop_wait(&pinf->listen_thr);
-	thread_stop_wait(&pinf->send_thr);
-	thread_stop_wait(&pinf->recv_thr);
 
-	if (pinf->fd >= 0)
-		close(pinf->fd);
+	for (i = 0; i < pinf->nr_conns; i++) {
+		conn = &pinf->conns[i];
+
+		thread_stop_wait(&conn->connect_thr);
+		thread_stop_wait(&conn->send_thr);
+		thread_stop_wait(&conn->recv_thr);
+
+		while ((node = __cds_wfcq_dequeue_nonblocking(&conn->send_q_head,
+							      &conn->send_q_tail))) {
+			assert(node != CDS_WFCQ_WOULDBLOCK);
+			free(caa_container_of(node, struct socket_send_buf, q_node));
+		}
+
+		if (conn->fd >= 0)
+			close(conn->fd);
+	}
 }
 
 /*
- * Start up a socket for a peer in the msg core.
+ * Start up sockets for a peer in the msg core.
  *
  * If the start arg is null then the call is coming from a send and we
- * start the connect thread to try and get the socket.
+ * start a connect thread for each connection to try and get the
+ * sockets.
  *
  * If we have start arg then we're coming from accept and already have
- * an accepted socket fd, we start the send and recv threads.
+ * an accepted socket fd, we start the send and recv threads for a
+ * single connection.
  */
 static int socket_start(void *info, struct sockaddr_in *addr, void *accepted)
 {
 	struct socket_peer_info *pinf = info;
-	int ret;
+	int ret = 0;
+	int i;
 
 	pinf->addr = *addr;
 
 	if (accepted) {
 		int *fd = accepted;
 
-		pinf->fd = *fd;
-		ret = start_send_recv(pinf);
+		pinf->nr_conns = 1;
+		pinf->conns[0].fd = *fd;
+		ret = start_send_recv(&pinf->conns[0]);
 	} else {
-		ret = thread_start(&pinf->connect_thr, socket_connect_thread, pinf);
+		for (i = 0; i < pinf->nr_conns && ret == 0; i++)
+			ret = thread_start(&pinf->conns[i].connect_thr, socket_connect_thread,
+					   &pinf->conns[i]);
 	}
 
 	if (ret < 0)
@@ -391,8 +457,8 @@ static int socket_start(void *info, struct sockaddr_in *addr, void *accepted)
 
 /*
  * We re-use the peer structure for the listening context, but it's only
- * used to accept new connections.  The listen_thread is started as the
- * recv_thr and the send queue is never used.
+ * used to accept new connections on the first connection's fd.  The
+ * connection's threads and send queue are never used.
  */
 static void *socket_start_listen(struct ngnfs_fs_info *nfi, struct sockaddr_in *addr)
 {
@@ -406,30 +472,30 @@ static void *socket_start_listen(struct ngnfs_fs_info *nfi, struct sockaddr_in *
 		goto out;
 	}
 
-	socket_init_peer(pinf, nfi);
+	socket_init_peer(pinf, nfi, NULL);
 
-	pinf->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (pinf->fd < 0) {
+	pinf->conns[0].fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (pinf->conns[0].fd < 0) {
 		ret = -errno;
 		goto out;
 	}
 
 	optval = 1;
-	ret = setsockopt(pinf->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	ret = setsockopt(pinf->conns[0].fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 	if (ret < 0) {
 		ret = -errno;
 		log("setting SO_REUSEADDR failed");
 		goto out;
 	}
 
-	ret = bind(pinf->fd, (struct sockaddr *)addr, sizeof(*addr));
+	ret = bind(pinf->conns[0].fd, (struct sockaddr *)addr, sizeof(*addr));
 	if (ret < 0) {
 		ret = -errno;
 		log("binding to "IPV4F" failed", IPV4A(addr));
 		goto out;
 	}
 
-	ret = listen(pinf->fd, 255);
+	ret = listen(pinf->conns[0].fd, 255);
 	if (ret < 0) {
 		ret = -errno;
 		goto out;
@@ -461,14 +527,40 @@ static void socket_stop_listen(struct ngnfs_fs_info *nfi, void *info)
 	}
 }
 
+/*
+ * Class steering keeps block reads, block writes, and everything else
+ * on their own connections.
+ */
+static struct socket_conn *steer_conn(struct socket_peer_info *pinf,
+				      struct ngnfs_msg_desc *mdesc)
+{
+	u32 ind;
+
+	if (pinf->nr_conns == 1)
+		return &pinf->conns[0];
+
+	if (pinf->steer == NGNFS_MTR_SOCKET_STEER_CLASS) {
+		switch (mdesc->type) {
+			case NGNFS_MSG_GET_BLOCK:	ind = 0; break;
+			case NGNFS_MSG_WRITE_BLOCK:	ind = 1; break;
+			default:			ind = 2; break;
+		}
+	} else {
+		ind = mdesc->steer;
+	}
+
+	return &pinf->conns[ind % pinf->nr_conns];
+}
+
 /*
  * Copy the send data into an allocated buffer and queue it for the send
- * thread.  We copy the send page today but could use a page reference
- * in the future.
+ * thread of the steered connection.  We copy the send page today but
+ * could use a page reference in the future.
  */
 static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 {
 	struct socket_peer_info *pinf = info;
+	struct socket_conn *conn = steer_conn(pinf, mdesc);
 	struct socket_send_buf *sbuf;
 	void *data;
 	void *ctl;
@@ -485,9 +577,9 @@ static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 		goto out;
 	}
 
-	/* XXX crc not used yet */
 	cds_wfcq_node_init(&sbuf->q_node);
 	sbuf->size = sizeof(struct ngnfs_msg_header) + mdesc->ctl_size + mdesc->data_size;
+	sbuf->hdr.crc = cpu_to_le32(ngnfs_msg_crc(mdesc));
 	sbuf->hdr.data_size = cpu_to_le16(mdesc->data_size);
 	sbuf->hdr.ctl_size = mdesc->ctl_size;
 	sbuf->hdr.type = mdesc->type;
@@ -500,14 +592,43 @@ static int socket_send(void *info, struct ngnfs_msg_desc *mdesc)
 	if (mdesc->data_size)
 		memcpy(data, page_address(mdesc->data_page), mdesc->data_size);
 
-	cds_wfcq_enqueue(&pinf->send_q_head, &pinf->send_q_tail, &sbuf->q_node);
-	wake_up(&pinf->waitq);
+	cds_wfcq_enqueue(&conn->send_q_head, &conn->send_q_tail, &sbuf->q_node);
+	wake_up(&conn->waitq);
 	ret = 0;
 out:
 	return ret;
 }
 
+/*
+ * The setup arg is an optional struct ngnfs_mtr_socket_options.
+ */
+static void *socket_setup(struct ngnfs_fs_info *nfi, void *arg)
+{
+	struct ngnfs_mtr_socket_options *opts = arg;
+	struct socket_info *sinf;
+
+	if (opts && (opts->nr_conns < 1 || opts->nr_conns > NGNFS_MTR_SOCKET_MAX_CONNS ||
+		     opts->steer >= NGNFS_MTR_SOCKET_STEER__NR))
+		return ERR_PTR(-EINVAL);
+
+	sinf = calloc(1, sizeof(struct socket_info));
+	if (!sinf)
+		return ERR_PTR(-ENOMEM);
+
+	sinf->nr_conns = opts ? opts->nr_conns : 1;
+	sinf->steer = opts ? opts->steer : NGNFS_MTR_SOCKET_STEER_HASH;
+
+	return sinf;
+}
+
+static void socket_destroy(struct ngnfs_fs_info *nfi, void *mtr_info)
+{
+	free(mtr_info);
+}
+
 struct ngnfs_msg_transport_ops ngnfs_mtr_socket_ops = {
+	.setup = socket_setup,
+	.destroy = socket_destroy,
 	.start_listen = socket_start_listen,
 	.stop_listen = socket_stop_listen,
 
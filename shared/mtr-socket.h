@@ -2,8 +2,24 @@
 #ifndef NGNFS_SHARED_MTR_SOCKET_H
 #define NGNFS_SHARED_MTR_SOCKET_H
 
+#include "shared/lk/types.h"
 #include "shared/msg.h"
 
+#define NGNFS_MTR_SOCKET_MAX_CONNS 8
+
+enum {
+	/* by the sender's steer hint */
+	NGNFS_MTR_SOCKET_STEER_HASH = 0,
+	/* block reads, block writes, and other messages on separate connections */
+	NGNFS_MTR_SOCKET_STEER_CLASS,
+	NGNFS_MTR_SOCKET_STEER__NR,
+};
+
+struct ngnfs_mtr_socket_options {
+	u8 nr_conns;
+	u8 steer;
+};
+
 extern struct ngnfs_msg_transport_ops ngnfs_mtr_socket_ops;
 
 #endif
@@ -12,13 +12,17 @@
  * consume and act on the result of the operation before tearing down
  * the txn which drops locks.
  *
- * This could also let us support multiple operations in one
- * transaction, though the api would need to be expanded a bit.
+ * Batches of independent operations are grouped by the blocks they
+ * modify.  All the operations on a block are performed by one prepare
+ * and commit, and many blocks are modified in one transaction so that
+ * they're dirtied and written together.
  */
 
 #include "shared/lk/bug.h"
 #include "shared/lk/byteorder.h"
 #include "shared/lk/errno.h"
+#include "shared/lk/minmax.h"
+#include "shared/lk/sort.h"
 #include "shared/lk/types.h"
 
 #include "shared/block.h"
@@ -47,7 +51,7 @@ static void commit_mkfs(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn
 	int ret;
 
 	bt = ngnfs_block_buf(bl);
-	ngnfs_btree_init_block(bt, 0);
+	ngnfs_btree_init_block(bt, 0, 0);
 
 	ret = ngnfs_btree_insert(bt, &key, sizeof(key), ninode, sizeof(struct ngnfs_inode));
 	BUG_ON(ret != 0);
@@ -120,8 +124,229 @@ int ngnfs_pfs_read_inode(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *tx
 
 	ret = map_iblock(&bnr, ino) ?:
 	      ngnfs_txn_add_block(nfi, txn, bnr, NBF_READ, prepare_read_inode, NULL, &args) ?:
-	      ngnfs_txn_execute(nfi, txn);
+	      ngnfs_txn_execute_read(nfi, txn);
 	ngnfs_txn_destroy(nfi, txn);
 
 	return ret ?: args.ret;
 }
+
+/*
+ * The number of blocks modified by each transaction in a batch.  It
+ * leaves room under the dirty set limit for sets to merge.
+ */
+#define BATCH_BLOCKS	32
+
+struct batch_entry {
+	u64 bnr;
+	struct ngnfs_pfs_op *op;
+};
+
+struct batch_block {
+	struct batch_entry *ents;
+	unsigned int nr;
+	struct ngnfs_inode ninode;
+	bool init;
+	bool existed;
+	bool present;
+};
+
+/* sort by block then by op order within a block */
+static int cmp_batch_entries(const void *A, const void *B, const void *priv)
+{
+	const struct batch_entry *a = A;
+	const struct batch_entry *b = B;
+
+	return a->bnr < b->bnr ? -1 : a->bnr > b->bnr ? 1 :
+	       a->op < b->op ? -1 : a->op > b->op ? 1 : 0;
+}
+
+static void set_attrs(struct ngnfs_inode *ninode, struct ngnfs_inode *attrs, u32 mask)
+{
+	if (mask & NGNFS_PFS_ATTR_MODE)
+		ninode->mode = attrs->mode;
+	if (mask & NGNFS_PFS_ATTR_UID)
+		ninode->uid = attrs->uid;
+	if (mask & NGNFS_PFS_ATTR_GID)
+		ninode->gid = attrs->gid;
+	if (mask & NGNFS_PFS_ATTR_SIZE)
+		ninode->size = attrs->size;
+	if (mask & NGNFS_PFS_ATTR_ATIME)
+		ninode->atime_nsec = attrs->atime_nsec;
+	if (mask & NGNFS_PFS_ATTR_MTIME)
+		ninode->mtime_nsec = attrs->mtime_nsec;
+	if (mask & NGNFS_PFS_ATTR_CTIME)
+		ninode->ctime_nsec = attrs->ctime_nsec;
+}
+
+/*
+ * Perform the block's ops in order on a copy of its inode, recording
+ * each op's result.  Commit then only has to store the final inode.
+ * Blocks that have never been written read as zeros and are
+ * initialized by commit.
+ */
+static int prepare_batch(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			 struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	struct batch_block *bb = arg;
+	u8 key = NGNFS_IBLOCK_KEY_INODE;
+	struct ngnfs_pfs_op *op;
+	unsigned int i;
+	int ret;
+
+	bb->init = bt->nr_items == 0 && bt->total_free == 0;
+	if (bb->init)
+		ret = -ENOENT;
+	else
+		ret = ngnfs_btree_lookup(bt, &key, sizeof(key), &bb->ninode, sizeof(bb->ninode));
+	if (ret >= 0 && ret != sizeof(bb->ninode))
+		return -EIO;
+	if (ret < 0 && ret != -ENOENT)
+		return ret;
+
+	bb->existed = ret >= 0;
+	bb->present = bb->existed;
+
+	for (i = 0; i < bb->nr; i++) {
+		op = bb->ents[i].op;
+
+		switch (op->type) {
+		case NGNFS_PFS_OP_CREATE:
+			if (bb->present) {
+				op->ret = -EEXIST;
+			} else if (!bb->existed && !bb->init &&
+				   !ngnfs_btree_has_room(bt, &key, sizeof(key), sizeof(bb->ninode))) {
+				op->ret = -ENOSPC;
+			} else {
+				bb->ninode = *op->ninode;
+				bb->ninode.ino = cpu_to_le64(op->ino);
+				bb->present = true;
+				op->ret = 0;
+			}
+			break;
+
+		case NGNFS_PFS_OP_SETATTR:
+			if (bb->present) {
+				set_attrs(&bb->ninode, op->ninode, op->attr_mask);
+				op->ret = 0;
+			} else {
+				op->ret = -ENOENT;
+			}
+			break;
+
+		case NGNFS_PFS_OP_UNLINK:
+			if (bb->present) {
+				if (bb->ninode.nlink != 0)
+					bb->ninode.nlink = cpu_to_le32(le32_to_cpu(bb->ninode.nlink) - 1);
+				bb->present = bb->ninode.nlink != 0;
+				op->ret = 0;
+			} else {
+				op->ret = -ENOENT;
+			}
+			break;
+
+		default:
+			op->ret = -EINVAL;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void commit_batch(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			 struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	struct batch_block *bb = arg;
+	u8 key = NGNFS_IBLOCK_KEY_INODE;
+	int ret = 0;
+
+	if (bb->init)
+		ngnfs_btree_init_block(bt, 0, 0);
+
+	if (bb->present && bb->existed)
+		ret = ngnfs_btree_update(bt, &key, sizeof(key), &bb->ninode, sizeof(bb->ninode));
+	else if (bb->present)
+		ret = ngnfs_btree_insert(bt, &key, sizeof(key), &bb->ninode, sizeof(bb->ninode));
+	else if (bb->existed)
+		ret = ngnfs_btree_delete(bt, &key, sizeof(key));
+	BUG_ON(ret != 0);
+}
+
+/*
+ * Perform a batch of inode operations.  The ops are grouped by the
+ * blocks they modify and are performed in order within each block.
+ * The blocks are modified in as few transactions as the dirty set
+ * limits allow.  The caller's txn is reset between transactions and
+ * the caller tears it down after the batch.
+ *
+ * Each op's result is stored in its ret.  If an error is returned then
+ * ops whose transactions weren't committed have their ret set to the
+ * error.
+ */
+int ngnfs_pfs_batch(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		    struct ngnfs_pfs_op *ops, unsigned int nr)
+{
+	struct batch_block *blocks = NULL;
+	struct batch_entry *ents = NULL;
+	struct batch_block *bb;
+	unsigned int nr_blocks;
+	unsigned int start = 0;
+	unsigned int n = 0;
+	unsigned int i;
+	int ret;
+
+	if (nr == 0)
+		return 0;
+
+	ents = kmalloc(nr * sizeof(ents[0]), GFP_NOFS);
+	blocks = kmalloc(min(nr, BATCH_BLOCKS) * sizeof(blocks[0]), GFP_NOFS);
+	if (!ents || !blocks) {
+		for (i = 0; i < nr; i++)
+			ops[i].ret = -ENOMEM;
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ops[i].ret = map_iblock(&ents[n].bnr, ops[i].ino);
+		if (ops[i].ret == 0)
+			ents[n++].op = &ops[i];
+	}
+
+	sort_r(ents, n, sizeof(ents[0]), cmp_batch_entries, NULL, NULL);
+
+	for (i = 0; i < n; start = i) {
+		for (nr_blocks = 0; i < n && nr_blocks < BATCH_BLOCKS; nr_blocks++) {
+			bb = &blocks[nr_blocks];
+			bb->ents = &ents[i];
+			bb->nr = 0;
+			do {
+				bb->nr++;
+				i++;
+			} while (i < n && ents[i].bnr == bb->ents[0].bnr);
+
+			ret = ngnfs_txn_add_block(nfi, txn, bb->ents[0].bnr, NBF_WRITE,
+						  prepare_batch, commit_batch, bb);
+			if (ret < 0)
+				goto out;
+		}
+
+		ret = ngnfs_txn_execute(nfi, txn);
+		ngnfs_txn_reset(nfi, txn);
+		if (ret < 0)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	if (ret < 0) {
+		for (i = start; i < n; i++)
+			ents[i].op->ret = ret;
+	}
+
+	kfree(ents);
+	kfree(blocks);
+	return ret;
+}
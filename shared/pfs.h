@@ -6,9 +6,39 @@
 #include "shared/lk/time64.h"
 #include "shared/txn.h"
 
+/*
+ * Batches are arrays of independent inode operations.  Create
+ * initializes an inode from @ninode, setattr copies the fields in
+ * @attr_mask from @ninode, and unlink drops a link and removes the inode
+ * once its last link is gone.  Each op's result is stored in @ret.
+ */
+enum {
+	NGNFS_PFS_OP_CREATE = 0,
+	NGNFS_PFS_OP_SETATTR,
+	NGNFS_PFS_OP_UNLINK,
+};
+
+#define NGNFS_PFS_ATTR_MODE	(1 << 0)
+#define NGNFS_PFS_ATTR_UID	(1 << 1)
+#define NGNFS_PFS_ATTR_GID	(1 << 2)
+#define NGNFS_PFS_ATTR_SIZE	(1 << 3)
+#define NGNFS_PFS_ATTR_ATIME	(1 << 4)
+#define NGNFS_PFS_ATTR_MTIME	(1 << 5)
+#define NGNFS_PFS_ATTR_CTIME	(1 << 6)
+
+struct ngnfs_pfs_op {
+	u64 ino;
+	struct ngnfs_inode *ninode;
+	u32 attr_mask;
+	u8 type;
+	int ret;
+};
+
 int ngnfs_pfs_mkfs(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
 		   u64 root_ino, u64 nsec);
 int ngnfs_pfs_read_inode(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn, u64 ino,
 			 struct ngnfs_inode *ninode, size_t size);
+int ngnfs_pfs_batch(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		    struct ngnfs_pfs_op *ops, unsigned int nr);
 
 #endif
@@ -0,0 +1,1064 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Multi-level btrees are built from btree blocks whose items are
+ * modified by the btree block functions.  Leaf blocks at level 0 store
+ * the caller's items and parent blocks store items whose keys are
+ * greater than or equal to all the keys in the child block referenced
+ * by their value.  Searches descend to the child of the first parent
+ * item whose key is greater than or equal to the search key, or the
+ * last child if the key is greater than all the parent keys.
+ *
+ * Each operation walks down the tree in a transaction, adding each
+ * child block as its parent is prepared.  Changes to the structure of
+ * the tree are made preemptively on the way down: a block that might
+ * not have room for the changes from below is split, and a block that
+ * has fallen under the minimum utilization is refilled from a sibling.
+ * Rather than making the structural change and the operation in one
+ * transaction we commit the structural change and retry the operation
+ * from the root.  The number of blocks in a transaction is then
+ * limited to the path and a sibling or two, and structural changes
+ * are always made to blocks whose parents have room for their updated
+ * parent items.
+ *
+ * Writing walks descend through parents with read references and only
+ * take a write reference on the leaf, so writers to different leaves
+ * don't serialize on the upper blocks and only dirty the leaf.  If a
+ * parent needs to be modified, by a restructure or by extending its
+ * last key, the walk retries with write references from that parent
+ * down.  The root's level isn't known until it's read so writing to a
+ * tree whose root is a leaf retries once.
+ *
+ * The root block number is fixed.  The tree grows by moving the root
+ * items into a new child and shrinks by copying the root's only child
+ * back into the root.
+ *
+ * Cursors iterate over items by keeping a copy of each leaf block and
+ * the keys that bound the leaf in its parents.  Moving past the end of
+ * the leaf descends again to the leaf after the bound.  As the cursor
+ * descends through the last parent level it starts reading the
+ * siblings in the direction of iteration so that they're likely cached
+ * by the time the cursor reaches them.
+ *
+ * Builders construct new trees from items in sorted order.  They fill
+ * a private block at each level and write it once it's full, adding
+ * its parent item to the block at the next level.  The root is written
+ * last so the tree only becomes visible once it's complete.
+ *
+ * Callers manage serialization of modifications to each tree.
+ */
+
+#include "shared/lk/bug.h"
+#include "shared/lk/byteorder.h"
+#include "shared/lk/err.h"
+#include "shared/lk/errno.h"
+#include "shared/lk/slab.h"
+#include "shared/lk/string.h"
+#include "shared/lk/types.h"
+
+#include "shared/block.h"
+#include "shared/btree.h"
+#include "shared/format-block.h"
+#include "shared/tree.h"
+#include "shared/txn.h"
+
+/* leaves read ahead of cursor iteration */
+#define TREE_PREFETCH_NR	8
+
+/* used space moved to the new sibling by splits for appends */
+#define TREE_APPEND_SPLIT_PCT	90
+
+enum {
+	WALK_LOOKUP = 0,
+	WALK_INSERT,
+	WALK_DELETE,
+	WALK_CURSOR,
+};
+
+enum {
+	RESTRUCT_NONE = 0,
+	RESTRUCT_GROW,
+	RESTRUCT_SPLIT,
+	RESTRUCT_REFILL,
+	RESTRUCT_COLLAPSE,
+};
+
+struct tree_walk {
+	struct ngnfs_tree_root *root;
+	int op;
+	void *key;
+	size_t key_size;
+	void *val;
+	size_t val_size;
+	int ret;
+
+	/* the blocks from the root down to the most recently prepared block */
+	int nr;
+	int write_at;
+	u64 next_bnr;
+	u8 next_level;
+	struct ngnfs_block *path[NGNFS_TREE_MAX_HEIGHT];
+	u16 pos[NGNFS_TREE_MAX_HEIGHT];
+	bool extend[NGNFS_TREE_MAX_HEIGHT];
+
+	/* a structural change that's committed instead of the operation */
+	int restruct;
+	int at;
+	u16 sib_pos;
+	u8 sib_level;
+	u64 sib_bnr;
+	struct ngnfs_block *sib;
+	int nr_new;
+	int nr_new_bl;
+	u64 new_bnr[2];
+	struct ngnfs_block *new_bl[2];
+	bool committed;
+
+	/* cursor descent */
+	struct ngnfs_tree_cursor *curs;
+	bool after;
+	bool leaf_after;
+	bool last;
+	bool reverse;
+	u8 key_buf[NGNFS_BTREE_KEY_SIZE_MAX];
+};
+
+static inline struct ngnfs_btree_block *path_bt(struct tree_walk *walk, int i)
+{
+	return ngnfs_block_buf(walk->path[i]);
+}
+
+static inline bool walk_writes(struct tree_walk *walk)
+{
+	return walk->op == WALK_INSERT || walk->op == WALK_DELETE;
+}
+
+/*
+ * Writing walks get write references on leaves and on the blocks at
+ * and below write_at in the path.  The root is added before its level
+ * is known.
+ */
+static nbf_t path_nbf(struct tree_walk *walk, int i, int level)
+{
+	if (walk_writes(walk) && (i >= walk->write_at || (i > 0 && level == 0)))
+		return NBF_WRITE;
+
+	return NBF_READ;
+}
+
+/*
+ * The walk is going to modify the block at @i in the path.  If we only
+ * have a read reference then we retry with write references from the
+ * block down.
+ */
+static int need_write(struct tree_walk *walk, int i)
+{
+	if (path_nbf(walk, i, path_bt(walk, i)->level) == NBF_WRITE)
+		return 0;
+
+	walk->write_at = i;
+	return -EAGAIN;
+}
+
+static void commit_walk(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			struct ngnfs_block *bl, void *arg);
+static int prepare_walk(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			struct ngnfs_block *bl, void *arg);
+
+static int prepare_sib(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		       struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	struct tree_walk *walk = arg;
+
+	if (le64_to_cpu(bt->bnr) != walk->sib_bnr || bt->level != walk->sib_level)
+		return -EIO;
+
+	walk->sib = bl;
+	return 0;
+}
+
+static int prepare_new(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		       struct ngnfs_block *bl, void *arg)
+{
+	struct tree_walk *walk = arg;
+
+	walk->new_bl[walk->nr_new_bl++] = bl;
+	return 0;
+}
+
+static int add_sib(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		   struct tree_walk *walk, struct ngnfs_btree_block *parent, u16 pos)
+{
+	int ret;
+
+	ret = ngnfs_btree_child(parent, pos, &walk->sib_bnr);
+	if (ret < 0)
+		return ret;
+
+	walk->sib_pos = pos;
+	walk->sib_level = parent->level - 1;
+
+	return ngnfs_txn_add_block(nfi, txn, walk->sib_bnr, NBF_WRITE, prepare_sib,
+				   commit_walk, walk);
+}
+
+static int add_new(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+		   struct tree_walk *walk, int nr)
+{
+	struct ngnfs_tree_root *root = walk->root;
+	int ret = 0;
+
+	while (walk->nr_new < nr) {
+		ret = root->alloc(nfi, root->arg, &walk->new_bnr[walk->nr_new]);
+		if (ret < 0)
+			break;
+
+		ret = ngnfs_txn_add_block(nfi, txn, walk->new_bnr[walk->nr_new++],
+					  NBF_NEW | NBF_WRITE, prepare_new, commit_walk, walk);
+		if (ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Decide if the most recently prepared block needs to be restructured
+ * before the operation can proceed through it.  If it does we record
+ * the change and add the additional blocks it needs to the txn instead
+ * of descending.
+ */
+static int plan_restruct(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			 struct tree_walk *walk, int i)
+{
+	struct ngnfs_btree_block *bt = path_bt(walk, i);
+	struct ngnfs_btree_block *parent;
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 pos;
+	int ret = 0;
+
+	if (bt->level > 0 && i == 0 && nr == 1 && walk->op == WALK_DELETE) {
+		walk->restruct = RESTRUCT_COLLAPSE;
+		walk->at = i;
+		ret = need_write(walk, i) ?:
+		      add_sib(nfi, txn, walk, bt, 0);
+
+	} else if ((bt->level > 0 &&
+		    !ngnfs_btree_has_room(bt, NULL, NGNFS_BTREE_KEY_SIZE_MAX,
+					  sizeof(struct ngnfs_btree_ref))) ||
+		   (bt->level == 0 && walk->op == WALK_INSERT &&
+		    !ngnfs_btree_has_room(bt, walk->key, walk->key_size, walk->val_size) &&
+		    ngnfs_btree_lookup(bt, walk->key, walk->key_size, NULL, 0) == -ENOENT)) {
+		walk->restruct = i == 0 ? RESTRUCT_GROW : RESTRUCT_SPLIT;
+		walk->at = i;
+		ret = need_write(walk, i == 0 ? i : i - 1) ?:
+		      add_new(nfi, txn, walk, i == 0 ? 2 : 1);
+
+	} else if (i > 0 && walk->op == WALK_DELETE && ngnfs_btree_underfull(bt)) {
+		parent = path_bt(walk, i - 1);
+		if (le16_to_cpu(parent->nr_items) > 1) {
+			pos = walk->pos[i - 1];
+			walk->restruct = RESTRUCT_REFILL;
+			walk->at = i;
+			ret = need_write(walk, i - 1) ?:
+			      add_sib(nfi, txn, walk, parent,
+				      pos + 1 < le16_to_cpu(parent->nr_items) ? pos + 1 : pos - 1);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Record the keys in the parent that bound the cursor's leaf.  The
+ * first and last children inherit the bounds from further up the path.
+ */
+static void record_bounds(struct tree_walk *walk, struct ngnfs_btree_block *bt, u16 pos)
+{
+	struct ngnfs_tree_cursor *curs = walk->curs;
+	u16 nr = le16_to_cpu(bt->nr_items);
+	size_t size;
+
+	if (pos > 0) {
+		ngnfs_btree_item_at(bt, pos - 1, curs->lower, &size, NULL, 0);
+		curs->lower_size = size;
+	}
+
+	if (pos + 1 < nr) {
+		ngnfs_btree_item_at(bt, pos, curs->upper, &size, NULL, 0);
+		curs->upper_size = size;
+	}
+}
+
+static void prefetch_leaves(struct ngnfs_fs_info *nfi, struct tree_walk *walk,
+			    struct ngnfs_btree_block *bt, u16 pos)
+{
+	int nr = le16_to_cpu(bt->nr_items);
+	u64 bnr;
+	int p;
+	int i;
+
+	for (i = 1; i <= TREE_PREFETCH_NR; i++) {
+		p = walk->reverse ? (int)pos - i : (int)pos + i;
+		if (p < 0 || p >= nr)
+			break;
+
+		if (ngnfs_btree_child(bt, p, &bnr) == 0)
+			ngnfs_block_prefetch(nfi, bnr);
+	}
+}
+
+static int prepare_leaf(struct tree_walk *walk, struct ngnfs_btree_block *bt)
+{
+	struct ngnfs_tree_cursor *curs = walk->curs;
+	int ret = 0;
+
+	switch (walk->op) {
+	case WALK_LOOKUP:
+		walk->ret = ngnfs_btree_lookup(bt, walk->key, walk->key_size,
+					       walk->val, walk->val_size);
+		break;
+	case WALK_INSERT:
+		if (ngnfs_btree_lookup(bt, walk->key, walk->key_size, NULL, 0) >= 0)
+			ret = -EEXIST;
+		break;
+	case WALK_DELETE:
+		ret = ngnfs_btree_lookup(bt, walk->key, walk->key_size, NULL, 0);
+		if (ret > 0)
+			ret = 0;
+		break;
+	case WALK_CURSOR:
+		memcpy(curs->leaf, bt, NGNFS_BLOCK_SIZE);
+		if (walk->last)
+			curs->pos = le16_to_cpu(bt->nr_items);
+		else
+			curs->pos = ngnfs_btree_search_pos(bt, walk->key, walk->key_size,
+							   walk->leaf_after);
+		break;
+	}
+
+	return ret;
+}
+
+static int prepare_walk(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+	struct tree_walk *walk = arg;
+	int i = walk->nr;
+	u64 bnr;
+	u16 pos;
+	u16 nr;
+	int ret;
+
+	/* make sure the block is the one we expect in the tree */
+	if (i == NGNFS_TREE_MAX_HEIGHT || le64_to_cpu(bt->bnr) != walk->next_bnr ||
+	    (i > 0 && bt->level != walk->next_level))
+		return -EIO;
+
+	walk->path[i] = bl;
+	walk->nr++;
+
+	if (walk_writes(walk)) {
+		if (bt->level == 0) {
+			ret = need_write(walk, i);
+			if (ret < 0)
+				return ret;
+		}
+
+		ret = plan_restruct(nfi, txn, walk, i);
+		if (ret < 0 || walk->restruct != RESTRUCT_NONE)
+			return ret;
+	}
+
+	if (bt->level == 0)
+		return prepare_leaf(walk, bt);
+
+	nr = le16_to_cpu(bt->nr_items);
+	if (nr == 0)
+		return -EIO;
+
+	if (walk->last)
+		pos = nr;
+	else
+		pos = ngnfs_btree_search_pos_prefixes(bt, ngnfs_block_prefixes(bl), walk->key,
+						      walk->key_size, walk->after);
+	if (pos >= nr) {
+		pos = nr - 1;
+		if (walk->op == WALK_INSERT) {
+			walk->extend[i] = true;
+			ret = need_write(walk, i);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	walk->pos[i] = pos;
+
+	if (walk->op == WALK_CURSOR) {
+		record_bounds(walk, bt, pos);
+		if (bt->level == 1)
+			prefetch_leaves(nfi, walk, bt, pos);
+	}
+
+	ret = ngnfs_btree_child(bt, pos, &bnr);
+	if (ret < 0)
+		return ret;
+
+	walk->next_bnr = bnr;
+	walk->next_level = bt->level - 1;
+	return ngnfs_txn_add_block(nfi, txn, bnr, path_nbf(walk, i + 1, walk->next_level),
+				   prepare_walk, commit_walk, walk);
+}
+
+static void commit_op(struct tree_walk *walk)
+{
+	struct ngnfs_btree_block *leaf = path_bt(walk, walk->nr - 1);
+	int ret;
+	int i;
+
+	if (walk->op == WALK_INSERT) {
+		for (i = 0; i < walk->nr - 1; i++) {
+			if (walk->extend[i])
+				ngnfs_btree_extend_last(path_bt(walk, i), walk->key,
+							walk->key_size);
+		}
+		ret = ngnfs_btree_insert(leaf, walk->key, walk->key_size,
+					 walk->val, walk->val_size);
+	} else {
+		ret = ngnfs_btree_delete(leaf, walk->key, walk->key_size);
+	}
+
+	/* prepare made sure the leaf had room or had the item */
+	BUG_ON(ret != 0);
+}
+
+/*
+ * Splits normally balance the items between the two blocks.  Inserting
+ * after all the items on the right spine of the tree is likely to be a
+ * sequential append that would leave every split block half empty, so
+ * those splits move most of the items to the lesser sibling and leave
+ * room in the block for the appends.
+ */
+static u8 split_pct(struct tree_walk *walk, struct ngnfs_btree_block *bt)
+{
+	u16 nr = le16_to_cpu(bt->nr_items);
+	u16 pos;
+	int i;
+
+	if (walk->op != WALK_INSERT)
+		return 50;
+
+	for (i = 0; i < walk->at; i++) {
+		if (walk->pos[i] + 1 != le16_to_cpu(path_bt(walk, i)->nr_items))
+			return 50;
+	}
+
+	/* leaf keys must be after all items, parent keys in the last child */
+	pos = ngnfs_btree_search_pos(bt, walk->key, walk->key_size, false);
+	if (pos < (bt->level > 0 ? nr - 1 : nr))
+		return 50;
+
+	return walk->root->append_split_pct ?: TREE_APPEND_SPLIT_PCT;
+}
+
+/*
+ * The commit function is called for every written block in the txn
+ * but we make all the changes the first time it's called.
+ */
+static void commit_walk(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			struct ngnfs_block *bl, void *arg)
+{
+	struct tree_walk *walk = arg;
+	struct ngnfs_btree_block *parent;
+	struct ngnfs_btree_block *bt;
+	struct ngnfs_btree_block *sib;
+	struct ngnfs_btree_block *a;
+	struct ngnfs_btree_block *b;
+	u8 pct;
+
+	if (walk->committed)
+		return;
+	walk->committed = true;
+
+	bt = path_bt(walk, walk->at);
+	parent = walk->at > 0 ? path_bt(walk, walk->at - 1) : NULL;
+
+	switch (walk->restruct) {
+	case RESTRUCT_NONE:
+		commit_op(walk);
+		break;
+
+	case RESTRUCT_GROW:
+		a = ngnfs_block_buf(walk->new_bl[0]);
+		b = ngnfs_block_buf(walk->new_bl[1]);
+		a->bnr = cpu_to_le64(walk->new_bnr[0]);
+		pct = split_pct(walk, bt);
+		ngnfs_btree_grow(bt, a);
+		ngnfs_btree_init_block(b, a->level, a->flags);
+		b->bnr = cpu_to_le64(walk->new_bnr[1]);
+		ngnfs_btree_split(bt, 0, a, b, pct);
+		break;
+
+	case RESTRUCT_SPLIT:
+		sib = ngnfs_block_buf(walk->new_bl[0]);
+		ngnfs_btree_init_block(sib, bt->level, bt->flags);
+		sib->bnr = cpu_to_le64(walk->new_bnr[0]);
+		ngnfs_btree_split(parent, walk->pos[walk->at - 1], bt, sib, split_pct(walk, bt));
+		break;
+
+	case RESTRUCT_REFILL:
+		sib = ngnfs_block_buf(walk->sib);
+		ngnfs_btree_refill(parent, walk->pos[walk->at - 1], walk->sib_pos, bt, sib);
+		break;
+
+	case RESTRUCT_COLLAPSE:
+		ngnfs_btree_shrink(bt, ngnfs_block_buf(walk->sib));
+		break;
+	}
+}
+
+static void reset_walk(struct tree_walk *walk)
+{
+	walk->nr = 0;
+	walk->next_bnr = walk->root->bnr;
+	memset(walk->extend, 0, sizeof(walk->extend));
+	walk->restruct = RESTRUCT_NONE;
+	walk->at = 0;
+	walk->sib = NULL;
+	walk->nr_new = 0;
+	walk->nr_new_bl = 0;
+	walk->committed = false;
+	walk->ret = 0;
+
+	if (walk->curs) {
+		walk->curs->lower_size = 0;
+		walk->curs->upper_size = 0;
+	}
+}
+
+/*
+ * Walk down the tree until the operation completes without having to
+ * first restructure the tree.  Blocks removed from the tree are freed
+ * once the restructuring txn succeeds and allocated blocks are freed if
+ * it fails.  We start over if the txn conflicted with another.
+ */
+static int walk_tree(struct ngnfs_fs_info *nfi, struct tree_walk *walk)
+{
+	struct ngnfs_tree_root *root = walk->root;
+	struct ngnfs_transaction txn;
+	bool free_sib;
+	int ret;
+	int i;
+
+	ngnfs_txn_init(&txn);
+
+	for (;;) {
+		reset_walk(walk);
+
+		ret = ngnfs_txn_add_block(nfi, &txn, root->bnr, path_nbf(walk, 0, -1),
+					  prepare_walk, commit_walk, walk) ?:
+		      ngnfs_txn_execute(nfi, &txn);
+
+		free_sib = ret == 0 &&
+			   (walk->restruct == RESTRUCT_COLLAPSE ||
+			    (walk->restruct == RESTRUCT_REFILL &&
+			     ((struct ngnfs_btree_block *)ngnfs_block_buf(walk->sib))->nr_items == 0));
+
+		ngnfs_txn_reset(nfi, &txn);
+
+		if (ret < 0) {
+			if (root->free) {
+				for (i = 0; i < walk->nr_new; i++)
+					root->free(nfi, root->arg, walk->new_bnr[i]);
+			}
+			if (ret == -EAGAIN)
+				continue;
+			break;
+		}
+
+		if (free_sib && root->free)
+			root->free(nfi, root->arg, walk->sib_bnr);
+
+		if (walk->restruct == RESTRUCT_NONE)
+			break;
+	}
+
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret;
+}
+
+static struct tree_walk *alloc_walk(struct ngnfs_tree_root *root, int op, void *key,
+				    size_t key_size, void *val, size_t val_size)
+{
+	struct tree_walk *walk;
+
+	walk = kzalloc(sizeof(struct tree_walk), GFP_NOFS);
+	if (walk) {
+		walk->root = root;
+		walk->op = op;
+		walk->key = key;
+		walk->key_size = key_size;
+		walk->val = val;
+		walk->val_size = val_size;
+		walk->write_at = NGNFS_TREE_MAX_HEIGHT;
+	}
+
+	return walk;
+}
+
+static void commit_create(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			  struct ngnfs_block *bl, void *arg)
+{
+	struct ngnfs_tree_root *root = arg;
+	struct ngnfs_btree_block *bt = ngnfs_block_buf(bl);
+
+	ngnfs_btree_init_block(bt, 0, root->block_flags);
+	bt->bnr = cpu_to_le64(root->bnr);
+}
+
+/*
+ * Initialize the root block of a new empty tree.
+ */
+int ngnfs_tree_create(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root)
+{
+	struct ngnfs_transaction txn;
+	int ret;
+
+	ngnfs_txn_init(&txn);
+	ret = ngnfs_txn_add_block(nfi, &txn, root->bnr, NBF_NEW | NBF_WRITE, NULL,
+				  commit_create, root) ?:
+	      ngnfs_txn_execute(nfi, &txn);
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret;
+}
+
+/*
+ * Copy the value of the item with the given key into the caller's
+ * buffer, returning the number of bytes copied or -ENOENT.
+ */
+int ngnfs_tree_lookup(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size, void *val, size_t val_size)
+{
+	struct tree_walk *walk;
+	int ret;
+
+	if (key_size == 0 || key_size > NGNFS_BTREE_KEY_SIZE_MAX)
+		return -EINVAL;
+
+	walk = alloc_walk(root, WALK_LOOKUP, key, key_size, val, val_size);
+	if (!walk)
+		return -ENOMEM;
+
+	ret = walk_tree(nfi, walk) ?: walk->ret;
+	kfree(walk);
+
+	return ret;
+}
+
+/*
+ * Insert a new item, returning -EEXIST if an item with the key exists.
+ */
+int ngnfs_tree_insert(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size, void *val, size_t val_size)
+{
+	struct tree_walk *walk;
+	int ret;
+
+	if (key_size == 0 || key_size > NGNFS_BTREE_KEY_SIZE_MAX ||
+	    val_size > NGNFS_BTREE_VAL_SIZE_MAX)
+		return -EINVAL;
+
+	walk = alloc_walk(root, WALK_INSERT, key, key_size, val, val_size);
+	if (!walk)
+		return -ENOMEM;
+
+	ret = walk_tree(nfi, walk);
+	kfree(walk);
+
+	return ret;
+}
+
+/*
+ * Delete the item with the given key, returning -ENOENT if it doesn't
+ * exist.
+ */
+int ngnfs_tree_delete(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size)
+{
+	struct tree_walk *walk;
+	int ret;
+
+	if (key_size == 0 || key_size > NGNFS_BTREE_KEY_SIZE_MAX)
+		return -EINVAL;
+
+	walk = alloc_walk(root, WALK_DELETE, key, key_size, NULL, 0);
+	if (!walk)
+		return -ENOMEM;
+
+	ret = walk_tree(nfi, walk);
+	kfree(walk);
+
+	return ret;
+}
+
+/*
+ * Cursors start out positioned in an empty leaf so that next and prev
+ * return -ENOENT until the cursor is positioned with a seek.
+ */
+int ngnfs_tree_cursor_init(struct ngnfs_tree_cursor *curs, struct ngnfs_tree_root *root)
+{
+	curs->leaf = kmalloc(NGNFS_BLOCK_SIZE, GFP_NOFS);
+	if (!curs->leaf)
+		return -ENOMEM;
+
+	ngnfs_btree_init_block(curs->leaf, 0, 0);
+	curs->root = root;
+	curs->pos = 0;
+	curs->lower_size = 0;
+	curs->upper_size = 0;
+
+	return 0;
+}
+
+static int cursor_descend(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			  void *key, size_t key_size, bool after, bool leaf_after,
+			  bool last, bool reverse)
+{
+	struct tree_walk *walk;
+	int ret;
+
+	walk = alloc_walk(curs->root, WALK_CURSOR, NULL, key_size, NULL, 0);
+	if (!walk)
+		return -ENOMEM;
+
+	/* the key can be the cursor's bound which the walk overwrites */
+	if (key_size)
+		memcpy(walk->key_buf, key, key_size);
+	walk->key = walk->key_buf;
+	walk->curs = curs;
+	walk->after = after;
+	walk->leaf_after = leaf_after;
+	walk->last = last;
+	walk->reverse = reverse;
+
+	ret = walk_tree(nfi, walk);
+	kfree(walk);
+
+	return ret;
+}
+
+/*
+ * Position the cursor so that next returns the first item with a key
+ * greater than or equal to the given key and prev returns the last
+ * item with a lesser key.  A zero length key positions the cursor
+ * before all the items.
+ */
+int ngnfs_tree_cursor_seek(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t key_size)
+{
+	if (key_size > NGNFS_BTREE_KEY_SIZE_MAX)
+		return -EINVAL;
+
+	return cursor_descend(nfi, curs, key, key_size, false, false, false, false);
+}
+
+/*
+ * Position the cursor after all the items.
+ */
+int ngnfs_tree_cursor_seek_last(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs)
+{
+	return cursor_descend(nfi, curs, NULL, 0, false, false, true, true);
+}
+
+/*
+ * Copy the next item's key and value and advance the cursor past it.
+ * The key buffer must be able to hold the max key size.  Returns the
+ * number of value bytes copied or -ENOENT when there are no more items.
+ */
+int ngnfs_tree_cursor_next(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t *key_size, void *val, size_t val_size)
+{
+	int ret;
+
+	for (;;) {
+		if (curs->pos < le16_to_cpu(curs->leaf->nr_items)) {
+			ret = ngnfs_btree_item_at(curs->leaf, curs->pos, key, key_size,
+						  val, val_size);
+			if (ret >= 0)
+				curs->pos++;
+			break;
+		}
+
+		if (curs->upper_size == 0) {
+			ret = -ENOENT;
+			break;
+		}
+
+		/* descend to the first leaf after the upper bound */
+		ret = cursor_descend(nfi, curs, curs->upper, curs->upper_size,
+				     true, true, false, false);
+		if (ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Copy the previous item's key and value and move the cursor before
+ * it, otherwise just like next.
+ */
+int ngnfs_tree_cursor_prev(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t *key_size, void *val, size_t val_size)
+{
+	int ret;
+
+	for (;;) {
+		if (curs->pos > 0) {
+			ret = ngnfs_btree_item_at(curs->leaf, curs->pos - 1, key, key_size,
+						  val, val_size);
+			if (ret >= 0)
+				curs->pos--;
+			break;
+		}
+
+		if (curs->lower_size == 0) {
+			ret = -ENOENT;
+			break;
+		}
+
+		/* descend to the leaf containing the lower bound, after its items */
+		ret = cursor_descend(nfi, curs, curs->lower, curs->lower_size,
+				     false, true, false, true);
+		if (ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+void ngnfs_tree_cursor_destroy(struct ngnfs_tree_cursor *curs)
+{
+	kfree(curs->leaf);
+	curs->leaf = NULL;
+}
+
+/*
+ * Call the function for each item whose key is within the inclusive
+ * range, in key order.  Iteration stops if the function returns
+ * non-zero, and negative errors are returned.
+ */
+int ngnfs_tree_range(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		     void *start, size_t start_size, void *end, size_t end_size,
+		     ngnfs_tree_item_fn fn, void *arg)
+{
+	struct ngnfs_tree_cursor curs = { .leaf = NULL, };
+	size_t key_size;
+	void *key;
+	void *val;
+	int ret;
+
+	key = kmalloc(NGNFS_BTREE_KEY_SIZE_MAX, GFP_NOFS);
+	val = kmalloc(NGNFS_BTREE_VAL_SIZE_MAX, GFP_NOFS);
+	if (!key || !val) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = ngnfs_tree_cursor_init(&curs, root) ?:
+	      ngnfs_tree_cursor_seek(nfi, &curs, start, start_size);
+	while (ret == 0) {
+		ret = ngnfs_tree_cursor_next(nfi, &curs, key, &key_size, val,
+					     NGNFS_BTREE_VAL_SIZE_MAX);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			break;
+		}
+
+		if (ngnfs_btree_cmp_keys(key, key_size, end, end_size) > 0)
+			break;
+
+		ret = fn(key, key_size, val, ret, arg);
+	}
+
+	if (ret > 0)
+		ret = 0;
+out:
+	ngnfs_tree_cursor_destroy(&curs);
+	kfree(key);
+	kfree(val);
+	return ret;
+}
+
+static void commit_build(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			 struct ngnfs_block *bl, void *arg)
+{
+	memcpy(ngnfs_block_buf(bl), arg, NGNFS_BLOCK_SIZE);
+}
+
+static int write_built_block(struct ngnfs_fs_info *nfi, u64 bnr, struct ngnfs_btree_block *bt)
+{
+	struct ngnfs_transaction txn;
+	int ret;
+
+	bt->bnr = cpu_to_le64(bnr);
+
+	ngnfs_txn_init(&txn);
+	ret = ngnfs_txn_add_block(nfi, &txn, bnr, NBF_NEW | NBF_WRITE, NULL,
+				  commit_build, bt) ?:
+	      ngnfs_txn_execute(nfi, &txn);
+	ngnfs_txn_destroy(nfi, &txn);
+
+	return ret;
+}
+
+static struct ngnfs_btree_block *build_level(struct ngnfs_tree_builder *bld, int level)
+{
+	struct ngnfs_btree_block *bt;
+
+	if (level >= NGNFS_TREE_MAX_HEIGHT)
+		return ERR_PTR(-EIO);
+
+	if (level == bld->nr_levels) {
+		bt = kmalloc(NGNFS_BLOCK_SIZE, GFP_NOFS);
+		if (!bt)
+			return ERR_PTR(-ENOMEM);
+
+		memset(bt, 0, NGNFS_BLOCK_SIZE);
+		ngnfs_btree_init_block(bt, level, bld->root->block_flags);
+		bld->blocks[level] = bt;
+		bld->nr_levels++;
+	}
+
+	return bld->blocks[level];
+}
+
+/*
+ * Write the block at the given level to a newly allocated block and
+ * add its parent item to the next level, first writing the parent if
+ * it's full.
+ */
+static int flush_level(struct ngnfs_fs_info *nfi, struct ngnfs_tree_builder *bld, int level)
+{
+	struct ngnfs_tree_root *root = bld->root;
+	struct ngnfs_btree_block *bt = bld->blocks[level];
+	struct ngnfs_btree_block *parent;
+	u64 bnr;
+	int ret;
+
+	parent = build_level(bld, level + 1);
+	if (IS_ERR(parent))
+		return PTR_ERR(parent);
+
+	ret = root->alloc(nfi, root->arg, &bnr);
+	if (ret < 0)
+		return ret;
+
+	bt->bnr = cpu_to_le64(bnr);
+	ret = ngnfs_btree_append_child(parent, bt, bld->fill_pct);
+	if (ret == -ENOSPC) {
+		ret = flush_level(nfi, bld, level + 1) ?:
+		      ngnfs_btree_append_child(parent, bt, bld->fill_pct);
+	}
+
+	ret = ret ?: write_built_block(nfi, bnr, bt);
+	if (ret < 0) {
+		if (root->free)
+			root->free(nfi, root->arg, bnr);
+		return ret;
+	}
+
+	ngnfs_btree_init_block(bt, level, root->block_flags);
+	bld->flushed[level] = true;
+	return 0;
+}
+
+/*
+ * Prepare to build a new tree whose blocks are filled up to the given
+ * utilization.  The fill can't be less than the minimum utilization so
+ * that each parent references multiple children.
+ */
+int ngnfs_tree_build_init(struct ngnfs_tree_builder *bld, struct ngnfs_tree_root *root,
+			  u8 fill_pct)
+{
+	struct ngnfs_btree_block *bt;
+
+	memset(bld, 0, sizeof(struct ngnfs_tree_builder));
+
+	if (fill_pct < NGNFS_BTREE_MIN_USED_PCT || fill_pct > 100)
+		return -EINVAL;
+
+	bld->root = root;
+	bld->fill_pct = fill_pct;
+
+	bt = build_level(bld, 0);
+	return PTR_ERR_OR_ZERO(bt);
+}
+
+/*
+ * Add the next item to the tree, keys must be added in strictly
+ * increasing order.
+ */
+int ngnfs_tree_build_add(struct ngnfs_fs_info *nfi, struct ngnfs_tree_builder *bld,
+			 void *key, size_t key_size, void *val, size_t val_size)
+{
+	struct ngnfs_btree_block *bt = bld->blocks[0];
+	int ret;
+
+	if (bld->last_size &&
+	    ngnfs_btree_cmp_keys(key, key_size, bld->last, bld->last_size) <= 0)
+		return -EINVAL;
+
+	ret = ngnfs_btree_append(bt, key, key_size, val, val_size, bld->fill_pct);
+	if (ret == -ENOSPC) {
+		ret = flush_level(nfi, bld, 0) ?:
+		      ngnfs_btree_append(bt, key, key_size, val, val_size, bld->fill_pct);
+	}
+
+	if (ret == 0) {
+		memcpy(bld->last, key, key_size);
+		bld->last_size = key_size;
+	}
+
+	return ret;
+}
+
+/*
+ * Write the remaining partial blocks at each level, finishing with the
+ * root.  The last block at each level can be less than the minimum
+ * utilization and will be refilled by later deletions.  Blocks written
+ * before an error aren't freed.
+ */
+int ngnfs_tree_build_finish(struct ngnfs_fs_info *nfi, struct ngnfs_tree_builder *bld)
+{
+	int level;
+	int ret = 0;
+
+	for (level = 0; level < bld->nr_levels; level++) {
+		if (level == bld->nr_levels - 1 && !bld->flushed[level]) {
+			ret = write_built_block(nfi, bld->root->bnr, bld->blocks[level]);
+			break;
+		}
+
+		ret = flush_level(nfi, bld, level);
+		if (ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+void ngnfs_tree_build_destroy(struct ngnfs_tree_builder *bld)
+{
+	int i;
+
+	for (i = 0; i < bld->nr_levels; i++) {
+		kfree(bld->blocks[i]);
+		bld->blocks[i] = NULL;
+	}
+	bld->nr_levels = 0;
+}
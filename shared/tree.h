@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef NGNFS_SHARED_TREE_H
+#define NGNFS_SHARED_TREE_H
+
+#include "shared/format-block.h"
+#include "shared/fs_info.h"
+#include "shared/lk/types.h"
+
+/* far more levels than can be built from 64bit block numbers */
+#define NGNFS_TREE_MAX_HEIGHT	32
+
+/*
+ * Callers describe a tree by the fixed block number of its root and
+ * the functions that allocate and free the block numbers of the other
+ * blocks in the tree.  @free can be null if the caller doesn't track
+ * freed blocks.  @block_flags are given to new blocks, trees whose
+ * keys share long prefixes can set NGNFS_BTREE_FLAG_PREFIX and trees
+ * whose keys are all 8 or 16 bytes can set the key size flags.
+ *
+ * @append_split_pct is the percentage of a block's used item bytes that
+ * are moved to its new sibling when it's split by insertions after all
+ * the items in the tree.  It's 0 for the default, which leaves little room in
+ * blocks that sequential insertion won't revisit.
+ */
+struct ngnfs_tree_root {
+	u64 bnr;
+	int (*alloc)(struct ngnfs_fs_info *nfi, void *arg, u64 *bnr);
+	void (*free)(struct ngnfs_fs_info *nfi, void *arg, u64 bnr);
+	void *arg;
+	u8 block_flags;
+	u8 append_split_pct;
+};
+
+/*
+ * We expose the cursor type so callers can allocate it, but they only
+ * use it through the cursor functions.
+ */
+struct ngnfs_tree_cursor {
+	struct ngnfs_tree_root *root;
+	struct ngnfs_btree_block *leaf;
+	u16 pos;
+	u8 lower_size;
+	u8 upper_size;
+	u8 lower[NGNFS_BTREE_KEY_SIZE_MAX];
+	u8 upper[NGNFS_BTREE_KEY_SIZE_MAX];
+};
+
+int ngnfs_tree_create(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root);
+int ngnfs_tree_lookup(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size, void *val, size_t val_size);
+int ngnfs_tree_insert(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size, void *val, size_t val_size);
+int ngnfs_tree_delete(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		      void *key, size_t key_size);
+
+int ngnfs_tree_cursor_init(struct ngnfs_tree_cursor *curs, struct ngnfs_tree_root *root);
+int ngnfs_tree_cursor_seek(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t key_size);
+int ngnfs_tree_cursor_seek_last(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs);
+int ngnfs_tree_cursor_next(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t *key_size, void *val, size_t val_size);
+int ngnfs_tree_cursor_prev(struct ngnfs_fs_info *nfi, struct ngnfs_tree_cursor *curs,
+			   void *key, size_t *key_size, void *val, size_t val_size);
+void ngnfs_tree_cursor_destroy(struct ngnfs_tree_cursor *curs);
+
+typedef int (*ngnfs_tree_item_fn)(void *key, size_t key_size, void *val, size_t val_size,
+				  void *arg);
+int ngnfs_tree_range(struct ngnfs_fs_info *nfi, struct ngnfs_tree_root *root,
+		     void *start, size_t start_size, void *end, size_t end_size,
+		     ngnfs_tree_item_fn fn, void *arg);
+
+/*
+ * Builders are allocated by callers and only used through the build
+ * functions.
+ */
+struct ngnfs_tree_builder {
+	struct ngnfs_tree_root *root;
+	u8 fill_pct;
+	u8 nr_levels;
+	u8 last_size;
+	u8 last[NGNFS_BTREE_KEY_SIZE_MAX];
+	bool flushed[NGNFS_TREE_MAX_HEIGHT];
+	struct ngnfs_btree_block *blocks[NGNFS_TREE_MAX_HEIGHT];
+};
+
+int ngnfs_tree_build_init(struct ngnfs_tree_builder *bld, struct ngnfs_tree_root *root,
+			  u8 fill_pct);
+int ngnfs_tree_build_add(struct ngnfs_fs_info *nfi, struct ngnfs_tree_builder *bld,
+			 void *key, size_t key_size, void *val, size_t val_size);
+int ngnfs_tree_build_finish(struct ngnfs_fs_info *nfi, struct ngnfs_tree_builder *bld);
+void ngnfs_tree_build_destroy(struct ngnfs_tree_builder *bld);
+
+#endif
@@ -1,8 +1,10 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+#include "shared/lk/container_of.h"
 #include "shared/lk/err.h"
 #include "shared/lk/errno.h"
 #include "shared/lk/list.h"
+#include "shared/lk/rcupdate.h"
 
 #include "shared/block.h"
 #include "shared/txn.h"
@@ -18,23 +20,40 @@
  * acquisition rules.  They assemble the blocks as they see fit and we
  * ensure that we safely acquire access to them without deadlocking.
  *
+ * Blocks are acquired in phases.  We start reads for all the blocks
+ * that are known before waiting for any of them, then prepare each
+ * block as its read completes.  Blocks added by prepare have their
+ * reads started as soon as prepare returns so they join the reads that
+ * are already in flight.  A transaction's misses then cost about one
+ * round trip for each dependent prepare rather than one per block.
+ *
+ * Write references are exclusive so we acquire each phase's blocks in
+ * block number order.  Blocks in later phases were found through
+ * earlier blocks and can be out of order.  We don't wait for those, the
+ * txn returns -EAGAIN if they're contended and the caller resets and
+ * retries.  Read references are shared and don't block writers'
+ * prepare.  We check that the blocks read by multi-block or writing
+ * txns weren't modified before they commit and return -EAGAIN if they
+ * were.
+ *
+ * Transactions that only read can first be attempted without acquiring
+ * block references at all.  Prepare is called on copies of cached
+ * blocks and the attempt succeeds if none of the blocks were modified
+ * by the time all the blocks were prepared.  Cache misses and
+ * conflicting writes fall back to acquiring references.
+ *
  * The commit functions make changes to blocks once prepare has ensured
  * that all the changes will succeed.  This avoids unwinding in the face
  * of error.  We work with the block cache to ensure that the blocks are
- * written as an atomic unit as well.
+ * written as an atomic unit as well.  Async execution returns once the
+ * blocks are dirty and calls the caller back when they're written.
+ *
+ * Most transactions only have a few blocks so their tracking structs
+ * are stored in the txn.  Larger txns allocate more and keep them on a
+ * spare list across resets so that callers that reuse a txn only
+ * allocate as it first grows.
  */
 
-struct ngnfs_transaction_block {
-	struct list_head head;
-	struct list_head write_head;
-	struct ngnfs_block *bl;
-	u64 bnr;
-	nbf_t nbf;
-	txn_prepare_fn prepare;
-	txn_commit_fn commit;
-	void *arg;
-};
-
 /* off = bl - head -> bl = head + off */
 #define WRITE_HEAD_BL_OFFSET \
 	(ssize_t)(offsetof(struct ngnfs_transaction_block, bl) - \
@@ -44,6 +63,42 @@ void ngnfs_txn_init(struct ngnfs_transaction *txn)
 {
 	INIT_LIST_HEAD(&txn->blocks);
 	INIT_LIST_HEAD(&txn->writes);
+	INIT_LIST_HEAD(&txn->spare);
+	txn->nr_inline = 0;
+}
+
+static bool is_inline(struct ngnfs_transaction *txn, struct ngnfs_transaction_block *tblk)
+{
+	return tblk >= &txn->inline_blocks[0] &&
+	       tblk < &txn->inline_blocks[NGNFS_TXN_INLINE_BLOCKS];
+}
+
+static struct ngnfs_transaction_block *alloc_tblk(struct ngnfs_transaction *txn)
+{
+	struct ngnfs_transaction_block *tblk;
+
+	if (txn->nr_inline < NGNFS_TXN_INLINE_BLOCKS)
+		return &txn->inline_blocks[txn->nr_inline++];
+
+	tblk = list_first_entry_or_null(&txn->spare, struct ngnfs_transaction_block, head);
+	if (tblk) {
+		list_del(&tblk->head);
+		return tblk;
+	}
+
+	return kmalloc(sizeof(struct ngnfs_transaction_block), GFP_NOFS);
+}
+
+/*
+ * Blocks are freed in the reverse order that they were allocated so
+ * freeing an inline block always frees the most recently used slot.
+ */
+static void free_tblk(struct ngnfs_transaction *txn, struct ngnfs_transaction_block *tblk)
+{
+	if (is_inline(txn, tblk))
+		txn->nr_inline--;
+	else
+		list_add(&tblk->head, &txn->spare);
 }
 
 /*
@@ -57,7 +112,7 @@ int ngnfs_txn_add_block(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn
 	struct ngnfs_transaction_block *tblk;
 	int ret;
 
-	tblk = kmalloc(sizeof(struct ngnfs_transaction_block), GFP_NOFS);
+	tblk = alloc_tblk(txn);
 	if (!tblk) {
 		ret = -ENOMEM;
 		goto out;
@@ -78,31 +133,138 @@ out:
 }
 
 /*
- * Callers are responsible for tearing down the txn.
+ * Start reads for the blocks after the given block, which can be the
+ * list head, and return the last block in the txn.  New blocks aren't
+ * read.
  */
-int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
+static struct ngnfs_transaction_block *start_reads(struct ngnfs_fs_info *nfi,
+						  struct ngnfs_transaction *txn,
+						  struct ngnfs_transaction_block *tblk)
+{
+	list_for_each_entry_continue(tblk, &txn->blocks, head) {
+		if (!(tblk->nbf & NBF_NEW))
+			ngnfs_block_prefetch(nfi, tblk->bnr);
+	}
+
+	return list_last_entry(&txn->blocks, struct ngnfs_transaction_block, head);
+}
+
+/*
+ * Acquire the blocks after @last through @end in block number order.
+ * Write references below ones we already hold would invert the order
+ * so we don't wait for them.
+ */
+static int acquire_blocks(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			  struct ngnfs_transaction_block *last,
+			  struct ngnfs_transaction_block *end,
+			  struct ngnfs_transaction_block **max_write)
 {
 	struct ngnfs_transaction_block *tblk;
+	struct ngnfs_transaction_block *next;
 	struct ngnfs_block *bl;
-	int ret = 0;
+	nbf_t nbf;
+
+	for (;;) {
+		next = NULL;
+		tblk = last;
+		list_for_each_entry_continue(tblk, &txn->blocks, head) {
+			if (!tblk->bl && (!next || tblk->bnr < next->bnr))
+				next = tblk;
+			if (tblk == end)
+				break;
+		}
+		if (!next)
+			return 0;
+
+		nbf = next->nbf;
+		if ((nbf & NBF_WRITE) && *max_write && next->bnr <= (*max_write)->bnr)
+			nbf |= NBF_NOWAIT;
+
+		bl = ngnfs_block_get(nfi, next->bnr, nbf);
+		if (IS_ERR(bl))
+			return PTR_ERR(bl);
+
+		next->bl = bl;
+		if ((nbf & NBF_WRITE) && !(nbf & NBF_NOWAIT))
+			*max_write = next;
+	}
+}
+
+/*
+ * Returns true if none of the blocks that were read up to and including
+ * @stop have been modified since they were prepared.
+ */
+static bool reads_valid(struct ngnfs_transaction *txn, struct ngnfs_transaction_block *stop)
+{
+	struct ngnfs_transaction_block *tblk;
 
 	list_for_each_entry(tblk, &txn->blocks, head) {
-		bl = ngnfs_block_get(nfi, tblk->bnr, tblk->nbf);
-		if (IS_ERR(bl)) {
-			ret = PTR_ERR(bl);
+		if (!(tblk->nbf & NBF_WRITE) && !ngnfs_block_read_valid(tblk->bl, tblk->seq))
+			return false;
+		if (tblk == stop)
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * The notify, if given, is attached to the dirty blocks or called
+ * immediately if the txn didn't write, but only if we return success.
+ */
+static int execute_notify(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			  struct ngnfs_block_notify *notify)
+{
+	struct ngnfs_transaction_block *tblk;
+	struct ngnfs_transaction_block *read = NULL;
+	struct ngnfs_transaction_block *last = NULL;
+	struct ngnfs_transaction_block *max_write = NULL;
+	struct ngnfs_transaction_block *end;
+	int nr_read = 0;
+	int ret = 0;
+
+	read = list_prepare_entry(read, &txn->blocks, head);
+	read = start_reads(nfi, txn, read);
+
+	/* each phase is the blocks added by the previous phase's prepares */
+	last = list_prepare_entry(last, &txn->blocks, head);
+	while (!list_is_last(&last->head, &txn->blocks)) {
+		end = list_last_entry(&txn->blocks, struct ngnfs_transaction_block, head);
+
+		ret = acquire_blocks(nfi, txn, last, end, &max_write);
+		if (ret < 0)
 			goto out;
-		}
 
-		tblk->bl = bl;
+		tblk = last;
+		list_for_each_entry_continue(tblk, &txn->blocks, head) {
+			if (!(tblk->nbf & NBF_WRITE)) {
+				tblk->seq = ngnfs_block_read_begin(tblk->bl);
+				nr_read++;
+			}
 
-		if (tblk->prepare) {
-			ret = tblk->prepare(nfi, txn, tblk->bl, tblk->arg);
-			if (ret < 0)
+			if (tblk->prepare)
+				ret = tblk->prepare(nfi, txn, tblk->bl, tblk->arg);
+
+			if (!(tblk->nbf & NBF_WRITE))
+				ngnfs_block_read_end(tblk->bl);
+			if (ret < 0) {
+				/* errors from inconsistent reads are meaningless */
+				if (nr_read > 1 && !reads_valid(txn, tblk))
+					ret = -EAGAIN;
 				goto out;
+			}
+
+			/* read blocks that prepare added while we prepare the rest */
+			read = start_reads(nfi, txn, read);
+
+			if (tblk->nbf & NBF_WRITE)
+				list_add_tail(&tblk->write_head, &txn->writes);
+
+			if (tblk == end)
+				break;
 		}
 
-		if (tblk->nbf & NBF_WRITE)
-			list_add_tail(&tblk->write_head, &txn->writes);
+		last = end;
 	}
 
 	if (!list_empty(&txn->writes)) {
@@ -110,35 +272,207 @@ int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
 		if (ret < 0)
 			goto out;
 
+		/* blocks are dirty but unmodified if reads changed */
+		if (nr_read > 0 && !reads_valid(txn, NULL)) {
+			ngnfs_block_dirty_end(nfi, &txn->writes, WRITE_HEAD_BL_OFFSET);
+			ret = -EAGAIN;
+			goto out;
+		}
+
 		list_for_each_entry(tblk, &txn->writes, write_head) {
 			if (tblk->commit)
 				tblk->commit(nfi, txn, tblk->bl, tblk->arg);
 		}
 
-		ngnfs_block_dirty_end(nfi, &txn->writes, WRITE_HEAD_BL_OFFSET);
+		ngnfs_block_dirty_end_notify(nfi, &txn->writes, WRITE_HEAD_BL_OFFSET, notify);
+	} else {
+		if (nr_read > 1 && !reads_valid(txn, NULL)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		if (notify)
+			notify->fn(nfi, notify, 0);
+	}
+
+out:
+	return ret;
+}
+
+/*
+ * Callers are responsible for tearing down the txn.  -EAGAIN is
+ * returned if the txn conflicted with other txns, callers reset the
+ * txn and try again.
+ */
+int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
+{
+	return execute_notify(nfi, txn, NULL);
+}
+
+struct txn_async {
+	struct ngnfs_block_notify notify;
+	txn_durable_fn fn;
+	void *arg;
+};
+
+static void txn_async_written(struct ngnfs_fs_info *nfi, struct ngnfs_block_notify *notify,
+			      int err)
+{
+	struct txn_async *async = container_of(notify, struct txn_async, notify);
+
+	async->fn(nfi, async->arg, err);
+	kfree(async);
+}
+
+/*
+ * Execute a transaction without waiting for its writes to be durable.
+ * @fn is called with @arg once the blocks written by the txn have been
+ * written, which can happen before this returns.  It's only called if
+ * this returns success and is called from writeback completion so it
+ * must not block.
+ *
+ * Dirty blocks are only written once enough are dirty or a sync is
+ * requested.  Callers that want completion soon can call
+ * ngnfs_block_start_sync() after submitting a group of transactions.
+ * Callers are responsible for tearing down the txn.
+ */
+int ngnfs_txn_execute_async(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			    txn_durable_fn fn, void *arg)
+{
+	struct txn_async *async;
+	int ret;
+
+	async = kmalloc(sizeof(struct txn_async), GFP_NOFS);
+	if (!async) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
+	async->notify.fn = txn_async_written;
+	async->fn = fn;
+	async->arg = arg;
+
+	ret = execute_notify(nfi, txn, &async->notify);
+	if (ret < 0)
+		kfree(async);
 out:
 	return ret;
 }
 
+/*
+ * Attempt to execute a read-only transaction by preparing snapshot
+ * copies of cached blocks.  -EAGAIN is returned if any block can't be
+ * used, in which case the blocks added by prepare during the attempt
+ * have been removed.  Prepare errors are only returned if they were
+ * seen on a consistent view of the blocks.
+ */
+static int execute_optimistic(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
+{
+	struct list_head *last = txn->blocks.prev;
+	struct ngnfs_transaction_block *tblk;
+	struct ngnfs_block *bl;
+	unsigned int nr = 0;
+	int ret = 0;
+
+	rcu_read_lock();
+
+	list_for_each_entry(tblk, &txn->blocks, head) {
+		if (tblk->nbf != NBF_READ) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		bl = ngnfs_block_snapshot(nfi, tblk->bnr, nr);
+		if (IS_ERR(bl)) {
+			ret = PTR_ERR(bl);
+			break;
+		}
+		nr++;
+
+		if (tblk->prepare) {
+			ret = tblk->prepare(nfi, txn, bl, tblk->arg);
+			if (ret < 0)
+				break;
+		}
+	}
+
+	/* prepare saw torn or stale blocks, its results are meaningless */
+	if (ret != -EAGAIN && !ngnfs_block_snapshots_valid(nr))
+		ret = -EAGAIN;
+
+	rcu_read_unlock();
+
+	if (ret == -EAGAIN) {
+		while (txn->blocks.prev != last) {
+			tblk = list_last_entry(&txn->blocks, struct ngnfs_transaction_block, head);
+			list_del(&tblk->head);
+			free_tblk(txn, tblk);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Execute a transaction whose blocks are all read.  This first tries to
+ * prepare copies of cached blocks before falling back to acquiring
+ * references, so prepare can be called more than once for each block
+ * and must not keep the block after it returns.  Callers are
+ * responsible for tearing down the txn.
+ */
+int ngnfs_txn_execute_read(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
+{
+	int ret;
+
+	ret = execute_optimistic(nfi, txn);
+	if (ret == -EAGAIN)
+		ret = ngnfs_txn_execute(nfi, txn);
+
+	return ret;
+}
+
+/*
+ * Release the blocks in a transaction so that it can be used for
+ * another operation.  This can be called for any state of an
+ * initialized transaction, including repeatedly.  Allocated block
+ * tracking is kept for the next use until the txn is destroyed.
+ */
+void ngnfs_txn_reset(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
+{
+	struct ngnfs_transaction_block *tblk;
+	struct ngnfs_transaction_block *tmp;
+
+	list_for_each_entry_safe(tblk, tmp, &txn->blocks, head) {
+		if (!list_empty(&tblk->write_head))
+			list_del_init(&tblk->write_head);
+		list_del_init(&tblk->head);
+		if (tblk->nbf & NBF_WRITE)
+			ngnfs_block_put_write(tblk->bl);
+		else
+			ngnfs_block_put(tblk->bl);
+		if (!is_inline(txn, tblk))
+			list_add(&tblk->head, &txn->spare);
+	}
+
+	txn->nr_inline = 0;
+}
+
 /*
  * Tear down a transaction.  The transaction must have been initialized
  * and this can be called for any state of the transaction, including
  * repeatedly.  It is a nop on a newly initialized or previously
- * destroyed txn.  The caller is responsible for the allocation of the
- * txn struct itself.
+ * destroyed txn and a destroyed txn can be used again.  The caller is
+ * responsible for the allocation of the txn struct itself.
  */
 void ngnfs_txn_destroy(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn)
 {
 	struct ngnfs_transaction_block *tblk;
 	struct ngnfs_transaction_block *tmp;
 
-	list_for_each_entry_safe(tblk, tmp, &txn->blocks, head) {
-		if (!list_empty(&tblk->write_head))
-			list_del_init(&tblk->write_head);
+	ngnfs_txn_reset(nfi, txn);
+
+	list_for_each_entry_safe(tblk, tmp, &txn->spare, head) {
 		list_del_init(&tblk->head);
-		ngnfs_block_put(tblk->bl);
 		kfree(tblk);
 	}
 }
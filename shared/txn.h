@@ -8,18 +8,10 @@ struct ngnfs_transaction;
 #include "shared/lk/list.h"
 
 /*
- * We expose the type so callers can allocate and initialize it, but they don't
- * use it directly.
+ * Transactions store this many blocks in the txn struct itself before
+ * allocating more.
  */
-struct ngnfs_transaction {
-	struct list_head blocks;
-	struct list_head writes;
-};
-
-#define INIT_NGNFS_TXN(txn) {				\
-	.blocks = LIST_HEAD_INIT(txn.blocks),		\
-	.writes = LIST_HEAD_INIT(txn.writes),		\
-}
+#define NGNFS_TXN_INLINE_BLOCKS	4
 
 typedef int (*txn_prepare_fn)(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
 			      struct ngnfs_block *bl, void *arg);
@@ -29,11 +21,50 @@ typedef int (*txn_prepare_fn)(struct ngnfs_fs_info *nfi, struct ngnfs_transactio
  */
 typedef void (*txn_commit_fn)(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
 			      struct ngnfs_block *bl, void *arg);
+/*
+ * Durable functions are called once an async txn's writes are
+ * persistent, or with an error if they couldn't be written.
+ */
+typedef void (*txn_durable_fn)(struct ngnfs_fs_info *nfi, void *arg, int err);
+
+/*
+ * We expose the types so callers can allocate and initialize them, but they don't
+ * use them directly.
+ */
+struct ngnfs_transaction_block {
+	struct list_head head;
+	struct list_head write_head;
+	struct ngnfs_block *bl;
+	u64 bnr;
+	nbf_t nbf;
+	txn_prepare_fn prepare;
+	txn_commit_fn commit;
+	void *arg;
+	unsigned long seq;
+};
+
+struct ngnfs_transaction {
+	struct list_head blocks;
+	struct list_head writes;
+	struct list_head spare;
+	unsigned int nr_inline;
+	struct ngnfs_transaction_block inline_blocks[NGNFS_TXN_INLINE_BLOCKS];
+};
+
+#define INIT_NGNFS_TXN(txn) {				\
+	.blocks = LIST_HEAD_INIT(txn.blocks),		\
+	.writes = LIST_HEAD_INIT(txn.writes),		\
+	.spare = LIST_HEAD_INIT(txn.spare),		\
+}
 
 void ngnfs_txn_init(struct ngnfs_transaction *txn);
 int ngnfs_txn_add_block(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn, u64 bnr,
 			nbf_t nbf, txn_prepare_fn prepare, txn_commit_fn commit, void *arg);
 int ngnfs_txn_execute(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn);
+int ngnfs_txn_execute_async(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn,
+			    txn_durable_fn fn, void *arg);
+int ngnfs_txn_execute_read(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn);
+void ngnfs_txn_reset(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn);
 void ngnfs_txn_destroy(struct ngnfs_fs_info *nfi, struct ngnfs_transaction *txn);
 
 #endif